@@ -0,0 +1,64 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Sample format conversion and decimation
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* output formats, the values are used on the wire by fx2adc_tcp */
+typedef enum {
+	CONVERT_U8 = 0,		/* unsigned 8 bit, as delivered by the ADC */
+	CONVERT_S8,		/* signed 8 bit */
+	CONVERT_S16,		/* signed 16 bit, little endian */
+	CONVERT_F32,		/* float, little endian, -1.0 .. 1.0 */
+	CONVERT_CS8,		/* complex signed 8 bit, I/Q interleaved */
+	CONVERT_CF32,		/* complex float, I/Q interleaved */
+	CONVERT_NUM_FORMATS
+} convert_format_t;
+
+#define CONVERT_MAX_DECIMATION	256
+
+typedef struct convert convert_t;
+
+/*
+ * Real formats are converted from the ADC samples directly. Complex
+ * formats are shifted down by a quarter of the sample rate first, so that
+ * the band from 0 to fs/2 ends up centered at 0 Hz. Whenever the
+ * decimation is larger than 1 or the output is complex, a Hamming
+ * windowed FIR low pass removes everything outside of the output band.
+ */
+convert_t *convert_new(convert_format_t format, unsigned int decim);
+void convert_free(convert_t *cv);
+
+/* bytes per output sample */
+unsigned int convert_sample_size(convert_format_t format);
+
+/* number of input samples the output lags behind, 0 without filter */
+unsigned int convert_delay(convert_t *cv);
+
+/* maximum number of output bytes for len input bytes */
+size_t convert_max_out(convert_t *cv, size_t len);
+
+/*
+ * Convert len samples starting with sample index first into out, returns
+ * the number of bytes written. The index of the first output sample is
+ * stored in out_sample, output sample k corresponds to input sample k *
+ * decim: the delay of the filter is compensated, so the outputs lag the
+ * input by convert_delay() samples. The filter state is reset if first
+ * doesn't follow the previous call.
+ */
+size_t convert_run(convert_t *cv, const uint8_t *in, size_t len, uint64_t first,
+		   void *out, uint64_t *out_sample);
+
+/* split len bytes of interleaved CH1 and CH2 samples into len / 2 bytes
+ * each, as delivered in dual-channel mode */
+void convert_deinterleave(const uint8_t *in, size_t len, uint8_t *ch1, uint8_t *ch2);
+
+#endif
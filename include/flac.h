@@ -0,0 +1,43 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * FLAC encoder for 8 bit samples
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#ifndef _FLAC_H_
+#define _FLAC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* samples per channel of every frame but the last one of a stream */
+#define FLAC_BLOCK_SIZE		4096
+
+/* length of the stream header, the marker and the STREAMINFO block */
+#define FLAC_HEADER_SIZE	42
+
+/*
+ * Write the stream header. The rate is stored in kHz, the field only
+ * holds up to 1 MHz. A total of 0 means unknown, the header can be
+ * rewritten with the real number once the stream is complete.
+ */
+size_t flac_header(uint8_t *out, uint32_t rate, unsigned int channels,
+		   uint64_t total);
+
+/* maximum number of bytes flac_encode() writes for len input bytes */
+size_t flac_max_size(size_t len, unsigned int channels);
+
+/*
+ * Encode len bytes of unsigned 8 bit samples, interleaved if there are
+ * two channels, into frames of FLAC_BLOCK_SIZE. The first frame gets the
+ * given frame number and len must be a multiple of the block size unless
+ * the frames end the stream. The frames don't depend on each other, so
+ * parts of a stream can be encoded in parallel and concatenated. Returns
+ * the number of bytes written to out.
+ */
+size_t flac_encode(const uint8_t *in, size_t len, unsigned int channels,
+		   uint64_t frame, uint8_t *out);
+
+#endif
@@ -112,6 +112,8 @@ FX2ADC_API int fx2adc_get_vdiv(fx2adc_dev_t *dev);
  * \param samp_rate the sample rate to be set
  * \param ext_clock if true, use the IFCLK input insteafd of internal clock source
  *		    if a Si5351 is connected, it will be configured
+ *		    if false, the external clock input and the Si5351 output
+ *		    are switched off again
  * \return 0 on success, -EINVAL on invalid rate
  */
 FX2ADC_API int fx2adc_set_sample_rate(fx2adc_dev_t *dev, uint32_t rate, bool ext_clock);
@@ -124,6 +126,34 @@ FX2ADC_API int fx2adc_set_sample_rate(fx2adc_dev_t *dev, uint32_t rate, bool ext
  */
 FX2ADC_API uint32_t fx2adc_get_sample_rate(fx2adc_dev_t *dev);
 
+/*!
+ * Set the number of channels to sample. In dual-channel mode the samples
+ * of both channels are interleaved, starting with channel 1. This can be
+ * changed while streaming.
+ *
+ * \param dev the device handle given by fx2adc_open()
+ * \param channels 1 or 2
+ * \return 0 on success, -EINVAL on invalid channel count
+ */
+FX2ADC_API int fx2adc_set_channels(fx2adc_dev_t *dev, int channels);
+
+/*!
+ * Get the number of channels the device is configured to sample.
+ *
+ * \param dev the device handle given by fx2adc_open()
+ * \return 0 on error, number of channels otherwise
+ */
+FX2ADC_API int fx2adc_get_channels(fx2adc_dev_t *dev);
+
+/*!
+ * Check whether a Si5351 clock generator drives the external clock input,
+ * so that fx2adc_set_sample_rate() can set any rate with ext_clock.
+ *
+ * \param dev the device handle given by fx2adc_open()
+ * \return 1 if present, 0 if not
+ */
+FX2ADC_API int fx2adc_has_clockgen(fx2adc_dev_t *dev);
+
 /* streaming functions */
 
 typedef void(*fx2adc_read_cb_t)(unsigned char *buf, uint32_t len, void *ctx);
@@ -148,6 +178,29 @@ FX2ADC_API int fx2adc_read(fx2adc_dev_t *dev,
 				 uint32_t buf_num,
 				 uint32_t buf_len);
 
+typedef struct fx2adc_xfer_stats {
+	uint64_t completed;	/* transfers passed to the callback */
+	uint64_t bytes;		/* in them */
+	uint64_t short_xfers;	/* completed with less than buf_len bytes */
+	uint64_t errors;	/* LIBUSB_TRANSFER_ERROR */
+	uint64_t timeouts;	/* LIBUSB_TRANSFER_TIMED_OUT */
+	uint64_t stalls;	/* LIBUSB_TRANSFER_STALL */
+	uint64_t overflows;	/* LIBUSB_TRANSFER_OVERFLOW */
+	uint64_t resubmit_failed; /* transfers that could not be queued again */
+	bool dev_lost;		/* the device is gone, or too many errors */
+} fx2adc_xfer_stats_t;
+
+/*!
+ * Get the transfer counters of the running or the last fx2adc_read(), they
+ * are reset when it starts. Can be called from any thread, the counters
+ * are not read atomically as a whole.
+ *
+ * \param dev the device handle given by fx2adc_open()
+ * \param stats filled with the counters
+ * \return 0 on success
+ */
+FX2ADC_API int fx2adc_get_xfer_stats(fx2adc_dev_t *dev, fx2adc_xfer_stats_t *stats);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -0,0 +1,195 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Layout of the files fx2adc_file writes with -m, for live readers
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FX2ADC_MMAP_H
+#define __FX2ADC_MMAP_H
+
+/*
+ * With -m, fx2adc_file writes every file through a memory mapping. The
+ * file starts with struct fx2adc_mmap_header, the samples follow at
+ * data_offset. The file is grown ahead of the samples, so its size says
+ * nothing, only the first committed bytes of the data are valid. The
+ * writer stores the samples before it updates committed, and increments
+ * commit_futex after every update, readers can sleep on it. Once the
+ * file is complete, FX2ADC_MMAP_CLOSED is set and the file is cut to
+ * its real length.
+ *
+ * A reader maps the same file and gets the samples straight from the
+ * page cache, the functions below implement that (Linux only):
+ *
+ *	struct fx2adc_mmap_reader rd;
+ *	const unsigned char *data;
+ *	uint64_t done = 0, committed;
+ *
+ *	fx2adc_mmap_attach(&rd, "capture.bin");
+ *	while ((committed = fx2adc_mmap_wait(&rd, done, 1000)) > done ||
+ *	       !fx2adc_mmap_closed(&rd)) {
+ *		process(rd.data + done, committed - done);
+ *		done = committed;
+ *	}
+ *	fx2adc_mmap_detach(&rd);
+ */
+
+#include <stdint.h>
+
+#define FX2ADC_MMAP_MAGIC	0x4658324d	/* "FX2M" */
+#define FX2ADC_MMAP_VERSION	1
+
+/* the data starts at a multiple of every common page size */
+#define FX2ADC_MMAP_DATA_OFFSET	65536
+
+/* header flags */
+#define FX2ADC_MMAP_CLOSED	(1 << 0)
+
+struct fx2adc_mmap_header {
+	uint32_t magic;		/* written last, 0 while the file is set up */
+	uint32_t version;
+	uint64_t data_offset;
+	uint32_t sample_rate;
+	uint32_t flags;
+	uint64_t start_ns;	/* ns since the epoch of the capture start */
+	uint64_t committed;	/* bytes of samples that are valid */
+	uint32_t commit_futex;	/* incremented for every update of committed */
+	uint32_t reserved;
+};
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* the data is mapped in steps of this, beyond the end of the file */
+#define FX2ADC_MMAP_READER_STEP	(1ULL << 30)
+
+struct fx2adc_mmap_reader {
+	int fd;
+	const struct fx2adc_mmap_header *hdr;
+	const unsigned char *data;	/* the samples */
+	uint64_t mapped;		/* bytes of data mapped */
+};
+
+static inline int fx2adc_mmap_attach(struct fx2adc_mmap_reader *rd, const char *path)
+{
+	const struct fx2adc_mmap_header *hdr;
+
+	rd->hdr = NULL;
+	rd->data = NULL;
+	rd->mapped = 0;
+
+	rd->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (rd->fd < 0)
+		return -1;
+
+	hdr = mmap(NULL, FX2ADC_MMAP_DATA_OFFSET, PROT_READ, MAP_SHARED, rd->fd, 0);
+	if (hdr == MAP_FAILED)
+		goto err;
+
+	/* the file may have just been created, try again later */
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != FX2ADC_MMAP_MAGIC ||
+	    hdr->version != FX2ADC_MMAP_VERSION ||
+	    hdr->data_offset != FX2ADC_MMAP_DATA_OFFSET) {
+		munmap((void *)hdr, FX2ADC_MMAP_DATA_OFFSET);
+		errno = EAGAIN;
+		goto err;
+	}
+
+	rd->hdr = hdr;
+
+	return 0;
+err:
+	close(rd->fd);
+	return -1;
+}
+
+static inline void fx2adc_mmap_detach(struct fx2adc_mmap_reader *rd)
+{
+	if (rd->data)
+		munmap((void *)rd->data, rd->mapped);
+	if (rd->hdr)
+		munmap((void *)rd->hdr, FX2ADC_MMAP_DATA_OFFSET);
+	rd->data = NULL;
+	rd->hdr = NULL;
+	close(rd->fd);
+}
+
+static inline int fx2adc_mmap_closed(struct fx2adc_mmap_reader *rd)
+{
+	return !!(__atomic_load_n(&rd->hdr->flags, __ATOMIC_ACQUIRE) & FX2ADC_MMAP_CLOSED);
+}
+
+/*
+ * Wait until more than done bytes are committed, or the timeout expires,
+ * and return the committed length. All of it can be read from rd->data,
+ * which may move with every call.
+ */
+static inline uint64_t fx2adc_mmap_wait(struct fx2adc_mmap_reader *rd, uint64_t done,
+					int timeout_ms)
+{
+	const struct fx2adc_mmap_header *hdr = rd->hdr;
+	struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	uint64_t committed, len;
+	uint32_t futex;
+	void *data;
+
+	while (1) {
+		futex = __atomic_load_n(&hdr->commit_futex, __ATOMIC_ACQUIRE);
+		committed = __atomic_load_n(&hdr->committed, __ATOMIC_ACQUIRE);
+
+		if (committed > done)
+			break;
+
+		/* the last commit comes before the flag */
+		if (fx2adc_mmap_closed(rd)) {
+			committed = __atomic_load_n(&hdr->committed, __ATOMIC_ACQUIRE);
+			break;
+		}
+
+		if (syscall(SYS_futex, &hdr->commit_futex, FUTEX_WAIT, futex,
+			    timeout_ms < 0 ? NULL : &ts, NULL, 0) &&
+		    errno == ETIMEDOUT)
+			break;
+	}
+
+	/* pages beyond the end of the file can be mapped, just not read */
+	if (committed > rd->mapped) {
+		len = (committed + FX2ADC_MMAP_READER_STEP - 1) /
+		      FX2ADC_MMAP_READER_STEP * FX2ADC_MMAP_READER_STEP;
+		data = mmap(NULL, len, PROT_READ, MAP_SHARED, rd->fd, hdr->data_offset);
+		if (data == MAP_FAILED)
+			return done;
+		if (rd->data)
+			munmap((void *)rd->data, rd->mapped);
+		rd->data = data;
+		rd->mapped = len;
+	}
+
+	return committed;
+}
+
+#endif /* __linux__ */
+
+#endif /* __FX2ADC_MMAP_H */
@@ -0,0 +1,333 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Shared memory transport of fx2adc_tcp for consumers on the same host
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FX2ADC_SHM_H
+#define __FX2ADC_SHM_H
+
+/*
+ * When started with -L <path>, fx2adc_tcp keeps its sample ring in a memfd
+ * and listens on a Unix domain socket at <path>. A reader connects to it
+ * and receives a struct fx2adc_shm_hello together with two file
+ * descriptors via SCM_RIGHTS: the ring, opened read-only, and a small
+ * memfd of its own holding its struct fx2adc_shm_reader, the only memory
+ * a reader can write to. The ring starts with struct fx2adc_shm_header,
+ * followed by the slot descriptors, the slot data starts at data_offset.
+ *
+ * The server never waits for readers: every slot is published with a
+ * sequence number, a reader that falls behind by more than num_slots - 1
+ * slots notices that the sequence number of its slot has changed and
+ * skips ahead. Readers wait for new data with a futex on head_futex and
+ * announce that in the waiters field of their cursor.
+ *
+ * The functions below implement a complete reader (Linux only):
+ *
+ *	struct fx2adc_shm_reader_ctx rd;
+ *	const unsigned char *buf;
+ *	uint32_t len;
+ *	uint64_t sample;
+ *
+ *	fx2adc_shm_attach(&rd, "/tmp/fx2adc.sock");
+ *	while ((buf = fx2adc_shm_next(&rd, &len, &sample, 1000))) {
+ *		process(buf, len);
+ *		if (fx2adc_shm_release(&rd) < 0)
+ *			; // the slot was overwritten while processing it
+ *	}
+ *	fx2adc_shm_detach(&rd);
+ */
+
+#include <stdint.h>
+
+#define FX2ADC_SHM_MAGIC	0x46583253	/* "FX2S" */
+#define FX2ADC_SHM_VERSION	2
+#define FX2ADC_SHM_MAX_READERS	16
+
+/* sequence number of a slot that is currently being written */
+#define FX2ADC_SHM_SEQ_WRITING	UINT64_MAX
+
+/* header flags */
+#define FX2ADC_SHM_CLOSED	(1 << 0)
+
+/* slot flags */
+#define FX2ADC_SHM_SLOT_DUAL	(1 << 2)	/* CH1 and CH2 interleaved */
+#define FX2ADC_SHM_SLOT_DISCONT	(1 << 4)	/* first slot after the channel mode
+						 * changed, resynchronise here */
+
+struct fx2adc_shm_slot {
+	uint64_t seq;		/* sequence number of the data in the slot */
+	uint64_t sample;	/* index of the first sample */
+	uint64_t timestamp;	/* ns since the epoch of the first sample */
+	uint32_t len;		/* valid bytes in the slot */
+	uint32_t flags;		/* FX2ADC_SHM_SLOT_* */
+};
+
+/* in the memfd of each reader */
+struct fx2adc_shm_reader {
+	uint32_t waiters;	/* threads of the reader waiting on head_futex */
+	uint32_t reserved;
+	uint64_t seq;		/* next slot the reader will read */
+	uint64_t dropped;	/* slots the reader had to skip */
+};
+
+struct fx2adc_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t slot_size;
+	uint64_t data_offset;	/* page aligned offset of the slot data */
+	uint64_t total_size;
+	uint32_t sample_rate;
+	uint32_t flags;
+	uint32_t head_futex;	/* incremented for every published slot */
+	uint32_t reserved;
+	uint64_t head;		/* sequence number of the next slot */
+	struct fx2adc_shm_slot slots[];
+};
+
+/* sent by the server to every new reader, along with the two fds */
+struct fx2adc_shm_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t reader;	/* number of the reader, for messages */
+	uint32_t reserved;
+};
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+struct fx2adc_shm_reader_ctx {
+	int sock;
+	const struct fx2adc_shm_header *hdr;
+	const unsigned char *data;
+	struct fx2adc_shm_reader *self;
+	uint64_t seq;		/* slot returned by the last fx2adc_shm_next() */
+	uint64_t dropped;
+	uint32_t flags;		/* of that slot */
+};
+
+static inline int fx2adc_shm_attach(struct fx2adc_shm_reader_ctx *rd, const char *path)
+{
+	struct sockaddr_un sa;
+	struct fx2adc_shm_hello hello;
+	struct fx2adc_shm_header info;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int fds[2] = { -1, -1 };
+	void *hdr;
+
+	memset(rd, 0, sizeof(*rd));
+
+	rd->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (rd->sock < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+	if (connect(rd->sock, (struct sockaddr *)&sa, sizeof(sa)))
+		goto err;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(rd->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) ||
+	    hello.magic != FX2ADC_SHM_MAGIC || hello.version != FX2ADC_SHM_VERSION ||
+	    hello.reader >= FX2ADC_SHM_MAX_READERS)
+		goto err;
+
+	cm = CMSG_FIRSTHDR(&msg);
+	if (!cm || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+		goto err;
+
+	memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+	if (pread(fds[0], &info, sizeof(info), 0) != sizeof(info))
+		goto err;
+
+	/* the ring is read-only, only the own cursor is writable */
+	hdr = mmap(NULL, info.data_offset, PROT_READ, MAP_SHARED, fds[0], 0);
+	if (hdr == MAP_FAILED)
+		goto err;
+
+	rd->data = mmap(NULL, info.total_size - info.data_offset, PROT_READ,
+			MAP_SHARED, fds[0], info.data_offset);
+	if (rd->data == MAP_FAILED) {
+		munmap(hdr, info.data_offset);
+		goto err;
+	}
+
+	rd->self = mmap(NULL, sizeof(*rd->self), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fds[1], 0);
+	if (rd->self == MAP_FAILED) {
+		munmap((void *)rd->data, info.total_size - info.data_offset);
+		munmap(hdr, info.data_offset);
+		goto err;
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+
+	rd->hdr = hdr;
+	rd->seq = __atomic_load_n(&rd->self->seq, __ATOMIC_ACQUIRE);
+
+	return 0;
+err:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	close(rd->sock);
+	rd->hdr = NULL;
+	return -1;
+}
+
+static inline void fx2adc_shm_detach(struct fx2adc_shm_reader_ctx *rd)
+{
+	if (rd->hdr) {
+		munmap(rd->self, sizeof(*rd->self));
+		munmap((void *)rd->data, rd->hdr->total_size - rd->hdr->data_offset);
+		munmap((void *)rd->hdr, rd->hdr->data_offset);
+		rd->hdr = NULL;
+	}
+
+	close(rd->sock);
+}
+
+/*
+ * Wait for the next slot and return a pointer to its data, or NULL on
+ * timeout or if the server went away. The data stays valid until the
+ * server wraps around the ring, call fx2adc_shm_release() when done with
+ * it to check if it has been overwritten in the meantime. The flags of
+ * the slot are in rd->flags.
+ */
+static inline const unsigned char *fx2adc_shm_next(struct fx2adc_shm_reader_ctx *rd,
+						   uint32_t *len, uint64_t *sample,
+						   int timeout_ms)
+{
+	const struct fx2adc_shm_header *hdr = rd->hdr;
+	const struct fx2adc_shm_slot *slot;
+	struct timespec ts, now, deadline;
+	uint64_t head;
+	uint32_t futex;
+
+	/* wakeups that bring nothing new only get the time that is left */
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	while (1) {
+		futex = __atomic_load_n(&hdr->head_futex, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+		if (rd->seq != head)
+			break;
+
+		if (__atomic_load_n(&hdr->flags, __ATOMIC_ACQUIRE) & FX2ADC_SHM_CLOSED)
+			return NULL;
+
+		if (timeout_ms >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ts.tv_sec = deadline.tv_sec - now.tv_sec;
+			ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (ts.tv_nsec < 0) {
+				ts.tv_sec--;
+				ts.tv_nsec += 1000000000L;
+			}
+			if (ts.tv_sec < 0)
+				return NULL;
+		}
+
+		__atomic_add_fetch(&rd->self->waiters, 1, __ATOMIC_SEQ_CST);
+		if (syscall(SYS_futex, &hdr->head_futex, FUTEX_WAIT, futex,
+			    timeout_ms < 0 ? NULL : &ts, NULL, 0) &&
+		    errno == ETIMEDOUT) {
+			__atomic_sub_fetch(&rd->self->waiters, 1, __ATOMIC_SEQ_CST);
+			return NULL;
+		}
+		__atomic_sub_fetch(&rd->self->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+
+	/* skip everything that has been overwritten already */
+	if (head - rd->seq > hdr->num_slots - 1) {
+		rd->dropped += head - rd->seq - (hdr->num_slots - 1);
+		rd->seq = head - (hdr->num_slots - 1);
+	}
+
+	slot = &hdr->slots[rd->seq % hdr->num_slots];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != rd->seq) {
+		/* overwritten right now, continue with the newest slot */
+		rd->dropped += head - 1 - rd->seq;
+		rd->seq = head - 1;
+		slot = &hdr->slots[rd->seq % hdr->num_slots];
+	}
+
+	if (len)
+		*len = slot->len;
+	if (sample)
+		*sample = slot->sample;
+	rd->flags = slot->flags;
+
+	return rd->data + (size_t)(rd->seq % hdr->num_slots) * hdr->slot_size;
+}
+
+/* returns -1 if the slot was overwritten while it was being processed */
+static inline int fx2adc_shm_release(struct fx2adc_shm_reader_ctx *rd)
+{
+	const struct fx2adc_shm_slot *slot = &rd->hdr->slots[rd->seq % rd->hdr->num_slots];
+	int r = 0;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != rd->seq) {
+		rd->dropped++;
+		r = -1;
+	}
+
+	rd->seq++;
+	__atomic_store_n(&rd->self->seq, rd->seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&rd->self->dropped, rd->dropped, __ATOMIC_RELAXED);
+
+	return r;
+}
+
+#endif /* __linux__ */
+
+#endif /* __FX2ADC_SHM_H */
@@ -0,0 +1,55 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Polyphase resampler for arbitrary output rates
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+
+/* the ratio of the rates is approximated by the closest fraction with a
+ * numerator of at most this, the number of filter phases */
+#define RESAMPLE_MAX_PHASES	1024
+
+typedef struct resample resample_t;
+
+/*
+ * Resample from in_rate to out_rate by up / down, which is exact if the
+ * ratio is a fraction with up to RESAMPLE_MAX_PHASES in the numerator,
+ * e.g. 8 fsc of NTSC (315/11 MHz) from 30 MHz is 21/22. The filter is a
+ * Kaiser windowed sinc with 32 taps per phase (more when reducing the
+ * rate), flat to about 38% and 70 dB down from 52% of the lower rate.
+ * The output is in one of the real formats u8, s8, s16 or f32. Large
+ * blocks are split between up to threads threads, the calling one
+ * included.
+ */
+resample_t *resample_new(uint32_t in_rate, double out_rate, convert_format_t format,
+			 unsigned int threads);
+void resample_free(resample_t *rs);
+
+/* the rate that is actually produced, in_rate * up / down */
+double resample_rate(resample_t *rs);
+void resample_ratio(resample_t *rs, unsigned int *up, unsigned int *down);
+
+/* maximum number of output bytes for len input bytes */
+size_t resample_max_out(resample_t *rs, size_t len);
+
+/*
+ * Resample len samples starting with sample index first into out,
+ * returns the number of bytes written. Output sample k is taken at input
+ * sample k * down / up, the index of the first one is stored in
+ * out_sample; the outputs lag the input by half the filter length. The
+ * state is reset if first doesn't follow the previous call, the outputs
+ * then continue on the same time grid.
+ */
+size_t resample_run(resample_t *rs, const uint8_t *in, size_t len, uint64_t first,
+		    void *out, uint64_t *out_sample);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Level and edge triggers on the sample data
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#ifndef _TRIGGER_H_
+#define _TRIGGER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	TRIGGER_LEVEL,		/* |sample - 128| >= level, 1 .. 127 */
+	TRIGGER_RISING,		/* previous sample < level <= sample */
+	TRIGGER_FALLING,	/* previous sample >= level > sample */
+} trigger_type_t;
+
+/*
+ * Search len unsigned samples for the condition, prev is the sample
+ * before the first one. Returns true if it is met, with the indices of
+ * the first and the last sample meeting it.
+ */
+bool trigger_scan(trigger_type_t type, unsigned int level, const uint8_t *buf,
+		  size_t len, uint8_t prev, size_t *first, size_t *last);
+
+#endif
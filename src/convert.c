@@ -0,0 +1,383 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Sample format conversion and decimation
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define HAVE_SSE 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#include "convert.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct convert {
+	convert_format_t format;
+	unsigned int decim;
+	bool complex;
+	bool filter;
+	float *taps;		/* reversed, padded to a multiple of 4 */
+	unsigned int ntaps;
+	unsigned int delay;	/* group delay of the filter in input samples */
+	float *buf_i;		/* ntaps - 1 samples of history, then the input */
+	float *buf_q;
+	size_t buf_len;
+	uint64_t next;		/* index of the next input sample */
+};
+
+static const unsigned int sample_size[CONVERT_NUM_FORMATS] = {
+	[CONVERT_U8] = 1,
+	[CONVERT_S8] = 1,
+	[CONVERT_S16] = 2,
+	[CONVERT_F32] = 4,
+	[CONVERT_CS8] = 2,
+	[CONVERT_CF32] = 8,
+};
+
+unsigned int convert_sample_size(convert_format_t format)
+{
+	return format < CONVERT_NUM_FORMATS ? sample_size[format] : 0;
+}
+
+static float dot(const float *a, const float *b, unsigned int n)
+{
+	unsigned int i;
+#if defined(HAVE_SSE)
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+	float t[4];
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	for (; i < n; i += 4)
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+	_mm_storeu_ps(t, _mm_add_ps(acc0, acc1));
+	return t[0] + t[1] + t[2] + t[3];
+#elif defined(HAVE_NEON)
+	float32x4_t acc = vdupq_n_f32(0);
+
+	for (i = 0; i < n; i += 4)
+		acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+
+	return vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) +
+	       vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#else
+	float acc[4] = { 0, 0, 0, 0 };
+
+	for (i = 0; i < n; i += 4) {
+		acc[0] += a[i] * b[i];
+		acc[1] += a[i + 1] * b[i + 1];
+		acc[2] += a[i + 2] * b[i + 2];
+		acc[3] += a[i + 3] * b[i + 3];
+	}
+
+	return acc[0] + acc[1] + acc[2] + acc[3];
+#endif
+}
+
+/* Hamming windowed sinc, the transition band is 40% of the cutoff wide,
+ * so that aliases only fall into the transition band of the output */
+static int design_filter(convert_t *cv)
+{
+	double fc = 0.5 / cv->decim;
+	unsigned int n, pad, i;
+	double sum = 0, x, *h;
+
+	if (cv->complex && fc > 0.25)
+		fc = 0.25;
+
+	n = (unsigned int)ceil(3.3 / (0.4 * fc)) | 1;
+	pad = (4 - n % 4) % 4;
+
+	h = malloc(n * sizeof(double));
+	cv->taps = calloc(n + pad, sizeof(float));
+	if (!h || !cv->taps) {
+		free(h);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		x = i - (n - 1) / 2.0;
+		h[i] = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+		h[i] *= 0.54 - 0.46 * cos(2 * M_PI * i / (n - 1));
+		sum += h[i];
+	}
+
+	/* unity gain at DC, padding goes to the oldest samples */
+	for (i = 0; i < n; i++)
+		cv->taps[pad + i] = (float)(h[n - 1 - i] / sum);
+
+	cv->ntaps = n + pad;
+	cv->delay = (n - 1) / 2;
+	free(h);
+
+	return 0;
+}
+
+convert_t *convert_new(convert_format_t format, unsigned int decim)
+{
+	convert_t *cv;
+
+	if (format >= CONVERT_NUM_FORMATS || decim < 1 || decim > CONVERT_MAX_DECIMATION)
+		return NULL;
+
+	cv = calloc(1, sizeof(*cv));
+	if (!cv)
+		return NULL;
+
+	cv->format = format;
+	cv->decim = decim;
+	cv->complex = format == CONVERT_CS8 || format == CONVERT_CF32;
+	cv->filter = decim > 1 || cv->complex;
+	cv->next = UINT64_MAX;
+
+	if (cv->filter && design_filter(cv)) {
+		free(cv);
+		return NULL;
+	}
+
+	return cv;
+}
+
+void convert_free(convert_t *cv)
+{
+	if (!cv)
+		return;
+
+	free(cv->taps);
+	free(cv->buf_i);
+	free(cv->buf_q);
+	free(cv);
+}
+
+unsigned int convert_delay(convert_t *cv)
+{
+	return cv->filter ? cv->delay : 0;
+}
+
+size_t convert_max_out(convert_t *cv, size_t len)
+{
+	if (cv->filter)
+		len = (len + cv->decim - 1) / cv->decim;
+
+	return len * sample_size[cv->format];
+}
+
+static inline float clampf(float v, float lo, float hi)
+{
+	return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/* formats without filter, these loops are simple enough to be vectorized
+ * by the compiler */
+static size_t convert_direct(convert_t *cv, const uint8_t *in, size_t len, void *out)
+{
+	uint8_t *o8 = out;
+	float *of = out;
+	size_t i;
+
+	switch (cv->format) {
+	case CONVERT_U8:
+		memcpy(out, in, len);
+		break;
+	case CONVERT_S8:
+		for (i = 0; i < len; i++)
+			o8[i] = in[i] ^ 0x80;
+		break;
+	case CONVERT_S16:
+		/* written bytewise, little endian on any host */
+		for (i = 0; i < len; i++) {
+			o8[2 * i] = 0;
+			o8[2 * i + 1] = in[i] ^ 0x80;
+		}
+		break;
+	case CONVERT_F32:
+		for (i = 0; i < len; i++)
+			of[i] = (in[i] - 128) * (1.0f / 128);
+		break;
+	default:
+		return 0;
+	}
+
+	return len * sample_size[cv->format];
+}
+
+static void store(convert_t *cv, void *out, size_t k, float i, float q)
+{
+	uint8_t *o8 = out;
+	float *of = out;
+	int v;
+
+	switch (cv->format) {
+	case CONVERT_U8:
+		o8[k] = (uint8_t)lrintf(clampf(i * 128 + 128, 0, 255));
+		break;
+	case CONVERT_S8:
+		o8[k] = (uint8_t)(int8_t)lrintf(clampf(i * 128, -128, 127));
+		break;
+	case CONVERT_S16:
+		v = (int)lrintf(clampf(i * 32768, -32768, 32767));
+		o8[2 * k] = v & 0xff;
+		o8[2 * k + 1] = (v >> 8) & 0xff;
+		break;
+	case CONVERT_F32:
+		of[k] = i;
+		break;
+	case CONVERT_CS8:
+		o8[2 * k] = (uint8_t)(int8_t)lrintf(clampf(i * 128, -128, 127));
+		o8[2 * k + 1] = (uint8_t)(int8_t)lrintf(clampf(q * 128, -128, 127));
+		break;
+	case CONVERT_CF32:
+		of[2 * k] = i;
+		of[2 * k + 1] = q;
+		break;
+	default:
+		break;
+	}
+}
+
+size_t convert_run(convert_t *cv, const uint8_t *in, size_t len, uint64_t first,
+		   void *out, uint64_t *out_sample)
+{
+	static const float mix_i[4] = { 1, 0, -1, 0 };
+	static const float mix_q[4] = { 0, -1, 0, 1 };
+	unsigned int hist = cv->ntaps - 1;
+	unsigned int phase;
+	float *bi, *bq;
+	uint64_t min_center;
+	size_t i, i0, k;
+
+	if (!cv->filter) {
+		*out_sample = first;
+		cv->next = first + len;
+		return convert_direct(cv, in, len, out);
+	}
+
+	if (len > cv->buf_len) {
+		bi = realloc(cv->buf_i, (hist + len) * sizeof(float));
+		if (bi)
+			cv->buf_i = bi;
+		bq = cv->complex ? realloc(cv->buf_q, (hist + len) * sizeof(float)) : NULL;
+		if (bq)
+			cv->buf_q = bq;
+		if (!bi || (cv->complex && !bq))
+			return 0;
+
+		cv->buf_len = len;
+	}
+
+	bi = cv->buf_i;
+	bq = cv->buf_q;
+
+	/* gap in the input, start over, without the outputs that would
+	 * mostly be made of the zeroed history */
+	min_center = 0;
+	if (first != cv->next) {
+		memset(bi, 0, hist * sizeof(float));
+		if (bq)
+			memset(bq, 0, hist * sizeof(float));
+		min_center = first;
+	}
+
+	if (cv->complex) {
+		/* shift by -fs/4, the phase follows the absolute sample index */
+		phase = first & 3;
+		for (i = 0; i < len; i++) {
+			float v = (in[i] - 128) * (1.0f / 128);
+
+			bi[hist + i] = v * mix_i[(phase + i) & 3];
+			bq[hist + i] = v * mix_q[(phase + i) & 3];
+		}
+	} else {
+		for (i = 0; i < len; i++)
+			bi[hist + i] = (in[i] - 128) * (1.0f / 128);
+	}
+
+	/* The output at input i is centered on sample i - delay, so the
+	 * outputs are computed where that center is a multiple of the
+	 * decimation. This compensates the group delay of the filter,
+	 * output k is aligned with input sample k * decim. */
+	i0 = (cv->delay % cv->decim + cv->decim - first % cv->decim) % cv->decim;
+	while (first + i0 < min_center + cv->delay)
+		i0 += cv->decim;
+
+	for (i = i0, k = 0; i < len; i += cv->decim, k++) {
+		store(cv, out, k, dot(cv->taps, bi + i, cv->ntaps),
+		      cv->complex ? dot(cv->taps, bq + i, cv->ntaps) : 0);
+	}
+
+	memmove(bi, bi + len, hist * sizeof(float));
+	if (bq)
+		memmove(bq, bq + len, hist * sizeof(float));
+
+	*out_sample = (first + i0 - cv->delay) / cv->decim;
+	cv->next = first + len;
+
+	return k * sample_size[cv->format];
+}
+
+void convert_deinterleave(const uint8_t *in, size_t len, uint8_t *ch1, uint8_t *ch2)
+{
+	size_t i = 0, n = len / 2;
+#if defined(HAVE_SSE2)
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i a, b;
+
+	/* the even bytes are the low halves of 16 bit words */
+	for (; i + 16 <= n; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+		b = _mm_loadu_si128((const __m128i *)(in + 2 * i + 16));
+		_mm_storeu_si128((__m128i *)(ch1 + i),
+				 _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+		_mm_storeu_si128((__m128i *)(ch2 + i),
+				 _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+#elif defined(HAVE_NEON)
+	uint8x16x2_t v;
+
+	for (; i + 16 <= n; i += 16) {
+		v = vld2q_u8(in + 2 * i);
+		vst1q_u8(ch1 + i, v.val[0]);
+		vst1q_u8(ch2 + i, v.val[1]);
+	}
+#endif
+	for (; i < n; i++) {
+		ch1[i] = in[2 * i];
+		ch2[i] = in[2 * i + 1];
+	}
+}
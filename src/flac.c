@@ -0,0 +1,390 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * FLAC encoder for 8 bit samples
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Only what is needed for the samples of the ADC: the fixed predictors
+ * of order 0 to 4 with partitioned Rice coding of the residual, and the
+ * verbatim and constant subframes. Every frame is encoded on its own,
+ * so the caller can spread the blocks of a stream over several threads.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "flac.h"
+
+#define MAX_ORDER		4
+#define MAX_PARTITION_ORDER	8
+#define MAX_RICE_PARAM		14	/* 15 is the escape code */
+
+/* frame header and footer including the longest frame number */
+#define MAX_FRAME_OVERHEAD	20
+
+struct bits {
+	uint8_t *p;
+	uint64_t acc;
+	unsigned int n;		/* bits in acc not stored yet */
+};
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	unsigned int i, j, c8, c16;
+
+	for (i = 0; i < 256; i++) {
+		c8 = i;
+		c16 = i << 8;
+		for (j = 0; j < 8; j++) {
+			c8 = (c8 << 1) ^ (c8 & 0x80 ? 0x07 : 0);
+			c16 = (c16 << 1) ^ (c16 & 0x8000 ? 0x8005 : 0);
+		}
+		crc8_table[i] = c8;
+		crc16_table[i] = c16;
+	}
+}
+
+static uint8_t crc8(const uint8_t *p, size_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--)
+		crc = crc8_table[crc ^ *p++];
+
+	return crc;
+}
+
+static uint16_t crc16(const uint8_t *p, size_t len)
+{
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *p++];
+
+	return crc;
+}
+
+/* append the len low bits of val, len is at most 32 */
+static inline void put(struct bits *b, uint32_t val, unsigned int len)
+{
+	uint32_t w;
+
+	b->acc = b->acc << len | val;
+	b->n += len;
+	if (b->n >= 32) {
+		b->n -= 32;
+		w = (uint32_t)(b->acc >> b->n);
+		b->p[0] = w >> 24;
+		b->p[1] = w >> 16;
+		b->p[2] = w >> 8;
+		b->p[3] = w;
+		b->p += 4;
+	}
+}
+
+/* pad with zeros to the next byte and store everything */
+static void align(struct bits *b)
+{
+	put(b, 0, (8 - b->n % 8) % 8);
+	while (b->n) {
+		b->n -= 8;
+		*b->p++ = (uint8_t)(b->acc >> b->n);
+	}
+}
+
+static inline void put_rice(struct bits *b, uint32_t u, unsigned int k)
+{
+	uint32_t q = u >> k;
+
+	/* q zeros, a one, then the k low bits */
+	while (q + 1 + k > 32) {
+		put(b, 0, 16);
+		q -= 16;
+	}
+	put(b, (1U << k) | (u & ((1U << k) - 1)), q + 1 + k);
+}
+
+/* frame numbers are coded like UTF-8, extended to 36 bits */
+static void put_utf8(struct bits *b, uint64_t v)
+{
+	unsigned int len, i;
+
+	if (v < 0x80) {
+		put(b, (uint32_t)v, 8);
+		return;
+	}
+
+	for (len = 2; len < 7 && v >> (5 * len + 1); len++)
+		;
+	put(b, ((0xff00 >> len) & 0xff) | (uint32_t)(v >> (6 * (len - 1))), 8);
+	for (i = len - 1; i-- > 0;)
+		put(b, 0x80 | ((v >> (6 * i)) & 0x3f), 8);
+}
+
+static unsigned int rice_param(uint32_t sum, unsigned int n)
+{
+	unsigned int k = 0;
+
+	while (k < MAX_RICE_PARAM && ((uint64_t)n << (k + 1)) < sum)
+		k++;
+
+	return k;
+}
+
+/* the fixed predictor with the smallest residual */
+static unsigned int best_order(const int32_t *x, unsigned int n)
+{
+	uint32_t sum[MAX_ORDER + 1] = { 0 };
+	int32_t e0, e1, e2, e3, e4, l0, l1, l2, l3;
+	unsigned int i, order = 0;
+
+	l0 = x[3];
+	l1 = x[3] - x[2];
+	l2 = l1 - (x[2] - x[1]);
+	l3 = l2 - (x[2] - 2 * x[1] + x[0]);
+
+	for (i = MAX_ORDER; i < n; i++) {
+		e0 = x[i];
+		e1 = e0 - l0;
+		e2 = e1 - l1;
+		e3 = e2 - l2;
+		e4 = e3 - l3;
+		sum[0] += e0 < 0 ? -e0 : e0;
+		sum[1] += e1 < 0 ? -e1 : e1;
+		sum[2] += e2 < 0 ? -e2 : e2;
+		sum[3] += e3 < 0 ? -e3 : e3;
+		sum[4] += e4 < 0 ? -e4 : e4;
+		l0 = e0;
+		l1 = e1;
+		l2 = e2;
+		l3 = e3;
+	}
+
+	for (i = 1; i <= MAX_ORDER; i++)
+		if (sum[i] < sum[order])
+			order = i;
+
+	return order;
+}
+
+/* the residual of the predictor, folded to unsigned */
+static void residual(const int32_t *x, unsigned int n, unsigned int order,
+		     uint32_t *res)
+{
+	unsigned int i;
+	int32_t e;
+
+	for (i = order; i < n; i++) {
+		switch (order) {
+		case 0:
+			e = x[i];
+			break;
+		case 1:
+			e = x[i] - x[i - 1];
+			break;
+		case 2:
+			e = x[i] - 2 * x[i - 1] + x[i - 2];
+			break;
+		case 3:
+			e = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+			break;
+		default:
+			e = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+			break;
+		}
+		res[i] = ((uint32_t)e << 1) ^ (uint32_t)(e >> 31);
+	}
+}
+
+static void encode_subframe(struct bits *b, const int32_t *x, unsigned int n,
+			    uint32_t *res)
+{
+	uint32_t sum[1 << MAX_PARTITION_ORDER];
+	uint8_t param[1 << MAX_PARTITION_ORDER];
+	unsigned int order, pmax, p, best_p, parts, len, i, j, k;
+	uint64_t cost, best_cost;
+
+	for (i = 1; i < n && x[i] == x[0]; i++)
+		;
+	if (i == n) {
+		put(b, 0x00, 8);		/* constant */
+		put(b, x[0] & 0xff, 8);
+		return;
+	}
+
+	if (n <= MAX_ORDER)
+		goto verbatim;
+
+	order = best_order(x, n);
+	residual(x, n, order, res);
+
+	/* the first partition holds the warm-up samples as well */
+	for (pmax = 0; pmax < MAX_PARTITION_ORDER && !(n % (2U << pmax)) &&
+	     (n >> (pmax + 1)) > order; pmax++)
+		;
+
+	parts = 1U << pmax;
+	len = n >> pmax;
+	for (j = 0; j < parts; j++) {
+		sum[j] = 0;
+		for (i = j ? j * len : order; i < (j + 1) * len; i++)
+			sum[j] += res[i];
+	}
+
+	/* from the finest partitioning up, merging neighbours */
+	best_cost = UINT64_MAX;
+	best_p = pmax;
+	for (p = pmax + 1; p-- > 0;) {
+		parts = 1U << p;
+		len = n >> p;
+		cost = 0;
+		for (j = 0; j < parts; j++) {
+			i = j ? len : len - order;
+			k = rice_param(sum[j], i);
+			cost += 4 + (uint64_t)i * (k + 1) + (sum[j] >> k);
+		}
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_p = p;
+			for (j = 0; j < parts; j++)
+				param[j] = rice_param(sum[j], j ? len : len - order);
+		}
+		for (j = 0; p && j < parts / 2; j++)
+			sum[j] = sum[2 * j] + sum[2 * j + 1];
+	}
+
+	/* the estimate is an upper bound of the real size */
+	if (8 * order + 6 + best_cost >= 8ULL * n)
+		goto verbatim;
+
+	put(b, 0x10 | order << 1, 8);
+	for (i = 0; i < order; i++)
+		put(b, x[i] & 0xff, 8);
+	put(b, 0, 2);			/* Rice coding, 4 bit parameters */
+	put(b, best_p, 4);
+
+	parts = 1U << best_p;
+	len = n >> best_p;
+	for (j = 0; j < parts; j++) {
+		k = param[j];
+		put(b, k, 4);
+		for (i = j ? j * len : order; i < (j + 1) * len; i++)
+			put_rice(b, res[i], k);
+	}
+	return;
+
+verbatim:
+	put(b, 0x02, 8);
+	for (i = 0; i < n; i++)
+		put(b, x[i] & 0xff, 8);
+}
+
+static size_t encode_frame(const uint8_t *in, unsigned int n, unsigned int channels,
+			   uint64_t frame, uint8_t *out)
+{
+	int32_t x[FLAC_BLOCK_SIZE];
+	uint32_t res[FLAC_BLOCK_SIZE];
+	struct bits b = { out, 0, 0 };
+	unsigned int ch, i;
+	uint16_t crc;
+
+	put(&b, 0xfff8, 16);		/* sync code, fixed block size */
+	put(&b, n == FLAC_BLOCK_SIZE ? 12 : 7, 4);
+	put(&b, 0, 4);			/* sample rate from STREAMINFO */
+	put(&b, channels - 1, 4);	/* independent channels */
+	put(&b, 1, 3);			/* 8 bits per sample */
+	put(&b, 0, 1);
+	put_utf8(&b, frame);
+	if (n != FLAC_BLOCK_SIZE)
+		put(&b, n - 1, 16);
+	align(&b);
+	*b.p = crc8(out, b.p - out);
+	b.p++;
+
+	for (ch = 0; ch < channels; ch++) {
+		for (i = 0; i < n; i++)
+			x[i] = (int32_t)in[i * channels + ch] - 128;
+		encode_subframe(&b, x, n, res);
+	}
+	align(&b);
+
+	crc = crc16(out, b.p - out);
+	b.p[0] = crc >> 8;
+	b.p[1] = crc & 0xff;
+
+	return b.p + 2 - out;
+}
+
+size_t flac_header(uint8_t *out, uint32_t rate, unsigned int channels,
+		   uint64_t total)
+{
+	struct bits b = { out, 0, 0 };
+	uint32_t khz = rate / 1000 ? rate / 1000 : 1;
+
+	memcpy(out, "fLaC", 4);
+	b.p += 4;
+
+	put(&b, 0x80, 8);		/* the last metadata block, STREAMINFO */
+	put(&b, 34, 24);
+	put(&b, FLAC_BLOCK_SIZE, 16);	/* minimum and maximum block size */
+	put(&b, FLAC_BLOCK_SIZE, 16);
+	put(&b, 0, 24);			/* frame sizes unknown */
+	put(&b, 0, 24);
+	put(&b, khz > 0xfffff ? 0xfffff : khz, 20);
+	put(&b, channels - 1, 3);
+	put(&b, 7, 5);			/* 8 bits per sample */
+	put(&b, (uint32_t)(total >> 32) & 0xf, 4);
+	put(&b, (uint32_t)total, 32);
+	align(&b);
+	memset(b.p, 0, 16);		/* no MD5 signature */
+
+	return FLAC_HEADER_SIZE;
+}
+
+size_t flac_max_size(size_t len, unsigned int channels)
+{
+	size_t frames = (len / channels + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE;
+
+	/* a verbatim subframe has one byte of header per channel */
+	return len + frames * (MAX_FRAME_OVERHEAD + channels);
+}
+
+size_t flac_encode(const uint8_t *in, size_t len, unsigned int channels,
+		   uint64_t frame, uint8_t *out)
+{
+	size_t block = (size_t)FLAC_BLOCK_SIZE * channels;
+	uint8_t *p = out;
+	size_t n;
+
+	pthread_once(&crc_once, crc_init);
+
+	for (; len; in += n, len -= n) {
+		n = len < block ? len - len % channels : block;
+		if (!n)
+			break;
+		p += encode_frame(in, n / channels, channels, frame++, p);
+	}
+
+	return p - out;
+}
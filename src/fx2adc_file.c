@@ -19,90 +19,2617 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* O_DIRECT, fallocate(), vmsplice() */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#else
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include "getopt/getopt.h"
+#endif
+
+#include <pthread.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 260
+#endif
+
+#include "fx2adc.h"
+#include "convert.h"
+#include "flac.h"
+#include "fx2adc_mmap.h"
+#include "resample.h"
+#include "trigger.h"
+
+#if defined(__linux__) && defined(O_DIRECT)
+#define HAVE_DIRECT_IO 1
+#endif
+
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+#include <sys/uio.h>
+#define HAVE_VMSPLICE 1
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#define HAVE_MMAP_OUTPUT 1
+#endif
+
+#if defined(ENABLE_IO_URING) && defined(HAVE_DIRECT_IO)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+#define DEFAULT_SAMPLE_RATE		30000000
+#define DEFAULT_BUF_LENGTH		(16 * 16384)
+#define MINIMAL_BUF_LENGTH		512
+#define MAXIMAL_BUF_LENGTH		(256 * 16384)
+
+/* time the write buffer can hold, to ride out stalls of the disk */
+#define DEFAULT_BUFFER_MS		2000
+
+/* largest single write, so that space is released while writing */
+#define MAX_WRITE_LENGTH		(4 * 1024 * 1024)
+
+/* direct I/O: offsets, lengths and buffers are multiples of this, the
+ * writes are collected to at least DIRECT_MIN_WRITE, and the file is
+ * allocated ahead in steps of FALLOCATE_STEP */
+#define DIRECT_ALIGN			4096
+#define DIRECT_MIN_WRITE		(1024 * 1024)
+#define FALLOCATE_STEP			(256ULL * 1024 * 1024)
+
+/* -m: the part of the file that is mapped at once, the pages behind the
+ * writes are synced and unmapped in steps of MMAP_RETIRE */
+#define MMAP_WINDOW			(64 * 1024 * 1024)
+#define MMAP_RETIRE			(4 * 1024 * 1024)
+
+/* pipe buffer requested for stdout */
+#define PIPE_SIZE			(1024 * 1024)
+
+/* writes in flight with io_uring */
+#define URING_DEPTH			8
+
+/* FLAC: the samples of a job, the encoder threads and the most jobs
+ * queued at once */
+#define FLAC_CHUNK			(256 * FLAC_BLOCK_SIZE)
+#define FLAC_MAX_THREADS		32
+#define FLAC_MAX_QUEUE			(2 * FLAC_MAX_THREADS)
+
+/* -c split: samples deinterleaved at once */
+#define SPLIT_CHUNK			(1024 * 1024)
+
+/* transfers dropped at different positions, remembered until written */
+#define MAX_GAPS			64
+
+static int do_exit = 0;
+static uint64_t bytes_to_read = 0;
+static fx2adc_dev_t *dev = NULL;
+
+/*
+ * The USB callback only copies the samples into this ring, a separate
+ * thread writes them out. If the disk stalls for longer than the ring
+ * lasts, whole transfers are dropped and counted, the file stays a
+ * valid sequence of transfers.
+ */
+static struct {
+	uint8_t *buf;
+	size_t size;
+	uint64_t head;		/* bytes written by the callback */
+	uint64_t tail;		/* bytes written to the file */
+	size_t high_water;	/* highest fill level */
+	uint64_t lost;		/* bytes dropped because the ring was full */
+	bool done;		/* no more data will arrive */
+	bool failed;		/* the writer gave up */
+	uint64_t shift;		/* stream bytes between windows, less padding */
+	/* where transfers were dropped or windows start: ring position and
+	 * the bytes lost and skipped up to there, so that the writer knows
+	 * the sample index */
+	struct {
+		uint64_t pos;
+		uint64_t lost;
+		uint64_t shift;
+	} gaps[MAX_GAPS];
+	unsigned int gap_first, gap_num;
+	uint64_t lost_written;	/* bytes lost before the tail */
+	uint64_t shift_written;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} wr;
+
+struct output {
+	FILE *file;
+	int fd;			/* direct I/O */
+	bool no_fallocate;
+	uint64_t offset;	/* bytes written */
+	uint64_t allocated;
+	uint8_t *stage;		/* direct I/O of compressed data */
+	size_t staged;
+	/* -m: written through a window of the file, the header publishes
+	 * the length for readers */
+	struct fx2adc_mmap_header *hdr;
+	int map_fd;
+	uint8_t *win;
+	uint64_t win_start;	/* data offset of the window */
+	uint64_t retired;	/* synced and unmapped up to here */
+	struct output *ch[2];	/* -c split: the files of CH1 and CH2 */
+	char name[PATH_MAX];
+};
+
+static struct output out = { .fd = -1 };
+static bool direct_io = false;
+#ifdef HAVE_MMAP_OUTPUT
+static bool use_mmap = false;
+#endif
+
+/*
+ * Dual channel: the samples of CH1 and CH2 arrive interleaved and stay
+ * so in the ring, all positions and sample indices in here count the
+ * bytes of both channels, they are divided by the number of channels
+ * where they are shown. With -c split an output is a pair of files, one
+ * per channel, the writer deinterleaves the samples into them.
+ */
+static unsigned int channels = 1;
+static struct {
+	bool enabled;
+	uint8_t *buf[2];	/* deinterleaved samples of a SPLIT_CHUNK */
+} split;
+
+/*
+ * -R: the writer resamples the samples to another rate on their way to
+ * the file. The ring keeps the capture rate, the resampler is fed the
+ * ring positions, so it runs straight across gaps like the samples do
+ * in a file without it. Positions shown in the metadata are converted
+ * with out_samples().
+ */
+static struct {
+	double rate;		/* requested, 0 if off */
+	resample_t *rs;
+	unsigned int up, down;
+	uint8_t *buf;		/* output of MAX_WRITE_LENGTH samples */
+	uint64_t first;		/* index of the first output written */
+	bool started;
+} resampler;
+
+#ifdef HAVE_VMSPLICE
+/*
+ * stdout is a pipe: the ring pages are handed to the pipe with
+ * vmsplice() instead of being copied into it, the reader copies straight
+ * from the ring. The pipe references the pages until they are read, so
+ * the ring space is only released once a full pipe buffer was spliced
+ * after it. The pages are not gifted, the ring is reused.
+ */
+static struct {
+	bool enabled;
+	size_t lag;		/* pipe buffer size */
+	uint64_t calls;
+} vms;
+#endif
+
+/*
+ * Rotation: the output is split into segments of the same number of
+ * bytes, the next file is opened while the current one is written. The
+ * first sample of every segment is recorded in the index file, so the
+ * segments concatenate to the capture even if transfers were dropped.
+ */
+static struct {
+	const char *template;
+	uint64_t length;	/* bytes per segment, 0: a single file */
+	uint64_t start;		/* ring position where the current one starts */
+	uint64_t end;		/* and where it ends */
+	unsigned int num;	/* current segment */
+	uint64_t first_sample;	/* of the current segment */
+	uint64_t start_ns;	/* wall clock time of the capture start */
+	uint32_t rate;
+	struct output next;
+	uint64_t next_sample;	/* the next file is named for this sample */
+	FILE *index;
+} seg = { .end = UINT64_MAX, .next = { .fd = -1 } };
+
+/*
+ * Flight recorder: the ring keeps the last -P seconds, which are only
+ * written once a trigger fires, followed by -A seconds after the last
+ * trigger. Every event goes to a file of its own, named and listed in
+ * the index like the segments. Triggers are SIGUSR1, a line "trigger"
+ * in the control FIFO, and a level or edge in the samples.
+ */
+static struct {
+	bool enabled;
+	bool active;		/* an event is being written */
+	uint64_t pre, post;	/* bytes */
+	size_t align;		/* of the start and end of an event */
+	trigger_type_t type;
+	unsigned int level;	/* 0: the samples don't trigger */
+	uint64_t scan;		/* the samples are searched up to here */
+	bool request;		/* by the control FIFO */
+	char comment[256];
+	const char *fifo;
+	pthread_t fifo_thread;
+	bool fifo_running;
+	unsigned int events;
+} trig;
+static volatile sig_atomic_t trigger_signal = 0;
+
+/*
+ * Scheduled capture: the device streams from the start, the callback
+ * only passes the samples inside the windows on to the ring, so that
+ * a window starts at its exact sample without opening or arming
+ * anything. Wall clock starts are mapped to stream positions with a
+ * reference, the earliest time a transfer completed minus its samples,
+ * renewed every REF_INTERVAL_MS to follow the drift of the sample
+ * clock. With -w every window gets a file, opened and closed by the
+ * writer like the events of the flight recorder.
+ */
+struct window {
+	int64_t at_ns;		/* wall clock start, 0: start is a stream position */
+	uint64_t start;		/* stream position of the first byte */
+	uint64_t length;	/* bytes, 0: until the capture ends */
+	uint64_t late;		/* bytes the start was missed by */
+	bool begun;
+	uint64_t ring_start;	/* ring positions, set by the callback */
+	uint64_t ring_end;	/* UINT64_MAX until the window is complete */
+	char *name;		/* NULL: named after the template */
+};
+
+#define REF_INTERVAL_MS			1000
+
+static struct {
+	struct window *win;
+	unsigned int num;
+	unsigned int cur;	/* the window the callback is in or waits for */
+	bool files;		/* the writer opens a file per window */
+	bool active;		/* the writer is in a window */
+	unsigned int writing;	/* and which */
+	size_t align;		/* of the ring position of a window start */
+	uint64_t stream;	/* bytes the device delivered */
+	int64_t ref_ns;		/* wall clock time of stream position 0 */
+	int64_t ref_next;	/* the reference of the current interval */
+	int64_t ref_renew;
+} sched;
+
+/*
+ * SigMF metadata, one .sigmf-meta file next to every output file. The
+ * writer thread queues the events at their ring position, a thread of
+ * its own turns them into the JSON file, which is rewritten at most once
+ * per META_INTERVAL_MS and replaced atomically.
+ */
+enum meta_type {
+	META_FILE,		/* a new output file starts */
+	META_GAP,		/* samples were dropped */
+	META_NOTE,		/* an annotation, e.g. a parameter change */
+};
+
+struct meta_item {
+	enum meta_type type;
+	uint64_t pos;		/* ring position */
+	uint64_t sample;	/* sample index of the capture there */
+	uint64_t count;		/* samples lost */
+	char label[32];
+	char text[PATH_MAX];	/* file name or comment */
+	struct meta_item *next;
+};
+
+#define META_INTERVAL_MS		1000
+
+static struct {
+	bool enabled;
+	struct meta_item *queue, **queue_tail;
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	/* device and settings, for the global object */
+	char hw[600];
+	int vdiv;
+	bool ext_clock;
+} meta;
+
+/*
+ * FLAC output: the writer thread cuts the ring into jobs, a pool of
+ * threads encodes them, and the writer stores the results in the order
+ * of the jobs. The space of a job in the ring is only released once it
+ * is written. Every file is a stream of its own, the frames are numbered
+ * from its start.
+ */
+struct flac_job {
+	const uint8_t *in;
+	size_t len;
+	uint64_t frame;		/* number of the first frame */
+	uint8_t *out;
+	size_t out_len;
+	bool ready;
+};
+
+static struct {
+	bool enabled;
+	unsigned int channels;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job was queued */
+	pthread_cond_t done;	/* a job was finished */
+	pthread_t threads[FLAC_MAX_THREADS];
+	int num_threads;
+	struct flac_job jobs[FLAC_MAX_QUEUE];
+	unsigned int depth;	/* jobs queued at most */
+	unsigned int first, num;
+	unsigned int taken;	/* of the queued jobs, by a thread */
+	uint64_t frame;		/* next frame of the current file */
+	uint64_t in_bytes, out_bytes;
+	bool exit;
+} flac = { .channels = 1 };
+static int flac_threads = 0;	/* 0: number of CPUs - 1 */
+
+#ifdef HAVE_IO_URING
+static struct {
+	int fd;
+	void *ring_ptr;
+	size_t ring_len;
+	struct io_uring_sqe *sqes;
+	unsigned int *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail;
+	unsigned int sq_entries, sq_mask, cq_mask;
+	struct io_uring_cqe *cqes;
+	/* writes in flight, in ring order, completed in any order */
+	uint64_t end[URING_DEPTH];
+	uint32_t len[URING_DEPTH];
+	bool complete[URING_DEPTH];
+	unsigned int first, num;
+	uint64_t writes, enters;
+} uring = { .fd = -1 };
+
+static bool use_uring = false;
+#endif
+
+void usage(void)
+{
+	fprintf(stderr,
+		"fx2adc_file, an acquisition tool for FX2 based USB scopes\n\n"
+		"Usage:\n"
+		"\t[-s samplerate (default: 30 MHz)]\n"
+		"\t[-e (use external clock on IFCLK)]\n"
+		"\t[-d device_index (default: 0)]\n"
+		"\t[-v voltage divider in mV, default is the lowest setting the hardware supports\n"
+		"\t[-p ppm_error (default: 0)]\n"
+		"\t[-b output_block_size (default: 16 * 16384)]\n"
+		"\t[-n number of samples to read per channel (default: 0, infinite)]\n"
+		"\t[-a start at: +seconds after the first sample, @seconds since the\n"
+		"\t    epoch or YYYY-MM-DDTHH:MM:SS[.frac]Z, read -n samples from there]\n"
+		"\t[-w schedule file, a line \"START LENGTH [filename]\" per window,\n"
+		"\t    START as for -a, LENGTH in samples or seconds with an s appended]\n"
+		"\t[-c channels: 1 (default), 2 (CH1 and CH2 interleaved in one file)\n"
+		"\t    or split (a file per channel)]\n"
+		"\t[-B write buffer in ms (default: %d)]\n"
+		"\t[-S bytes per file, start a new file after this many]\n"
+		"\t[-T seconds per file, start a new file after this time]\n"
+		"\t[-I index file listing the files with their first sample\n"
+		"\t    (default: the name of the first file with .index appended)]\n"
+		"\t[-M (write SigMF metadata next to each file)]\n"
+		"\t[-F (compress the samples to FLAC, the header has the rate in kHz)]\n"
+		"\t[-j number of FLAC encoder or resampler threads\n"
+		"\t    (default: number of CPUs - 1)]\n"
+		"\t[-R resample to this rate in Hz before writing, e.g. 28636363.636]\n"
+		"\t[-P seconds of history to keep, only write it when a trigger fires]\n"
+		"\t[-A seconds to write after the last trigger (default: 1)]\n"
+		"\t[-t trigger on the samples: level:N (|sample - 128| >= N),\n"
+		"\t    rise:N or fall:N (crossing N), besides SIGUSR1]\n"
+		"\t[-C control FIFO, a line \"trigger [comment]\" fires the trigger]\n"
+#ifdef HAVE_DIRECT_IO
+		"\t[-D (write with direct I/O, bypassing the page cache)]\n"
+#endif
+#ifdef HAVE_MMAP_OUTPUT
+		"\t[-m (write through a memory mapping, local readers can follow\n"
+		"\t    the file live, see fx2adc_mmap.h)]\n"
+#endif
+#ifdef HAVE_VMSPLICE
+		"\t[-W (write to a pipe on stdout with write() instead of vmsplice())]\n"
+#endif
+#ifdef HAVE_IO_URING
+		"\t[-U (queue the direct writes with io_uring, implies -D)]\n"
+#endif
+		"\tfilename (a '-' dumps samples to stdout; with -S, -T or -w, %%n is\n"
+		"\t    replaced by the file number, %%i by the index of the first\n"
+		"\t    sample, and strftime() sequences by its UTC start time)\n\n",
+		DEFAULT_BUFFER_MS);
+	exit(1);
+}
+
+#ifdef _WIN32
+BOOL WINAPI
+sighandler(int signum)
+{
+	if (CTRL_C_EVENT == signum) {
+		fprintf(stderr, "Signal caught, exiting!\n");
+		do_exit = 1;
+		fx2adc_cancel_async(dev);
+		return TRUE;
+	}
+	return FALSE;
+}
+#else
+static void sighandler(int signum)
+{
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "Signal caught, exiting!\n");
+	do_exit = 1;
+	fx2adc_cancel_async(dev);
+}
+
+/* the writer thread notices it with the next transfer */
+static void trigger_handler(int signum)
+{
+	trigger_signal = 1;
+}
+#endif
+
+static void writer_finish(void)
+{
+	pthread_mutex_lock(&wr.lock);
+	wr.done = true;
+	pthread_cond_signal(&wr.cond);
+	pthread_mutex_unlock(&wr.lock);
+}
+
+static void meta_push(enum meta_type type, uint64_t pos, uint64_t sample,
+		      uint64_t count, const char *label, const char *text)
+{
+	struct meta_item *item;
+
+	if (!meta.enabled)
+		return;
+
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return;
+
+	item->type = type;
+	item->pos = pos;
+	item->sample = sample;
+	item->count = count;
+	snprintf(item->label, sizeof(item->label), "%s", label ? label : "");
+	snprintf(item->text, sizeof(item->text), "%s", text ? text : "");
+
+	pthread_mutex_lock(&meta.lock);
+	*meta.queue_tail = item;
+	meta.queue_tail = &item->next;
+	pthread_cond_signal(&meta.cond);
+	pthread_mutex_unlock(&meta.lock);
+}
+
+/* annotate the sample at ring position pos, e.g. a parameter change */
+static void meta_note(uint64_t pos, const char *label, const char *comment)
+{
+	meta_push(META_NOTE, pos, 0, 0, label, comment);
+}
+
+static void json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+static void json_datetime(FILE *f, uint64_t sample)
+{
+	uint64_t ns = seg.start_ns + (seg.rate ? sample / channels * 1000000000ULL / seg.rate : 0);
+	time_t t = ns / 1000000000ULL;
+	struct tm tm;
+
+#ifdef _WIN32
+	gmtime_s(&tm, &t);
+#else
+	gmtime_r(&t, &tm);
+#endif
+	fprintf(f, "\"%04d-%02d-%02dT%02d:%02d:%02d.%06uZ\"", tm.tm_year + 1900,
+		tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		(unsigned int)(ns % 1000000000ULL / 1000));
+}
+
+/* a number of samples of the capture as stored in the files: per
+ * channel, at the output rate with -R */
+static uint64_t out_samples(uint64_t n)
+{
+	n /= channels;
+	if (resampler.rs)
+		n = (n * resampler.up + resampler.down - 1) / resampler.down;
+	return n;
+}
+
+/* offset in its file of the sample at ring position pos, the resampler
+ * only starts once it has the history of its first output */
+static uint64_t out_offset(const struct meta_item *file, uint64_t pos)
+{
+	uint64_t n = out_samples(pos - file->pos);
+
+	if (resampler.rs)
+		n = n > resampler.first ? n - resampler.first : 0;
+	return n;
+}
+
+/* the metadata file belonging to a data file, with the extension replaced */
+static void meta_name(char *name, size_t size, const char *data)
+{
+	const char *ext = strrchr(data, '.');
+	const char *dir = strrchr(data, '/');
+
+	if (!ext || (dir && dir > ext))
+		ext = data + strlen(data);
+	snprintf(name, size, "%.*s.sigmf-meta", (int)(ext - data), data);
+}
+
+/* name of the file of channel ch of a split output */
+static void channel_name(char *name, size_t size, const char *base, unsigned int ch)
+{
+	const char *ext = strrchr(base, '.');
+
+	if (!ext || strpbrk(ext, "/\\"))
+		ext = base + strlen(base);
+	snprintf(name, size, "%.*s-ch%u%s", (int)(ext - base), base, ch + 1, ext);
+}
+
+/* write the metadata of the data file starting with item, up to end;
+ * channel is 0 unless it holds a single channel of a split output */
+static void meta_write_file(struct meta_item *file, struct meta_item *end,
+			    const char *data, unsigned int channel)
+{
+	char name[PATH_MAX + 16], tmp[PATH_MAX + 32];
+	const char *base;
+	struct meta_item *item;
+	bool first;
+	FILE *f;
+
+	meta_name(name, sizeof(name), data);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to write %s\n", tmp);
+		return;
+	}
+
+	base = strrchr(data, '/');
+	base = base ? base + 1 : data;
+
+	fprintf(f, "{\n  \"global\": {\n");
+	/* FLAC stores the samples signed */
+	fprintf(f, "    \"core:datatype\": \"%s\",\n", flac.enabled ? "ri8" : "ru8");
+	fprintf(f, "    \"core:sample_rate\": %.12g,\n",
+		resampler.rs ? resample_rate(resampler.rs) : seg.rate);
+	fprintf(f, "    \"core:version\": \"1.0.0\",\n");
+	fprintf(f, "    \"core:num_channels\": %u,\n", channel ? 1 : channels);
+	fprintf(f, "    \"core:dataset\": ");
+	json_string(f, base);
+	fprintf(f, ",\n    \"core:hw\": ");
+	json_string(f, meta.hw);
+	fprintf(f, ",\n    \"core:recorder\": \"fx2adc_file\",\n");
+	fprintf(f, "    \"core:extensions\": [{\"name\": \"fx2adc\", \"version\": \"1.0.0\", \"optional\": true}],\n");
+	if (flac.enabled)
+		fprintf(f, "    \"fx2adc:encoding\": \"flac\",\n");
+	if (channel)
+		fprintf(f, "    \"fx2adc:channel\": %u,\n", channel);
+	fprintf(f, "    \"fx2adc:vdiv_mv\": %d,\n", meta.vdiv);
+	fprintf(f, "    \"fx2adc:ext_clock\": %s\n", meta.ext_clock ? "true" : "false");
+	fprintf(f, "  },\n");
+
+	/* a new capture segment after every gap, with the real sample index */
+	fprintf(f, "  \"captures\": [\n    {\"core:sample_start\": 0, \"core:global_index\": %llu, \"core:datetime\": ",
+		(unsigned long long)out_samples(file->sample));
+	json_datetime(f, file->sample);
+#ifdef HAVE_MMAP_OUTPUT
+	if (use_mmap)
+		fprintf(f, ", \"core:header_bytes\": %d", FX2ADC_MMAP_DATA_OFFSET);
+#endif
+	fprintf(f, "}");
+	for (item = file->next; item != end; item = item->next) {
+		if (item->type != META_GAP || item->pos == file->pos)
+			continue;
+		fprintf(f, ",\n    {\"core:sample_start\": %llu, \"core:global_index\": %llu, \"core:datetime\": ",
+			(unsigned long long)out_offset(file, item->pos),
+			(unsigned long long)out_samples(item->sample));
+		json_datetime(f, item->sample);
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n  ],\n  \"annotations\": [");
+
+	first = true;
+	if (seg.length) {
+		fprintf(f, "\n    {\"core:sample_start\": 0, \"core:label\": \"segment\", "
+			"\"core:comment\": \"file %s of the capture, first sample %llu\"}",
+			file->label, (unsigned long long)out_samples(file->sample));
+		first = false;
+	}
+	for (item = file->next; item != end; item = item->next) {
+		if (item->type == META_FILE)
+			continue;
+		fprintf(f, "%s\n    {\"core:sample_start\": %llu, ", first ? "" : ",",
+			(unsigned long long)out_offset(file, item->pos));
+		if (item->type == META_GAP) {
+			fprintf(f, "\"core:label\": \"overrun\", \"core:comment\": \"%llu samples lost\"}",
+				(unsigned long long)out_samples(item->count));
+		} else {
+			fprintf(f, "\"core:label\": ");
+			json_string(f, item->label);
+			fprintf(f, ", \"core:comment\": ");
+			json_string(f, item->text);
+			fprintf(f, "}");
+		}
+		first = false;
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	if (fclose(f) == 0)
+		rename(tmp, name);
+}
+
+/* write the metadata of the file starting with item, up to end */
+static void meta_write(struct meta_item *file, struct meta_item *end)
+{
+	char name[PATH_MAX];
+	unsigned int ch;
+
+	if (!split.enabled) {
+		meta_write_file(file, end, file->text, 0);
+		return;
+	}
+
+	for (ch = 0; ch < 2; ch++) {
+		channel_name(name, sizeof(name), file->text, ch);
+		meta_write_file(file, end, name, ch + 1);
+	}
+}
+
+static void meta_insert(struct meta_item **list, struct meta_item *item)
+{
+	/* the notes come from other threads, keep the list sorted */
+	while (*list && (*list)->pos <= item->pos)
+		list = &(*list)->next;
+	item->next = *list;
+	*list = item;
+}
+
+static void meta_free(struct meta_item *list)
+{
+	struct meta_item *next;
+
+	for (; list; list = next) {
+		next = list->next;
+		free(list);
+	}
+}
+
+static void *meta_thread(void *arg)
+{
+	struct meta_item *list = NULL, *item, *next, **p;
+	struct timespec ts;
+	bool done = false;
+
+	while (!done) {
+		pthread_mutex_lock(&meta.lock);
+		while (!meta.queue && !meta.done)
+			pthread_cond_wait(&meta.cond, &meta.lock);
+		item = meta.queue;
+		meta.queue = NULL;
+		meta.queue_tail = &meta.queue;
+		done = meta.done;
+		pthread_mutex_unlock(&meta.lock);
+
+		for (; item; item = next) {
+			next = item->next;
+			item->next = NULL;
+
+			if (item->type != META_FILE) {
+				/* always preceded by the first file */
+				if (list)
+					meta_insert(&list->next, item);
+				else
+					free(item);
+				continue;
+			}
+
+			/* a file is complete once the next one starts, a
+			 * drop right at the boundary belongs to the new one */
+			for (p = &list; *p && (*p)->pos < item->pos; p = &(*p)->next)
+				;
+			item->next = *p;
+			*p = NULL;
+			if (list)
+				meta_write(list, NULL);
+			meta_free(list);
+			list = item;
+		}
+
+		if (list)
+			meta_write(list, NULL);
+
+		/* the rest of the interval, unless the capture ends */
+		pthread_mutex_lock(&meta.lock);
+		if (!meta.done && !done) {
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_sec += META_INTERVAL_MS / 1000;
+			while (!meta.done && pthread_cond_timedwait(&meta.cond, &meta.lock, &ts) == 0)
+				;
+		}
+		pthread_mutex_unlock(&meta.lock);
+	}
+
+	meta_free(list);
+
+	return NULL;
+}
+
+static int meta_start(void)
+{
+	meta.queue_tail = &meta.queue;
+	pthread_mutex_init(&meta.lock, NULL);
+	pthread_cond_init(&meta.cond, NULL);
+
+	if (pthread_create(&meta.thread, NULL, meta_thread, NULL))
+		return -1;
+
+	meta.enabled = true;
+	return 0;
+}
+
+static void meta_stop(void)
+{
+	if (!meta.enabled)
+		return;
+
+	pthread_mutex_lock(&meta.lock);
+	meta.done = true;
+	pthread_cond_signal(&meta.cond);
+	pthread_mutex_unlock(&meta.lock);
+	pthread_join(meta.thread, NULL);
+}
+
+/* remember a drop or a window start at the head, called with the ring
+ * lock held */
+static void gap_add(void)
+{
+	unsigned int last = (wr.gap_first + wr.gap_num - 1) % MAX_GAPS;
+
+	/* with too many gaps in the ring, the later ones are moved
+	 * forward to the last one remembered */
+	if (wr.gap_num && (wr.gaps[last].pos == wr.head || wr.gap_num == MAX_GAPS)) {
+		wr.gaps[last].lost = wr.lost;
+		wr.gaps[last].shift = wr.shift;
+		return;
+	}
+
+	last = (wr.gap_first + wr.gap_num++) % MAX_GAPS;
+	wr.gaps[last].pos = wr.head;
+	wr.gaps[last].lost = wr.lost;
+	wr.gaps[last].shift = wr.shift;
+}
+
+/* sample index of the byte at ring position pos, which must not be
+ * behind the tail, called with the ring lock held */
+static uint64_t ring_sample(uint64_t pos)
+{
+	uint64_t lost;
+
+	while (wr.gap_num && wr.gaps[wr.gap_first].pos <= pos) {
+		lost = wr.gaps[wr.gap_first].lost - wr.lost_written;
+		wr.lost_written = wr.gaps[wr.gap_first].lost;
+		wr.shift_written = wr.gaps[wr.gap_first].shift;
+		if (lost)
+			meta_push(META_GAP, wr.gaps[wr.gap_first].pos,
+				  wr.gaps[wr.gap_first].pos + wr.lost_written + wr.shift_written,
+				  lost, NULL, NULL);
+		wr.gap_first = (wr.gap_first + 1) % MAX_GAPS;
+		wr.gap_num--;
+	}
+
+	return pos + wr.lost_written + wr.shift_written;
+}
+
+/* like ring_sample(), for data that isn't written */
+static void ring_skip(uint64_t pos)
+{
+	while (wr.gap_num && wr.gaps[wr.gap_first].pos <= pos) {
+		wr.lost_written = wr.gaps[wr.gap_first].lost;
+		wr.shift_written = wr.gaps[wr.gap_first].shift;
+		wr.gap_first = (wr.gap_first + 1) % MAX_GAPS;
+		wr.gap_num--;
+	}
+}
+
+/* copy samples into the ring, or count them as lost if it is full */
+static void ring_put(const unsigned char *buf, size_t len)
+{
+	size_t fill, pos, part;
+
+	pthread_mutex_lock(&wr.lock);
+	fill = wr.head - wr.tail;
+	if (wr.failed || fill + len > wr.size) {
+		wr.lost += len;
+		gap_add();
+		pthread_mutex_unlock(&wr.lock);
+		return;
+	}
+	pthread_mutex_unlock(&wr.lock);
+
+	/* the writer never touches the free part of the ring */
+	pos = wr.head % wr.size;
+	part = wr.size - pos < len ? wr.size - pos : len;
+	memcpy(wr.buf + pos, buf, part);
+	memcpy(wr.buf, buf + part, len - part);
+
+	pthread_mutex_lock(&wr.lock);
+	wr.head += len;
+	if (fill + len > wr.high_water)
+		wr.high_water = fill + len;
+	pthread_cond_signal(&wr.cond);
+	pthread_mutex_unlock(&wr.lock);
+}
+
+/* update the time reference with a transfer of len bytes that just
+ * completed, the earliest completion has the least delay */
+static void sched_clock(uint32_t len)
+{
+	struct timespec ts;
+	int64_t now, ref;
+
+	timespec_get(&ts, TIME_UTC);
+	now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	ref = now - (int64_t)((sched.stream + len) / channels * 1e9 / seg.rate);
+
+	if (!sched.ref_ns || ref < sched.ref_ns)
+		sched.ref_ns = ref;
+	if (!sched.ref_next || ref < sched.ref_next)
+		sched.ref_next = ref;
+	if (now >= sched.ref_renew) {
+		sched.ref_ns = sched.ref_next;
+		sched.ref_next = ref;
+		sched.ref_renew = now + REF_INTERVAL_MS * 1000000LL;
+	}
+}
+
+/* the window starts at stream position pos, the writer may open its
+ * file; the ring position is aligned for direct I/O */
+static void sched_begin(struct window *w, uint64_t pos)
+{
+	if (pos > w->start)
+		w->late = pos - w->start;
+	w->start = pos;
+	w->begun = true;
+
+	pthread_mutex_lock(&wr.lock);
+	wr.head = (wr.head + sched.align - 1) / sched.align * sched.align;
+	wr.shift = pos - wr.head - wr.lost;
+	gap_add();
+	w->ring_start = wr.head;
+	seg.start_ns = sched.ref_ns;
+	pthread_cond_signal(&wr.cond);
+	pthread_mutex_unlock(&wr.lock);
+}
+
+static void sched_end(struct window *w)
+{
+	pthread_mutex_lock(&wr.lock);
+	w->ring_end = wr.head;
+	if (sched.active && w == &sched.win[sched.writing])
+		seg.end = w->ring_end;
+	pthread_cond_signal(&wr.cond);
+	pthread_mutex_unlock(&wr.lock);
+}
+
+/* pass the parts of a transfer that are inside windows on to the ring,
+ * returns true once the last window is complete */
+static bool sched_pass(const unsigned char *buf, uint32_t len)
+{
+	struct window *w;
+	uint64_t pos, n;
+	uint32_t off = 0;
+
+	if (wr.failed)
+		return true;
+
+	sched_clock(len);
+	while (off < len && sched.cur < sched.num) {
+		w = &sched.win[sched.cur];
+		pos = sched.stream + off;
+
+		if (!w->begun) {
+			/* the reference improves until the start is reached */
+			if (w->at_ns) {
+				n = w->at_ns > sched.ref_ns ?
+				    (uint64_t)((w->at_ns - sched.ref_ns) * 1e-9 * seg.rate + 0.5) : 0;
+				w->start = n * channels;
+			}
+			if (w->start > pos) {
+				n = w->start - pos;
+				off += n < len - off ? n : len - off;
+				continue;
+			}
+			sched_begin(w, pos);
+		}
+
+		n = len - off;
+		if (w->length && w->start + w->length - pos < n)
+			n = w->start + w->length - pos;
+		ring_put(buf + off, n);
+		off += n;
+
+		if (w->length && pos + n == w->start + w->length) {
+			sched_end(w);
+			sched.cur++;
+		}
+	}
+	sched.stream += len;
+
+	return sched.cur == sched.num;
+}
+
+static void fx2adc_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	bool last = false;
+
+	if (ctx) {
+		if (do_exit)
+			return;
+
+		if (sched.num) {
+			last = sched_pass(buf, len);
+			goto out;
+		}
+
+		if ((bytes_to_read > 0) && (bytes_to_read <= len)) {
+			len = bytes_to_read;
+			last = true;
+		}
+
+		if (bytes_to_read > 0)
+			bytes_to_read -= len;
+
+		ring_put(buf, len);
+out:
+		if (last) {
+			do_exit = 1;
+			fx2adc_cancel_async(dev);
+		}
+	}
+}
+
+#ifdef HAVE_DIRECT_IO
+/* allocate the file ahead of the writes, in large steps, so that the
+ * filesystem can lay it out contiguously; it is cut to its real length
+ * at close */
+static void output_reserve(struct output *o, uint64_t end)
+{
+	uint64_t len;
+
+	if (end <= o->allocated || o->no_fallocate)
+		return;
+
+	len = (end - o->allocated + FALLOCATE_STEP - 1) / FALLOCATE_STEP * FALLOCATE_STEP;
+	if (fallocate(o->fd, 0, o->allocated, len) < 0) {
+		fprintf(stderr, "Failed to preallocate the file: %s\n", strerror(errno));
+		o->no_fallocate = true;
+		return;
+	}
+	o->allocated += len;
+}
+#endif
+
+#ifdef HAVE_MMAP_OUTPUT
+/*
+ * Memory mapped output: the file is grown with ftruncate() ahead of the
+ * window that is mapped, the samples are copied into it and their length
+ * is published in the header, see fx2adc_mmap.h. Behind the writes, the
+ * pages are synced and dropped from the mapping, they stay in the page
+ * cache for the readers.
+ */
+static int output_open_map(struct output *o, const char *filename)
+{
+	struct fx2adc_mmap_header *hdr;
+
+	o->map_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (o->map_fd < 0)
+		return -1;
+
+	if (ftruncate(o->map_fd, FX2ADC_MMAP_DATA_OFFSET) < 0)
+		goto err;
+
+	hdr = mmap(NULL, FX2ADC_MMAP_DATA_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   o->map_fd, 0);
+	if (hdr == MAP_FAILED)
+		goto err;
+
+	hdr->version = FX2ADC_MMAP_VERSION;
+	hdr->data_offset = FX2ADC_MMAP_DATA_OFFSET;
+	hdr->sample_rate = resampler.rs ? (uint32_t)(resample_rate(resampler.rs) + 0.5) : seg.rate;
+	hdr->start_ns = seg.start_ns;
+	__atomic_store_n(&hdr->magic, FX2ADC_MMAP_MAGIC, __ATOMIC_RELEASE);
+	o->hdr = hdr;
+
+	return 0;
+err:
+	close(o->map_fd);
+	return -1;
+}
+
+static void output_map_publish(struct output *o)
+{
+	__atomic_add_fetch(&o->hdr->commit_futex, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	syscall(SYS_futex, &o->hdr->commit_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* start the writeback of the pages up to end and unmap them */
+static void output_map_retire(struct output *o, uint64_t end)
+{
+	uint8_t *p = o->win + (o->retired - o->win_start);
+
+	if (end <= o->retired)
+		return;
+
+	/* MS_ASYNC only schedules the writeback */
+	msync(p, end - o->retired, MS_ASYNC);
+#ifdef MADV_DONTNEED
+	madvise(p, end - o->retired, MADV_DONTNEED);
+#endif
+	o->retired = end;
+}
+
+/* map the window starting at the current offset, the file is grown in
+ * large steps; on Linux the space is allocated first, so that a full disk
+ * is an error here instead of a SIGBUS in the copy */
+static int output_map_window(struct output *o)
+{
+	uint64_t end = o->offset + MMAP_WINDOW, len;
+	void *win;
+
+	if (o->win) {
+		output_map_retire(o, o->offset);
+		munmap(o->win, MMAP_WINDOW);
+		o->win = NULL;
+	}
+
+	if (end > o->allocated) {
+		len = (end - o->allocated + FALLOCATE_STEP - 1) / FALLOCATE_STEP * FALLOCATE_STEP;
+#ifdef __linux__
+		if (!o->no_fallocate &&
+		    fallocate(o->map_fd, FALLOC_FL_KEEP_SIZE,
+			      FX2ADC_MMAP_DATA_OFFSET + o->allocated, len) < 0) {
+			if (errno != EOPNOTSUPP)
+				return -1;
+			o->no_fallocate = true;
+		}
+#endif
+		if (ftruncate(o->map_fd, FX2ADC_MMAP_DATA_OFFSET + o->allocated + len) < 0)
+			return -1;
+		o->allocated += len;
+	}
+
+	win = mmap(NULL, MMAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, o->map_fd,
+		   FX2ADC_MMAP_DATA_OFFSET + o->offset);
+	if (win == MAP_FAILED)
+		return -1;
+
+	o->win = win;
+	o->win_start = o->offset;
+	o->retired = o->offset;
+
+	return 0;
+}
+
+static int output_write_map(struct output *o, const uint8_t *buf, size_t len)
+{
+	size_t part;
+
+	while (len) {
+		if (!o->win || o->offset == o->win_start + MMAP_WINDOW) {
+			if (output_map_window(o) < 0)
+				return -1;
+		}
+		part = o->win_start + MMAP_WINDOW - o->offset;
+		if (part > len)
+			part = len;
+		memcpy(o->win + (o->offset - o->win_start), buf, part);
+		buf += part;
+		len -= part;
+		o->offset += part;
+	}
+
+	/* the samples are stored before their length */
+	__atomic_store_n(&o->hdr->committed, o->offset, __ATOMIC_RELEASE);
+	output_map_publish(o);
+
+	if (o->offset - o->retired >= 2 * MMAP_RETIRE)
+		output_map_retire(o, o->offset - (o->offset - o->win_start) % MMAP_RETIRE - MMAP_RETIRE);
+
+	return 0;
+}
+
+static void output_close_map(struct output *o)
+{
+	if (o->win)
+		munmap(o->win, MMAP_WINDOW);
+	o->win = NULL;
+
+	if (ftruncate(o->map_fd, FX2ADC_MMAP_DATA_OFFSET + o->offset) < 0)
+		fprintf(stderr, "Failed to truncate the file: %s\n", strerror(errno));
+
+	__atomic_or_fetch(&o->hdr->flags, FX2ADC_MMAP_CLOSED, __ATOMIC_RELEASE);
+	output_map_publish(o);
+
+	munmap(o->hdr, FX2ADC_MMAP_DATA_OFFSET);
+	o->hdr = NULL;
+	close(o->map_fd);
+}
+#endif
+
+/* -c split: deinterleave the samples into the files of the channels */
+static int output_split(struct output *o, const uint8_t *buf, size_t len,
+			int (*write)(struct output *, const uint8_t *, size_t))
+{
+	size_t part;
+
+	while (len) {
+		part = len < SPLIT_CHUNK ? len : SPLIT_CHUNK;
+		convert_deinterleave(buf, part, split.buf[0], split.buf[1]);
+		if (write(o->ch[0], split.buf[0], part / 2) < 0 ||
+		    write(o->ch[1], split.buf[1], part / 2) < 0)
+			return -1;
+		buf += part;
+		len -= part;
+		o->offset += part;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_DIRECT_IO
+static int output_write_tail(struct output *o, const uint8_t *buf, size_t len);
+#endif
+
+static int output_write(struct output *o, const uint8_t *buf, size_t len)
+{
+#ifdef HAVE_DIRECT_IO
+	size_t whole;
+	ssize_t r;
+#endif
+
+	if (o->ch[0])
+		return output_split(o, buf, len, output_write);
+#ifdef HAVE_MMAP_OUTPUT
+	if (o->hdr)
+		return output_write_map(o, buf, len);
+#endif
+#ifdef HAVE_DIRECT_IO
+	if (o->fd >= 0) {
+		/* a window ends within a block */
+		whole = len - len % DIRECT_ALIGN;
+		if (whole < len) {
+			if (whole && output_write(o, buf, whole) < 0)
+				return -1;
+			return output_write_tail(o, buf + whole, len - whole);
+		}
+		output_reserve(o, o->offset + len);
+		while (len) {
+			r = pwrite(o->fd, buf, len, o->offset);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return -1;
+			buf += r;
+			len -= r;
+			o->offset += r;
+		}
+		return 0;
+	}
+#endif
+	if (fwrite(buf, 1, len, o->file) != len)
+		return -1;
+	o->offset += len;
+
+	return 0;
+}
+
+#ifdef HAVE_DIRECT_IO
+/* the last partial block goes out padded, the padding is cut off at close */
+static int output_write_tail(struct output *o, const uint8_t *buf, size_t len)
+{
+	void *blk;
+	int r;
+
+	if (o->ch[0])
+		return output_split(o, buf, len, output_write_tail);
+
+	if (posix_memalign(&blk, DIRECT_ALIGN, DIRECT_ALIGN))
+		return -1;
+
+	memset(blk, 0, DIRECT_ALIGN);
+	memcpy(blk, buf, len);
+	r = output_write(o, blk, DIRECT_ALIGN);
+	o->offset -= DIRECT_ALIGN - len;
+	free(blk);
+
+	return r;
+}
+
+/* the writes have to be whole blocks */
+static bool output_direct(const struct output *o)
+{
+	return o->fd >= 0 || (o->ch[0] && o->ch[0]->fd >= 0);
+}
+#endif
+
+/* compressed data doesn't come in blocks, for direct I/O it is
+ * collected first */
+static int output_append(struct output *o, const uint8_t *buf, size_t len)
+{
+#ifdef HAVE_DIRECT_IO
+	void *stage;
+	size_t part;
+
+	if (o->fd >= 0) {
+		if (!o->stage) {
+			if (posix_memalign(&stage, DIRECT_ALIGN, DIRECT_MIN_WRITE))
+				return -1;
+			o->stage = stage;
+		}
+		while (len) {
+			part = DIRECT_MIN_WRITE - o->staged < len ? DIRECT_MIN_WRITE - o->staged : len;
+			memcpy(o->stage + o->staged, buf, part);
+			o->staged += part;
+			buf += part;
+			len -= part;
+			if (o->staged == DIRECT_MIN_WRITE) {
+				if (output_write(o, o->stage, DIRECT_MIN_WRITE) < 0)
+					return -1;
+				o->staged = 0;
+			}
+		}
+		return 0;
+	}
+#endif
+	return output_write(o, buf, len);
+}
+
+/* the file holds all its samples: the staged data is written, a FLAC
+ * stream gets their number in the header, unless it is a pipe */
+static int output_finish(struct output *o, uint64_t samples)
+{
+	uint8_t hdr[FLAC_HEADER_SIZE];
+#ifdef HAVE_DIRECT_IO
+	size_t whole;
+	void *blk;
+	int r = 0;
+#endif
+
+#ifdef HAVE_DIRECT_IO
+	/* what is left of the compressed or resampled data */
+	if (o->fd >= 0 && o->staged) {
+		whole = o->staged - o->staged % DIRECT_ALIGN;
+		if (whole)
+			r = output_write(o, o->stage, whole);
+		if (r == 0 && o->staged > whole)
+			r = output_write_tail(o, o->stage + whole, o->staged - whole);
+		o->staged = 0;
+		if (r < 0)
+			return -1;
+	}
+#endif
+
+	if (!flac.enabled)
+		return 0;
+
+	flac_header(hdr, seg.rate, flac.channels, samples / flac.channels);
+
+#ifdef HAVE_DIRECT_IO
+	if (o->fd >= 0) {
+		if (posix_memalign(&blk, DIRECT_ALIGN, DIRECT_ALIGN))
+			return -1;
+
+		/* the header is part of the first block */
+		memset(blk, 0, DIRECT_ALIGN);
+		if (pread(o->fd, blk, DIRECT_ALIGN, 0) < 0)
+			r = -1;
+		memcpy(blk, hdr, sizeof(hdr));
+		if (r == 0 && pwrite(o->fd, blk, DIRECT_ALIGN, 0) != DIRECT_ALIGN)
+			r = -1;
+		free(blk);
+		return r;
+	}
+#endif
+
+	if (fseek(o->file, 0, SEEK_SET) == 0 &&
+	    fwrite(hdr, 1, sizeof(hdr), o->file) != sizeof(hdr))
+		return -1;
+
+	return 0;
+}
+
+/* every file starts with the header, the length is filled in at the end */
+static int output_header(struct output *o)
+{
+	uint8_t hdr[FLAC_HEADER_SIZE];
+
+	if (!flac.enabled)
+		return 0;
+
+	flac_header(hdr, seg.rate, flac.channels, 0);
+	return output_append(o, hdr, sizeof(hdr));
+}
+
+static int output_open_file(struct output *o, const char *filename)
+{
+	memset(o, 0, sizeof(*o));
+	o->fd = -1;
+	snprintf(o->name, sizeof(o->name), "%s", filename);
+
+	if (strcmp(filename, "-") == 0) { /* Write samples to stdout */
+		o->file = stdout;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		return output_header(o);
+	}
+
+#ifdef HAVE_MMAP_OUTPUT
+	if (use_mmap)
+		return output_open_map(o, filename);
+#endif
+
+#ifdef HAVE_DIRECT_IO
+	if (direct_io) {
+		o->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		if (o->fd >= 0) {
+			/* the length is known, allocate it at once */
+			if (seg.length && !flac.enabled)
+				output_reserve(o, seg.length / (split.enabled ? channels : 1));
+			return output_header(o);
+		}
+		if (errno != EINVAL)
+			return -1;
+		fprintf(stderr, "Direct I/O not supported for %s, using buffered writes\n",
+			filename);
+		direct_io = false;
+	}
+#endif
+
+	o->file = fopen(filename, "wb");
+
+	return o->file ? output_header(o) : -1;
+}
+
+static void output_close(struct output *o);
+
+/* with -c split, the output is the pair of the channel files */
+static int output_open(struct output *o, const char *filename)
+{
+	char name[PATH_MAX];
+	unsigned int ch;
+
+	if (!split.enabled)
+		return output_open_file(o, filename);
+
+	memset(o, 0, sizeof(*o));
+	o->fd = -1;
+	snprintf(o->name, sizeof(o->name), "%s", filename);
+
+	for (ch = 0; ch < 2; ch++) {
+		channel_name(name, sizeof(name), filename, ch);
+		o->ch[ch] = malloc(sizeof(*o->ch[ch]));
+		if (!o->ch[ch] || output_open_file(o->ch[ch], name) < 0) {
+			free(o->ch[ch]);
+			o->ch[ch] = NULL;
+			if (ch) {
+				output_close(o->ch[0]);
+				remove(o->ch[0]->name);
+				free(o->ch[0]);
+				o->ch[0] = NULL;
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void output_close(struct output *o)
+{
+	unsigned int ch;
+
+	if (o->ch[0]) {
+		for (ch = 0; ch < 2; ch++) {
+			output_close(o->ch[ch]);
+			free(o->ch[ch]);
+			o->ch[ch] = NULL;
+		}
+		return;
+	}
+
+#ifdef HAVE_MMAP_OUTPUT
+	if (o->hdr) {
+		output_close_map(o);
+		return;
+	}
+#endif
+#ifdef HAVE_DIRECT_IO
+	if (o->fd >= 0) {
+		if (ftruncate(o->fd, o->offset) < 0)
+			fprintf(stderr, "Failed to truncate the file: %s\n", strerror(errno));
+		close(o->fd);
+		o->fd = -1;
+		free(o->stage);
+		o->stage = NULL;
+		return;
+	}
+#endif
+	if (o->file && o->file != stdout)
+		fclose(o->file);
+	o->file = NULL;
+}
+
+static int output_rename(struct output *o, const char *name)
+{
+	char to[PATH_MAX];
+	unsigned int ch;
+
+	for (ch = 0; ch < 2 && o->ch[ch]; ch++) {
+		channel_name(to, sizeof(to), name, ch);
+		if (rename(o->ch[ch]->name, to) < 0)
+			return -1;
+		snprintf(o->ch[ch]->name, sizeof(o->ch[ch]->name), "%s", to);
+	}
+	if (!o->ch[0] && rename(o->name, name) < 0)
+		return -1;
+	snprintf(o->name, sizeof(o->name), "%s", name);
+
+	return 0;
+}
+
+/* delete the closed output of the given name and its metadata */
+static void output_remove(const char *name)
+{
+	char data[PATH_MAX], mname[PATH_MAX + 16];
+	unsigned int ch;
+
+	for (ch = 0; ch < (split.enabled ? 2U : 1U); ch++) {
+		if (split.enabled)
+			channel_name(data, sizeof(data), name, ch);
+		else
+			snprintf(data, sizeof(data), "%s", name);
+		remove(data);
+		if (meta.enabled) {
+			meta_name(mname, sizeof(mname), data);
+			remove(mname);
+		}
+	}
+}
+
+/* file name of the segment starting with the given sample */
+static void segment_name(char *name, size_t size, unsigned int num, uint64_t sample)
+{
+	char fmt[PATH_MAX];
+	const char *t;
+	size_t n = 0;
+	time_t start;
+	struct tm tm;
+	int r;
+
+	sample /= channels;
+	for (t = seg.template; *t && n < sizeof(fmt) - 1; t++) {
+		if (t[0] == '%' && (t[1] == 'n' || t[1] == 'i')) {
+			if (t[1] == 'n')
+				r = snprintf(fmt + n, sizeof(fmt) - n, "%04u", num);
+			else
+				r = snprintf(fmt + n, sizeof(fmt) - n, "%llu",
+					     (unsigned long long)sample);
+			n += r > 0 ? (size_t)r : 0;
+			t++;
+			continue;
+		}
+		fmt[n++] = *t;
+		if (t[0] == '%' && t[1])
+			fmt[n++] = *++t;
+	}
+	fmt[n < sizeof(fmt) ? n : sizeof(fmt) - 1] = '\0';
+
+	start = (seg.start_ns + (seg.rate ? sample * 1000000000ULL / seg.rate : 0)) / 1000000000ULL;
+#ifdef _WIN32
+	gmtime_s(&tm, &start);
+#else
+	gmtime_r(&start, &tm);
+#endif
+	if (!strftime(name, size, fmt, &tm))
+		snprintf(name, size, "%s", fmt);
+}
+
+/* open the file of the segment after the current one, ahead of time */
+static int segment_open_next(void)
+{
+	char name[PATH_MAX];
+
+	seg.next_sample = seg.first_sample + seg.length;
+	segment_name(name, sizeof(name), seg.num + 1, seg.next_sample);
+	if (output_open(&seg.next, name) < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void segment_log(uint64_t samples)
+{
+	char name[PATH_MAX];
+	unsigned int ch;
+
+	if (!seg.index)
+		return;
+
+	for (ch = 0; ch < (split.enabled ? 2U : 1U); ch++) {
+		if (split.enabled)
+			channel_name(name, sizeof(name), out.name, ch);
+		else
+			snprintf(name, sizeof(name), "%s", out.name);
+		fprintf(seg.index, "%s %llu %llu\n", name,
+			(unsigned long long)(seg.first_sample / channels),
+			(unsigned long long)(samples / channels));
+	}
+	fflush(seg.index);
+}
+
+/* the current segment is complete, switch to the next one, which
+ * starts with the given sample */
+static int segment_switch(uint64_t sample)
+{
+	char name[PATH_MAX];
+
+	if (output_finish(&out, seg.length) < 0)
+		fprintf(stderr, "Failed to complete %s: %s\n", out.name, strerror(errno));
+	output_close(&out);
+	segment_log(seg.length);
+
+	out = seg.next;
+	seg.num++;
+	seg.first_sample = sample;
+	seg.start = seg.end;
+	seg.end += seg.length;
+
+	/* samples were dropped, the name may have to change */
+	if (sample != seg.next_sample) {
+		segment_name(name, sizeof(name), seg.num, sample);
+		if (strcmp(name, out.name)) {
+			if (output_rename(&out, name) < 0)
+				fprintf(stderr, "Failed to rename %s: %s\n", out.name,
+					strerror(errno));
+		}
+	}
+
+	snprintf(name, sizeof(name), "%u", seg.num);
+	meta_push(META_FILE, seg.start, sample, 0, name, out.name);
+
+	return segment_open_next();
+}
+
+/* a trigger fired at ring position pos, open the file of the event,
+ * called with the ring lock held */
+static void event_start(uint64_t pos, const char *source)
+{
+	char name[PATH_MAX], num[16];
+	uint64_t start;
+	int r;
+
+	start = pos > trig.pre ? (pos - trig.pre) / trig.align * trig.align : 0;
+	if (start < wr.tail)
+		start = wr.tail;
+	wr.tail = start;
+	ring_skip(start);
+
+	seg.start = start;
+	seg.first_sample = start + wr.lost_written;
+	segment_name(name, sizeof(name), seg.num, seg.first_sample);
+
+	/* the callback must not wait for the file system */
+	pthread_mutex_unlock(&wr.lock);
+	r = output_open(&out, name);
+	pthread_mutex_lock(&wr.lock);
+	if (r < 0) {
+		fprintf(stderr, "Failed to open %s: %s, event lost\n", name, strerror(errno));
+		return;
+	}
+
+	fprintf(stderr, "Trigger by %s at sample %llu, writing %s\n", source,
+		(unsigned long long)((pos + wr.lost_written) / channels), name);
+	trig.active = true;
+	trig.events++;
+	seg.end = (pos + trig.post + trig.align - 1) / trig.align * trig.align;
+
+	snprintf(num, sizeof(num), "%u", seg.num);
+	meta_push(META_FILE, start, seg.first_sample, 0, num, out.name);
+	meta_note(pos, "trigger", strcmp(source, "command") ? source : trig.comment);
+}
+
+/* the event or window is written completely, called with the ring
+ * lock held */
+static int event_end(void)
+{
+	uint64_t samples = seg.end - seg.start;
+	int r;
+
+	trig.active = false;
+	if (sched.active) {
+		sched.active = false;
+		sched.writing++;
+	}
+	seg.end = UINT64_MAX;
+
+	pthread_mutex_unlock(&wr.lock);
+	r = output_finish(&out, samples);
+	if (r < 0)
+		fprintf(stderr, "Failed to complete %s: %s\n", out.name, strerror(errno));
+	output_close(&out);
+	segment_log(samples);
+	seg.num++;
+	pthread_mutex_lock(&wr.lock);
+
+	return r;
+}
+
+/* open the file of the next window once the callback started it,
+ * called with the ring lock held */
+static void sched_poll(void)
+{
+	struct window *w = &sched.win[sched.writing];
+	char name[PATH_MAX], num[16];
+	int r;
+
+	if (wr.failed || sched.active || sched.writing == sched.num || !w->begun)
+		return;
+
+	/* the padding before it is never written */
+	wr.tail = w->ring_start;
+	seg.start = wr.tail;
+	seg.first_sample = ring_sample(wr.tail);
+	if (w->name)
+		snprintf(name, sizeof(name), "%s", w->name);
+	else
+		segment_name(name, sizeof(name), seg.num, seg.first_sample);
+
+	pthread_mutex_unlock(&wr.lock);
+	r = output_open(&out, name);
+#ifdef HAVE_DIRECT_IO
+	if (r == 0 && out.fd >= 0 && w->length && !flac.enabled)
+		output_reserve(&out, w->length);
+#endif
+	pthread_mutex_lock(&wr.lock);
+	if (r < 0) {
+		fprintf(stderr, "Failed to open %s: %s, exiting!\n", name, strerror(errno));
+		wr.failed = true;
+		return;
+	}
+
+	if (w->late)
+		fprintf(stderr, "Window %u started %.3f ms late\n", sched.writing + 1,
+			w->late / channels * 1e3 / seg.rate);
+	fprintf(stderr, "Window %u at sample %llu, writing %s\n", sched.writing + 1,
+		(unsigned long long)(seg.first_sample / channels), name);
+	sched.active = true;
+	seg.end = w->ring_end;
+
+	snprintf(num, sizeof(num), "%u", seg.num);
+	meta_push(META_FILE, seg.start, seg.first_sample, 0, num, out.name);
+}
+
+/*
+ * Search the new samples for triggers, start an event or make the
+ * current one last until -A seconds after the last trigger. Without an
+ * event, the history beyond -P seconds is dropped; the writers call
+ * this at the top of their loop, not between writer_next() and queueing
+ * its result. Called with the ring lock held.
+ */
+static void trigger_poll(void)
+{
+	uint64_t first = UINT64_MAX, last = 0, end = wr.head;
+	const char *source = NULL;
+	size_t pos, len, f, l;
+	uint8_t prev;
+
+	if (trigger_signal) {
+		trigger_signal = 0;
+		first = last = end;
+		source = "signal";
+	}
+	if (trig.request) {
+		trig.request = false;
+		first = last = end;
+		source = "command";
+	}
+
+	/* a few GB/s, this doesn't hold up the callback */
+	while (trig.level && trig.scan < end) {
+		pos = trig.scan % wr.size;
+		len = end - trig.scan < wr.size - pos ? end - trig.scan : wr.size - pos;
+		prev = wr.buf[trig.scan ? (pos ? pos : wr.size) - 1 : 0];
+		if (trigger_scan(trig.type, trig.level, wr.buf + pos, len, prev, &f, &l)) {
+			if (trig.scan + f < first) {
+				first = trig.scan + f;
+				source = "samples";
+			}
+			if (trig.scan + l > last)
+				last = trig.scan + l;
+		}
+		trig.scan += len;
+	}
+
+	if (first != UINT64_MAX) {
+		if (!trig.active)
+			event_start(first, source);
+		if (trig.active && last + trig.post > seg.end)
+			seg.end = (last + trig.post + trig.align - 1) / trig.align * trig.align;
+	}
+
+	if (!trig.active && wr.head - wr.tail > trig.pre) {
+		wr.tail = (wr.head - trig.pre + trig.align - 1) / trig.align * trig.align;
+		ring_skip(wr.tail);
+	}
+}
+
+#ifndef _WIN32
+static void fifo_command(char *cmd)
+{
+	if (strncmp(cmd, "trigger", 7) || (cmd[7] && cmd[7] != ' ')) {
+		fprintf(stderr, "Unknown command: %s\n", cmd);
+		return;
+	}
+
+	pthread_mutex_lock(&wr.lock);
+	trig.request = true;
+	snprintf(trig.comment, sizeof(trig.comment), "%s", cmd[7] ? cmd + 8 : "command");
+	pthread_cond_signal(&wr.cond);
+	pthread_mutex_unlock(&wr.lock);
+}
+
+static void *fifo_thread(void *arg)
+{
+	char line[256], *p;
+	struct pollfd pfd;
+	size_t n = 0;
+	ssize_t r;
+
+	/* opened for writing as well, so that there is no end of file
+	 * when a writer closes it */
+	pfd.fd = open(trig.fifo, O_RDWR | O_NONBLOCK);
+	if (pfd.fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", trig.fifo, strerror(errno));
+		return NULL;
+	}
+	pfd.events = POLLIN;
+
+	while (!do_exit) {
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+		r = read(pfd.fd, line + n, sizeof(line) - 1 - n);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (r <= 0)
+			break;
+		n += r;
+		line[n] = '\0';
+		while ((p = strchr(line, '\n'))) {
+			*p = '\0';
+			if (p > line && p[-1] == '\r')
+				p[-1] = '\0';
+			if (line[0])
+				fifo_command(line);
+			n -= p + 1 - line;
+			memmove(line, p + 1, n + 1);
+		}
+		/* too long for a command */
+		if (n == sizeof(line) - 1)
+			n = 0;
+	}
+	close(pfd.fd);
+
+	return NULL;
+}
+
+static int fifo_start(void)
+{
+	struct stat st;
+
+	if (stat(trig.fifo, &st) < 0 && mkfifo(trig.fifo, 0600) < 0)
+		return -1;
+
+	if (pthread_create(&trig.fifo_thread, NULL, fifo_thread, NULL))
+		return -1;
+
+	trig.fifo_running = true;
+	return 0;
+}
+#endif
+
+/* switch to the next segment if the tail reached its end, called with
+ * the ring lock held */
+static int writer_segment_done(void)
+{
+	uint64_t sample;
+	int r;
+
+	if (wr.tail != seg.end)
+		return 0;
+
+	if (trig.enabled || sched.files)
+		return event_end();
+
+	sample = ring_sample(wr.tail);
+	pthread_mutex_unlock(&wr.lock);
+	r = segment_switch(sample);
+	pthread_mutex_lock(&wr.lock);
+
+	return r;
+}
+
+/* next contiguous part of the ring to write, starting at byte from,
+ * called with the ring lock held */
+static size_t writer_next(uint64_t from, size_t *pos)
+{
+	size_t len;
+
+	/* between events or windows */
+	if ((trig.enabled && !trig.active) || (sched.files && !sched.active))
+		return 0;
+
+	*pos = from % wr.size;
+	len = wr.head - from;
+	if (len > wr.size - *pos)
+		len = wr.size - *pos;
+	if (len > MAX_WRITE_LENGTH)
+		len = MAX_WRITE_LENGTH;
+	if (len > seg.end - from)
+		len = seg.end - from;
+
+	/* a FLAC job, whole blocks unless the stream ends there */
+	if (flac.enabled) {
+		if (len > FLAC_CHUNK)
+			len = FLAC_CHUNK;
+		if (len < FLAC_CHUNK && len < wr.size - *pos &&
+		    len < seg.end - from && !wr.done)
+			return 0;
+		if (len < seg.end - from && !(wr.done && from + len == wr.head))
+			len -= len % (FLAC_BLOCK_SIZE * flac.channels);
+		return len;
+	}
+
+	/* the resampled data is staged for direct I/O */
+	if (resampler.rs)
+		return len;
+
+#ifdef HAVE_DIRECT_IO
+	/* whole blocks only, of every channel file, collect a large write
+	 * unless the end of the ring or the segment is reached; the rest is
+	 * written when the capture ends */
+	if (output_direct(&out)) {
+		if (len < DIRECT_MIN_WRITE && len < wr.size - *pos &&
+		    len < seg.end - from && !wr.done)
+			return 0;
+		/* a window may end anywhere */
+		if (from + len != seg.end)
+			len -= len % (DIRECT_ALIGN * channels);
+	}
+#endif
+
+	return len;
+}
+
+/* called by the writer once all data is written but less than a block */
+static void writer_finish_tail(void)
+{
+#ifdef HAVE_DIRECT_IO
+	if (output_direct(&out) && !wr.failed && wr.head != wr.tail) {
+		if (output_write_tail(&out, wr.buf + wr.tail % wr.size, wr.head - wr.tail) < 0) {
+			fprintf(stderr, "Failed to write the end of the file: %s\n",
+				strerror(errno));
+			wr.failed = true;
+			return;
+		}
+		wr.tail = wr.head;
+	}
+#endif
+}
+
+/* -R: resample the samples at ring position from and append them */
+static int writer_resample(const uint8_t *buf, size_t len, uint64_t from)
+{
+	uint64_t first;
+	size_t n;
+
+	n = resample_run(resampler.rs, buf, len, from, resampler.buf, &first);
+	if (!n)
+		return 0;
+
+	if (!resampler.started) {
+		resampler.first = first;
+		resampler.started = true;
+	}
+
+	return output_append(&out, resampler.buf, n);
+}
+
+static void *writer_thread(void *arg)
+{
+	size_t pos, len;
+	int r;
+
+	pthread_mutex_lock(&wr.lock);
+	while (1) {
+		if (trig.enabled)
+			trigger_poll();
+		if (sched.files)
+			sched_poll();
+		while (!(len = writer_next(wr.tail, &pos)) && !wr.done) {
+			pthread_cond_wait(&wr.cond, &wr.lock);
+			if (trig.enabled)
+				trigger_poll();
+			if (sched.files)
+				sched_poll();
+		}
+
+		if (!len)
+			break;
+		pthread_mutex_unlock(&wr.lock);
+
+		if (resampler.rs)
+			r = writer_resample(wr.buf + pos, len, wr.tail);
+		else
+			r = output_write(&out, wr.buf + pos, len);
+		if (r < 0) {
+			fprintf(stderr, "Short write, samples lost, exiting!\n");
+			pthread_mutex_lock(&wr.lock);
+			wr.failed = true;
+			break;
+		}
+
+		pthread_mutex_lock(&wr.lock);
+		wr.tail += len;
+		if (writer_segment_done() < 0) {
+			wr.failed = true;
+			break;
+		}
+		/* hand the drops written so far to the metadata */
+		if (meta.enabled)
+			ring_sample(wr.tail);
+	}
+	writer_finish_tail();
+	pthread_mutex_unlock(&wr.lock);
+
+	if (wr.failed) {
+		do_exit = 1;
+		fx2adc_cancel_async(dev);
+	}
+
+	return NULL;
+}
+
+static void *flac_worker(void *arg)
+{
+	struct flac_job *job;
+
+	pthread_mutex_lock(&flac.lock);
+	while (1) {
+		while (flac.taken == flac.num && !flac.exit)
+			pthread_cond_wait(&flac.work, &flac.lock);
+		if (flac.exit)
+			break;
+		job = &flac.jobs[(flac.first + flac.taken++) % flac.depth];
+		pthread_mutex_unlock(&flac.lock);
+
+		job->out_len = flac_encode(job->in, job->len, flac.channels,
+					   job->frame, job->out);
+
+		pthread_mutex_lock(&flac.lock);
+		job->ready = true;
+		pthread_cond_signal(&flac.done);
+	}
+	pthread_mutex_unlock(&flac.lock);
+
+	return NULL;
+}
+
+/* -j default, the USB thread needs a core as well */
+static int default_threads(void)
+{
+	int n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n > 2 ? n - 1 : 1;
+}
+
+static int flac_start(void)
+{
+	size_t size = flac_max_size(FLAC_CHUNK, flac.channels);
+	unsigned int i;
+
+	if (!flac_threads)
+		flac_threads = default_threads();
+	if (flac_threads > FLAC_MAX_THREADS)
+		flac_threads = FLAC_MAX_THREADS;
+
+	/* enough jobs that a thread can start on the next one while the
+	 * writer waits for the oldest */
+	flac.depth = 2 * flac_threads;
+	for (i = 0; i < flac.depth; i++) {
+		flac.jobs[i].out = malloc(size);
+		if (!flac.jobs[i].out)
+			return -1;
+		memset(flac.jobs[i].out, 0, size);
+	}
+
+	pthread_mutex_init(&flac.lock, NULL);
+	pthread_cond_init(&flac.work, NULL);
+	pthread_cond_init(&flac.done, NULL);
+
+	for (i = 0; i < (unsigned int)flac_threads; i++) {
+		if (pthread_create(&flac.threads[i], NULL, flac_worker, NULL))
+			break;
+		flac.num_threads++;
+	}
+
+	if (!flac.num_threads)
+		return -1;
+
+	fprintf(stderr, "Encoding FLAC on %d threads\n", flac.num_threads);
+
+	return 0;
+}
+
+static void flac_stop(void)
+{
+	unsigned int i;
+	int t;
+
+	if (flac.num_threads) {
+		pthread_mutex_lock(&flac.lock);
+		flac.exit = true;
+		pthread_cond_broadcast(&flac.work);
+		pthread_mutex_unlock(&flac.lock);
+
+		for (t = 0; t < flac.num_threads; t++)
+			pthread_join(flac.threads[t], NULL);
+		flac.num_threads = 0;
+	}
+
+	for (i = 0; i < FLAC_MAX_QUEUE; i++)
+		free(flac.jobs[i].out);
+}
+
+/* hand the ring part at pos to the encoder threads, called with the
+ * ring lock held */
+static void flac_queue(size_t pos, size_t len)
+{
+	struct flac_job *job = &flac.jobs[(flac.first + flac.num) % flac.depth];
+
+	job->in = wr.buf + pos;
+	job->len = len;
+	job->frame = flac.frame;
+	job->ready = false;
+	flac.frame += (len / flac.channels + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE;
+
+	pthread_mutex_lock(&flac.lock);
+	flac.num++;
+	pthread_cond_signal(&flac.work);
+	pthread_mutex_unlock(&flac.lock);
+}
+
+/* Keeps the encoder threads busy and writes their results in order. */
+static void *writer_thread_flac(void *arg)
+{
+	struct flac_job *job;
+	uint64_t submit;
+	size_t pos, len;
+	int r;
+
+	pthread_mutex_lock(&wr.lock);
+	submit = wr.tail;
+	while (1) {
+		/* the tail moves on its own between events and windows,
+		 * when nothing is in flight */
+		if (trig.enabled)
+			trigger_poll();
+		if (sched.files)
+			sched_poll();
+		if (!flac.num)
+			submit = wr.tail;
+		while (flac.num < flac.depth && (len = writer_next(submit, &pos))) {
+			flac_queue(pos, len);
+			submit += len;
+		}
+
+		if (!flac.num) {
+			/* the stream of the old file is complete */
+			if (wr.tail == seg.end) {
+				if (writer_segment_done() < 0) {
+					wr.failed = true;
+					break;
+				}
+				flac.frame = 0;
+				continue;
+			}
+			if (wr.done)
+				break;
+			pthread_cond_wait(&wr.cond, &wr.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&wr.lock);
+
+		job = &flac.jobs[flac.first];
+		pthread_mutex_lock(&flac.lock);
+		while (!job->ready)
+			pthread_cond_wait(&flac.done, &flac.lock);
+		pthread_mutex_unlock(&flac.lock);
+
+		r = output_append(&out, job->out, job->out_len);
+		flac.in_bytes += job->len;
+		flac.out_bytes += job->out_len;
+
+		pthread_mutex_lock(&flac.lock);
+		flac.first = (flac.first + 1) % flac.depth;
+		flac.num--;
+		flac.taken--;
+		pthread_mutex_unlock(&flac.lock);
+
+		pthread_mutex_lock(&wr.lock);
+		if (r < 0) {
+			fprintf(stderr, "Short write, samples lost, exiting!\n");
+			wr.failed = true;
+			break;
+		}
+		wr.tail += job->len;
+		if (meta.enabled)
+			ring_sample(wr.tail);
+	}
+	pthread_mutex_unlock(&wr.lock);
+
+	if (wr.failed) {
+		do_exit = 1;
+		fx2adc_cancel_async(dev);
+	}
 
-#ifndef _WIN32
-#include <unistd.h>
-#else
-#include <windows.h>
-#include <io.h>
-#include <fcntl.h>
-#include "getopt/getopt.h"
+	return NULL;
+}
+
+#ifdef HAVE_VMSPLICE
+/* map the ring part into the pipe, falls back to write() if the kernel
+ * refuses */
+static int output_vmsplice(const uint8_t *buf, size_t len)
+{
+	struct iovec iov;
+	ssize_t r;
+
+	while (len && vms.enabled) {
+		iov.iov_base = (void *)buf;
+		iov.iov_len = len;
+		r = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EINVAL || errno == ENOSYS) && !vms.calls) {
+			fprintf(stderr, "vmsplice() not supported, using write()\n");
+			vms.enabled = false;
+			break;
+		}
+		if (r <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+		vms.calls++;
+	}
+
+	return len ? output_write(&out, buf, len) : 0;
+}
+
+static void *writer_thread_vmsplice(void *arg)
+{
+	uint64_t sent;
+	size_t pos, len;
+
+	pthread_mutex_lock(&wr.lock);
+	sent = wr.tail;
+	while (1) {
+		while (!(len = writer_next(sent, &pos)) && !wr.done)
+			pthread_cond_wait(&wr.cond, &wr.lock);
+
+		if (!len)
+			break;
+		pthread_mutex_unlock(&wr.lock);
+
+		if (output_vmsplice(wr.buf + pos, len) < 0) {
+			if (errno != EPIPE)
+				fprintf(stderr, "Short write, samples lost, exiting!\n");
+			pthread_mutex_lock(&wr.lock);
+			wr.failed = true;
+			break;
+		}
+
+		pthread_mutex_lock(&wr.lock);
+		sent += len;
+		/* still referenced by the pipe */
+		if (sent - wr.tail > vms.lag)
+			wr.tail = sent - vms.lag;
+	}
+	pthread_mutex_unlock(&wr.lock);
+
+	if (wr.failed) {
+		do_exit = 1;
+		fx2adc_cancel_async(dev);
+	}
+
+	return NULL;
+}
+
+/* a larger pipe buffer takes fewer wakeups of the reader, for write()
+ * as well */
+static void pipe_setup(bool use_vmsplice)
+{
+	struct stat st;
+	int size;
+
+	if (fstat(STDOUT_FILENO, &st) < 0 || !S_ISFIFO(st.st_mode))
+		return;
+
+	if (fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_SIZE) < 0)
+		fprintf(stderr, "Failed to enlarge the pipe: %s\n", strerror(errno));
+	size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+	if (size <= 0)
+		return;
+
+	vms.enabled = use_vmsplice;
+	vms.lag = size;
+	fprintf(stderr, "Pipe buffer %d kB, %s\n", size / 1024,
+		use_vmsplice ? "vmsplice()" : "write()");
+}
 #endif
 
-#include "fx2adc.h"
+#ifdef HAVE_IO_URING
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	unsigned char *ptr;
+	size_t sq_len, cq_len;
 
-#define DEFAULT_SAMPLE_RATE		30000000
-#define DEFAULT_BUF_LENGTH		(16 * 16384)
-#define MINIMAL_BUF_LENGTH		512
-#define MAXIMAL_BUF_LENGTH		(256 * 16384)
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+	if (uring.fd < 0)
+		return -1;
 
-static int do_exit = 0;
-static uint32_t bytes_to_read = 0;
-static fx2adc_dev_t *dev = NULL;
+	/* 5.6 for IORING_OP_WRITE */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+		goto err;
 
-void usage(void)
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	uring.ring_len = sq_len > cq_len ? sq_len : cq_len;
+
+	uring.ring_ptr = mmap(NULL, uring.ring_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (uring.ring_ptr == MAP_FAILED)
+		goto err;
+
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		munmap(uring.ring_ptr, uring.ring_len);
+		goto err;
+	}
+
+	ptr = uring.ring_ptr;
+	uring.sq_head = (unsigned int *)(ptr + p.sq_off.head);
+	uring.sq_tail = (unsigned int *)(ptr + p.sq_off.tail);
+	uring.sq_array = (unsigned int *)(ptr + p.sq_off.array);
+	uring.sq_mask = *(unsigned int *)(ptr + p.sq_off.ring_mask);
+	uring.sq_entries = p.sq_entries;
+	uring.cq_head = (unsigned int *)(ptr + p.cq_off.head);
+	uring.cq_tail = (unsigned int *)(ptr + p.cq_off.tail);
+	uring.cq_mask = *(unsigned int *)(ptr + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	close(uring.fd);
+	uring.fd = -1;
+	return -1;
+}
+
+static void uring_exit(void)
 {
-	fprintf(stderr,
-		"fx2adc_file, an acquisition tool for FX2 based USB scopes\n\n"
-		"Usage:\n"
-		"\t[-s samplerate (default: 30 MHz)]\n"
-		"\t[-e (use external clock on IFCLK)]\n"
-		"\t[-d device_index (default: 0)]\n"
-		"\t[-v voltage divider in mV, default is the lowest setting the hardware supports\n"
-		"\t[-p ppm_error (default: 0)]\n"
-		"\t[-b output_block_size (default: 16 * 16384)]\n"
-		"\t[-n number of samples to read (default: 0, infinite)]\n"
-		"\tfilename (a '-' dumps samples to stdout)\n\n");
-	exit(1);
+	if (uring.fd < 0)
+		return;
+
+	if (uring.writes)
+		fprintf(stderr, "io_uring: %llu writes in %llu system calls\n",
+			(unsigned long long)uring.writes,
+			(unsigned long long)uring.enters);
+
+	munmap(uring.sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+	munmap(uring.ring_ptr, uring.ring_len);
+	close(uring.fd);
+	uring.fd = -1;
 }
 
-#ifdef _WIN32
-BOOL WINAPI
-sighandler(int signum)
+/* queue a write of the ring part at pos to the end of the file */
+static void uring_queue(size_t pos, size_t len)
 {
-	if (CTRL_C_EVENT == signum) {
-		fprintf(stderr, "Signal caught, exiting!\n");
+	unsigned int tail = *uring.sq_tail;
+	unsigned int i = (uring.first + uring.num) % URING_DEPTH;
+	struct io_uring_sqe *sqe = &uring.sqes[tail & uring.sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = out.fd;
+	sqe->addr = (uint64_t)(uintptr_t)(wr.buf + pos);
+	sqe->len = len;
+	sqe->off = out.offset;
+	sqe->user_data = i;
+	uring.sq_array[tail & uring.sq_mask] = tail & uring.sq_mask;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	uring.end[i] = (uring.num ? uring.end[(i + URING_DEPTH - 1) % URING_DEPTH] : wr.tail) + len;
+	uring.len[i] = len;
+	uring.complete[i] = false;
+	uring.num++;
+	uring.writes++;
+	out.offset += len;
+}
+
+/* collect completions, returns the ring position up to which all data
+ * is written, or UINT64_MAX on error */
+static uint64_t uring_reap(uint64_t tail)
+{
+	unsigned int head = *uring.cq_head;
+	struct io_uring_cqe *cqe;
+	bool error = false;
+
+	while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &uring.cqes[head & uring.cq_mask];
+		/* short writes only happen when the disk is full */
+		if (cqe->res != (int32_t)uring.len[cqe->user_data]) {
+			fprintf(stderr, "io_uring write failed: %s\n",
+				cqe->res < 0 ? strerror(-cqe->res) : "short write");
+			error = true;
+		}
+		uring.complete[cqe->user_data] = true;
+		head++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+	while (uring.num && uring.complete[uring.first]) {
+		tail = uring.end[uring.first];
+		uring.first = (uring.first + 1) % URING_DEPTH;
+		uring.num--;
+	}
+
+	return error ? UINT64_MAX : tail;
+}
+
+/* Keeps up to URING_DEPTH writes in flight, the ring space is released
+ * in order as they complete. */
+static void *writer_thread_uring(void *arg)
+{
+	uint64_t submit, tail;
+	unsigned int queued;
+	size_t pos, len;
+	int r;
+
+	pthread_mutex_lock(&wr.lock);
+	submit = wr.tail;
+	while (1) {
+		/* the tail moves on its own between events, when nothing
+		 * is in flight */
+		if (trig.enabled)
+			trigger_poll();
+		if (!uring.num)
+			submit = wr.tail;
+		queued = 0;
+		while (uring.num < URING_DEPTH && (len = writer_next(submit, &pos))) {
+			uring_queue(pos, len);
+			submit += len;
+			queued++;
+		}
+
+		if (!uring.num) {
+			/* the writes to the old file are all complete */
+			if (wr.tail == seg.end) {
+				if (writer_segment_done() < 0) {
+					wr.failed = true;
+					break;
+				}
+				continue;
+			}
+			if (wr.done)
+				break;
+			pthread_cond_wait(&wr.cond, &wr.lock);
+			continue;
+		}
+		tail = wr.tail;
+		pthread_mutex_unlock(&wr.lock);
+
+		/* before the writes reach the kernel */
+		output_reserve(&out, out.offset);
+
+		do {
+			r = syscall(__NR_io_uring_enter, uring.fd, queued, 1,
+				    IORING_ENTER_GETEVENTS, NULL, 0);
+			uring.enters++;
+			if (r > 0)
+				queued -= (unsigned int)r < queued ? (unsigned int)r : queued;
+		} while (r < 0 && errno == EINTR);
+
+		tail = r < 0 ? UINT64_MAX : uring_reap(tail);
+
+		pthread_mutex_lock(&wr.lock);
+		if (tail == UINT64_MAX) {
+			if (r < 0)
+				fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+			wr.failed = true;
+			break;
+		}
+		wr.tail = tail;
+		if (meta.enabled)
+			ring_sample(wr.tail);
+	}
+	writer_finish_tail();
+	pthread_mutex_unlock(&wr.lock);
+
+	if (wr.failed) {
 		do_exit = 1;
 		fx2adc_cancel_async(dev);
-		return TRUE;
 	}
-	return FALSE;
+
+	return NULL;
 }
-#else
-static void sighandler(int signum)
+#endif
+
+/* a number of samples, exact as an integer, or like 1e9 */
+static uint64_t parse_count(const char *str, char **end)
 {
-	signal(SIGPIPE, SIG_IGN);
-	fprintf(stderr, "Signal caught, exiting!\n");
-	do_exit = 1;
-	fx2adc_cancel_async(dev);
+	uint64_t n;
+	char *e;
+
+	n = strtoull(str, &e, 10);
+	if (*e == '.' || *e == 'e' || *e == 'E')
+		n = (uint64_t)strtod(str, &e);
+	if (end)
+		*end = e;
+
+	return n;
 }
+
+/* a window start: "+seconds" after the first sample, "@seconds" since
+ * the epoch or an ISO 8601 time in UTC, YYYY-MM-DDTHH:MM:SS[.frac][Z] */
+static int parse_start(const char *str, struct window *w, uint32_t rate)
+{
+	struct tm tm;
+	double secs;
+	time_t t;
+	char *e;
+
+	memset(w, 0, sizeof(*w));
+	w->ring_end = UINT64_MAX;
+
+	if (str[0] == '+') {
+		secs = strtod(str + 1, &e);
+		if (*e || secs < 0)
+			return -1;
+		w->start = (uint64_t)(secs * rate + 0.5) * channels;
+		return 0;
+	}
+
+	if (str[0] == '@') {
+		secs = strtod(str + 1, &e);
+		if (*e || secs <= 0)
+			return -1;
+		w->at_ns = (int64_t)(secs * 1e9 + 0.5);
+		return 0;
+	}
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(str, "%d-%d-%dT%d:%d:%lf", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		   &tm.tm_hour, &tm.tm_min, &secs) != 6 || secs < 0 || secs >= 61)
+		return -1;
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_sec = (int)secs;
+#ifdef _WIN32
+	t = _mkgmtime(&tm);
+#else
+	t = timegm(&tm);
 #endif
+	if (t == (time_t)-1)
+		return -1;
+	w->at_ns = (int64_t)t * 1000000000LL + (int64_t)((secs - tm.tm_sec) * 1e9 + 0.5);
 
-static void fx2adc_callback(unsigned char *buf, uint32_t len, void *ctx)
+	return 0;
+}
+
+/* -w: a window per line, "START LENGTH [filename]", '#' starts a comment */
+static int sched_load(const char *path, uint32_t rate)
 {
-	if (ctx) {
-		if (do_exit)
-			return;
+	char line[PATH_MAX + 128], start[64], length[64], name[PATH_MAX];
+	struct window *win;
+	unsigned int lineno = 0;
+	double secs;
+	FILE *f;
+	char *e;
+	int n;
 
-		if ((bytes_to_read > 0) && (bytes_to_read < len)) {
-			len = bytes_to_read;
-			do_exit = 1;
-			fx2adc_cancel_async(dev);
-		}
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
 
-		if (fwrite(buf, 1, len, (FILE*)ctx) != len) {
-			fprintf(stderr, "Short write, samples lost, exiting!\n");
-			fx2adc_cancel_async(dev);
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((e = strchr(line, '#')))
+			*e = '\0';
+		n = sscanf(line, "%63s %63s %259s", start, length, name);
+		if (n <= 0)
+			continue;
+
+		win = realloc(sched.win, (sched.num + 1) * sizeof(*win));
+		if (!win)
+			goto err;
+		sched.win = win;
+		win += sched.num;
+
+		if (n < 2 || parse_start(start, win, rate) < 0) {
+			fprintf(stderr, "%s:%u: expected START LENGTH [filename]\n", path, lineno);
+			goto err;
+		}
+		win->length = parse_count(length, &e);
+		if (*e == 's') {
+			secs = strtod(length, &e);
+			win->length = (uint64_t)(secs * rate + 0.5);
+			e++;
+		}
+		if (*e) {
+			fprintf(stderr, "%s:%u: invalid length %s\n", path, lineno, length);
+			goto err;
 		}
+		win->length *= channels;
+		win->name = n == 3 ? strdup(name) : NULL;
+		sched.num++;
+	}
+	fclose(f);
 
-		if (bytes_to_read > 0)
-			bytes_to_read -= len;
+	if (!sched.num) {
+		fprintf(stderr, "%s: no windows\n", path);
+		return -1;
 	}
+
+	return 0;
+err:
+	fclose(f);
+	return -1;
 }
 
 int main(int argc, char **argv)
@@ -114,15 +2641,37 @@ int main(int argc, char **argv)
 	int n_read;
 	int r, opt;
 	int ppm_error = 0;
-	FILE *file;
 	uint8_t *buffer;
 	int dev_index = 0;
 	uint32_t samp_rate = DEFAULT_SAMPLE_RATE;
 	int vdiv = 0;
 	uint32_t out_block_size = DEFAULT_BUF_LENGTH;
+	uint32_t buffer_ms = DEFAULT_BUFFER_MS;
 	bool use_ext_clk = false;
+	void *(*writer_fn)(void *) = writer_thread;
+	pthread_t writer;
+	uint64_t seg_bytes = 0;
+	double seg_secs = 0;
+	const char *index_name = NULL;
+	bool use_meta = false;
+	char serial[256];
+	char template[PATH_MAX], name[PATH_MAX], index_buf[PATH_MAX + 8];
+	struct timespec ts;
+	const char *ext;
+	uint64_t samples;
+	size_t align;
+	double pre_secs = -1, post_secs = 1;
+	bool post_set = false;
+	char *level;
+	uint64_t samples_to_read = 0;
+	const char *start_at = NULL, *sched_file = NULL;
+	bool windows;
+	unsigned int i;
+#ifdef HAVE_VMSPLICE
+	bool use_vmsplice = true;
+#endif
 
-	while ((opt = getopt(argc, argv, "d:s:b:n:p:v:d:e")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:b:n:a:w:c:p:v:d:eB:DUS:T:I:MFj:R:P:A:t:C:Wm")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = (uint32_t)atoi(optarg);
@@ -140,11 +2689,101 @@ int main(int argc, char **argv)
 			out_block_size = (uint32_t)atof(optarg);
 			break;
 		case 'n':
-			bytes_to_read = (uint32_t)atof(optarg) * 2;
+			samples_to_read = parse_count(optarg, NULL);
+			break;
+		case 'a':
+			start_at = optarg;
+			break;
+		case 'w':
+			sched_file = optarg;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "split")) {
+				channels = 2;
+				split.enabled = true;
+			} else
+				channels = (unsigned int)atoi(optarg);
+			if (channels < 1 || channels > 2)
+				usage();
 			break;
 		case 'e':
 			use_ext_clk = true;
 			break;
+		case 'B':
+			buffer_ms = (uint32_t)atoi(optarg);
+			break;
+		case 'S':
+			seg_bytes = (uint64_t)atof(optarg);
+			break;
+		case 'T':
+			seg_secs = atof(optarg);
+			break;
+		case 'I':
+			index_name = optarg;
+			break;
+		case 'M':
+			use_meta = true;
+			break;
+		case 'F':
+			flac.enabled = true;
+			break;
+		case 'j':
+			flac_threads = atoi(optarg);
+			break;
+		case 'R':
+			resampler.rate = atof(optarg);
+			break;
+		case 'P':
+			pre_secs = atof(optarg);
+			break;
+		case 'A':
+			post_secs = atof(optarg);
+			post_set = true;
+			break;
+		case 't':
+			level = strchr(optarg, ':');
+			if (!level)
+				usage();
+			if (!strncmp(optarg, "level:", 6))
+				trig.type = TRIGGER_LEVEL;
+			else if (!strncmp(optarg, "rise:", 5))
+				trig.type = TRIGGER_RISING;
+			else if (!strncmp(optarg, "fall:", 5))
+				trig.type = TRIGGER_FALLING;
+			else
+				usage();
+			trig.level = (unsigned int)atoi(level + 1);
+			if (!trig.level || trig.level > (trig.type == TRIGGER_LEVEL ? 127U : 255U)) {
+				fprintf(stderr, "Trigger level out of range\n");
+				exit(1);
+			}
+			break;
+#ifndef _WIN32
+		case 'C':
+			trig.fifo = optarg;
+			break;
+#endif
+#ifdef HAVE_DIRECT_IO
+		case 'D':
+			direct_io = true;
+			break;
+#endif
+#ifdef HAVE_MMAP_OUTPUT
+		case 'm':
+			use_mmap = true;
+			break;
+#endif
+#ifdef HAVE_VMSPLICE
+		case 'W':
+			use_vmsplice = false;
+			break;
+#endif
+#ifdef HAVE_IO_URING
+		case 'U':
+			direct_io = true;
+			use_uring = true;
+			break;
+#endif
 		default:
 			usage();
 			break;
@@ -170,7 +2809,7 @@ int main(int argc, char **argv)
 
 	buffer = malloc(out_block_size * sizeof(uint8_t));
 
-	if (dev_index < 0) {
+	if (dev_index < 0 || flac_threads < 0) {
 		exit(1);
 	}
 
@@ -198,36 +2837,392 @@ int main(int argc, char **argv)
 
 	if (vdiv > 0) {
 		r = fx2adc_set_vdiv(dev, 1, vdiv);
+		if (r == 0 && channels == 2)
+			r = fx2adc_set_vdiv(dev, 2, vdiv);
 		if (r < 0)
 			fprintf(stderr, "WARNING: Failed to set the voltage divider.\n");
 	}
 
-	if (strcmp(filename, "-") == 0) { /* Write samples to stdout */
-		file = stdout;
-#ifdef _WIN32
-		_setmode(_fileno(stdin), _O_BINARY);
+	if (channels == 2) {
+		r = fx2adc_set_channels(dev, 2);
+		if (r < 0) {
+			fprintf(stderr, "Failed to enable dual-channel mode.\n");
+			goto release;
+		}
+	}
+	if (split.enabled && strcmp(filename, "-") == 0) {
+		fprintf(stderr, "Splitting the channels needs an output file\n");
+		split.enabled = false;
+	}
+	if (split.enabled && flac.enabled) {
+		fprintf(stderr, "FLAC stores both channels in one stream, -c split is ignored\n");
+		split.enabled = false;
+	}
+	flac.channels = channels;
+
+	/* an edge would be seen between the samples of CH1 and CH2 */
+	if (channels == 2 && trig.level && trig.type != TRIGGER_LEVEL) {
+		fprintf(stderr, "Only the level trigger works with both channels\n");
+		r = -1;
+		goto release;
+	}
+
+	if (direct_io && strcmp(filename, "-") == 0) {
+		fprintf(stderr, "Direct I/O needs an output file\n");
+		direct_io = false;
+	}
+
+#ifdef HAVE_MMAP_OUTPUT
+	if (use_mmap && strcmp(filename, "-") == 0) {
+		fprintf(stderr, "Memory mapped output needs an output file\n");
+		use_mmap = false;
+	}
+	if (use_mmap && flac.enabled) {
+		fprintf(stderr, "Memory mapped output is not used for FLAC\n");
+		use_mmap = false;
+	}
+	if (use_mmap && direct_io) {
+		fprintf(stderr, "Memory mapped output bypasses -D and -U\n");
+		direct_io = false;
+#ifdef HAVE_IO_URING
+		use_uring = false;
 #endif
-	} else {
-		file = fopen(filename, "wb");
-		if (!file) {
-			fprintf(stderr, "Failed to open %s\n", filename);
-			goto out;
+	}
+#endif
+
+	/* segments are a whole number of FLAC blocks, or of blocks for
+	 * direct I/O of the raw samples, of every channel; -S counts the
+	 * bytes of a file, which holds a single channel when split */
+	seg.rate = fx2adc_get_sample_rate(dev);
+	seg.length = seg_bytes * (split.enabled ? channels : 1);
+	if (seg_secs > 0 && (!seg.length || seg_secs * seg.rate * channels < seg.length))
+		seg.length = (uint64_t)(seg_secs * seg.rate) * channels;
+	align = (flac.enabled ? FLAC_BLOCK_SIZE : direct_io ? DIRECT_ALIGN : 1) * channels;
+	seg.length = (seg.length + align - 1) / align * align;
+
+	if (seg.length && strcmp(filename, "-") == 0) {
+		fprintf(stderr, "Splitting the output needs an output file\n");
+		seg.length = 0;
+	}
+
+	trig.enabled = pre_secs >= 0;
+	bytes_to_read = samples_to_read * channels;
+
+	/* the windows are cut from the stream by the callback, -a is a
+	 * single one of -n samples */
+	if (start_at || sched_file) {
+		if (start_at && sched_file) {
+			fprintf(stderr, "Either a start time or a schedule file\n");
+			r = -1;
+			goto release;
+		}
+		if (seg.length || trig.enabled || resampler.rate > 0) {
+			fprintf(stderr, "Scheduled captures don't work with -S, -T, -P or -R\n");
+			r = -1;
+			goto release;
+		}
+		if (sched_file && sched_load(sched_file, seg.rate) < 0) {
+			r = -1;
+			goto release;
+		}
+		if (sched_file && bytes_to_read)
+			fprintf(stderr, "The windows have their lengths, -n is ignored\n");
+		if (start_at) {
+			sched.win = malloc(sizeof(*sched.win));
+			if (!sched.win || parse_start(start_at, sched.win, seg.rate) < 0) {
+				fprintf(stderr, "Invalid start time %s\n", start_at);
+				r = -1;
+				goto release;
+			}
+			sched.win->length = bytes_to_read;
+			sched.win->name = strdup(filename);
+			sched.num = 1;
+		}
+		bytes_to_read = 0;
+		sched.files = strcmp(filename, "-") != 0;
+		sched.align = sched.files && direct_io && !flac.enabled ?
+			      DIRECT_ALIGN * channels : channels;
+	}
+	windows = sched_file && sched.files;
+
+	if (!trig.enabled && (trig.level || trig.fifo || post_set)) {
+		fprintf(stderr, "-t, -C and -A need -P to enable the trigger\n");
+		r = -1;
+		goto release;
+	}
+	if (trig.enabled && strcmp(filename, "-") == 0) {
+		fprintf(stderr, "Trigger mode needs an output file\n");
+		r = -1;
+		goto release;
+	}
+	if (trig.enabled && seg.length) {
+		fprintf(stderr, "Every event gets a file of its own, -S and -T are ignored\n");
+		seg.length = 0;
+	}
+	if (trig.enabled) {
+		trig.pre = (uint64_t)(pre_secs * seg.rate) * channels;
+		trig.post = post_secs > 0 ? (uint64_t)(post_secs * seg.rate) * channels : 0;
+		trig.align = align;
+	}
+
+	/* a single stream of samples, its length and the gaps are
+	 * converted to the output rate */
+	if (resampler.rate > 0) {
+		if (channels == 2 || flac.enabled || seg.length || trig.enabled) {
+			fprintf(stderr, "Resampling works with a single channel of raw samples in one file\n");
+			r = -1;
+			goto release;
+		}
+		resampler.rs = resample_new(seg.rate, resampler.rate, CONVERT_U8,
+					    flac_threads ? flac_threads : default_threads());
+		if (resampler.rs)
+			resampler.buf = malloc(resample_max_out(resampler.rs, MAX_WRITE_LENGTH));
+		if (!resampler.buf) {
+			fprintf(stderr, "Can't resample from %u Hz to %.3f Hz\n", seg.rate,
+				resampler.rate);
+			r = -1;
+			goto release;
+		}
+		resample_ratio(resampler.rs, &resampler.up, &resampler.down);
+		fprintf(stderr, "Resampling to %.3f Hz (%u/%u)\n",
+			resample_rate(resampler.rs), resampler.up, resampler.down);
+	}
+
+	if (use_meta && strcmp(filename, "-") == 0) {
+		fprintf(stderr, "SigMF metadata needs an output file\n");
+		use_meta = false;
+	}
+
+	timespec_get(&ts, TIME_UTC);
+	seg.start_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	snprintf(name, sizeof(name), "%s", filename);
+	if (seg.length || trig.enabled || windows) {
+		/* without a pattern, the file number goes before the extension */
+		ext = strrchr(filename, '.');
+		if (strchr(filename, '%'))
+			snprintf(template, sizeof(template), "%s", filename);
+		else if (ext && !strpbrk(ext, "/\\"))
+			snprintf(template, sizeof(template), "%.*s-%%n%s",
+				 (int)(ext - filename), filename, ext);
+		else
+			snprintf(template, sizeof(template), "%s-%%n", filename);
+		seg.template = template;
+		seg.end = seg.length ? seg.length : UINT64_MAX;
+		segment_name(name, sizeof(name), 0, 0);
+	}
+
+	/* the files of the events and windows are opened when they start */
+	if (!trig.enabled && !sched.files && output_open(&out, name) < 0) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		r = -1;
+		goto release;
+	}
+
+	if (seg.length || trig.enabled || windows) {
+		snprintf(index_buf, sizeof(index_buf), "%s.index", name);
+		if (!index_name)
+			index_name = index_buf;
+		seg.index = fopen(index_name, "w");
+		if (!seg.index)
+			fprintf(stderr, "Failed to open %s\n", index_name);
+		else
+			fprintf(seg.index, "# file first_sample samples\n");
+
+		if (seg.length && segment_open_next() < 0)
+			goto close;
+	}
+
+	if (use_meta) {
+		serial[0] = '\0';
+		fx2adc_get_usb_strings(dev, NULL, NULL, serial);
+		snprintf(meta.hw, sizeof(meta.hw), "%s%s%s",
+			 fx2adc_get_device_name((uint32_t)dev_index),
+			 serial[0] ? ", serial " : "", serial);
+		meta.vdiv = fx2adc_get_vdiv(dev);
+		meta.ext_clock = use_ext_clk;
+		if (meta_start() < 0)
+			fprintf(stderr, "Failed to start the metadata thread\n");
+		if (!trig.enabled && !sched.files)
+			meta_push(META_FILE, 0, 0, 0, "0", name);
+	}
+
+	if (flac.enabled) {
+		if (flac_start() < 0) {
+			fprintf(stderr, "Failed to start the FLAC encoder threads\n");
+			goto close;
+		}
+		writer_fn = writer_thread_flac;
+	}
+
+#ifdef HAVE_IO_URING
+	if (use_uring && flac.enabled)
+		fprintf(stderr, "io_uring is not used for FLAC output\n");
+	else if (use_uring && split.enabled)
+		fprintf(stderr, "io_uring is not used for split channels\n");
+	else if (use_uring && resampler.rs)
+		fprintf(stderr, "io_uring is not used when resampling\n");
+	else if (use_uring && sched.files)
+		fprintf(stderr, "io_uring is not used for scheduled windows\n");
+	else if (use_uring && direct_io) {
+		if (uring_init() == 0)
+			writer_fn = writer_thread_uring;
+		else
+			fprintf(stderr, "io_uring not supported, using pwrite()\n");
+	}
+#endif
+
+#ifdef HAVE_DIRECT_IO
+	/* the length is known, allocate it at once */
+	if (out.fd >= 0 && bytes_to_read && !seg.length && !flac.enabled && !resampler.rs)
+		output_reserve(&out, bytes_to_read);
+#endif
+
+#ifdef HAVE_VMSPLICE
+	/* FLAC and resampled samples are written from buffers of their own */
+	if (out.file == stdout && !flac.enabled) {
+		pipe_setup(use_vmsplice && !resampler.rs);
+		if (vms.enabled) {
+			fflush(stdout);
+			writer_fn = writer_thread_vmsplice;
 		}
 	}
+#endif
+
+	/* preallocated and touched, the callback must not wait for memory;
+	 * a multiple of the direct I/O and FLAC block sizes, so that blocks
+	 * don't wrap */
+	wr.size = (uint64_t)fx2adc_get_sample_rate(dev) * channels * buffer_ms / 1000;
+	wr.size = (wr.size + out_block_size - 1) / out_block_size * out_block_size;
+	if (wr.size < 2 * out_block_size)
+		wr.size = 2 * out_block_size;
+	wr.size += trig.pre;
+#ifdef HAVE_VMSPLICE
+	if (vms.enabled)
+		wr.size += vms.lag;
+#endif
+	if (flac.enabled || trig.enabled)
+		wr.size = (wr.size + align - 1) / align * align;
+#ifdef HAVE_DIRECT_IO
+	wr.size = (wr.size + DIRECT_ALIGN * channels - 1) / (DIRECT_ALIGN * channels) *
+		  DIRECT_ALIGN * channels;
+	if (posix_memalign((void **)&wr.buf, DIRECT_ALIGN, wr.size))
+		wr.buf = NULL;
+	if (split.enabled) {
+		if (posix_memalign((void **)&split.buf[0], DIRECT_ALIGN, SPLIT_CHUNK / 2) ||
+		    posix_memalign((void **)&split.buf[1], DIRECT_ALIGN, SPLIT_CHUNK / 2))
+			split.buf[1] = NULL;
+	}
+#else
+	wr.buf = malloc(wr.size);
+	if (split.enabled) {
+		split.buf[0] = malloc(SPLIT_CHUNK / 2);
+		split.buf[1] = malloc(SPLIT_CHUNK / 2);
+	}
+#endif
+	if (!wr.buf || (split.enabled && (!split.buf[0] || !split.buf[1]))) {
+		fprintf(stderr, "Failed to allocate %zu bytes write buffer\n", wr.size);
+		goto close;
+	}
+	memset(wr.buf, 0, wr.size);
+	pthread_mutex_init(&wr.lock, NULL);
+	pthread_cond_init(&wr.cond, NULL);
+
+	if (pthread_create(&writer, NULL, writer_fn, NULL)) {
+		fprintf(stderr, "Failed to start the writer thread\n");
+		goto close;
+	}
+
+#ifndef _WIN32
+	if (trig.enabled) {
+		sigact.sa_handler = trigger_handler;
+		sigaction(SIGUSR1, &sigact, NULL);
+		if (trig.fifo && fifo_start() < 0)
+			fprintf(stderr, "Failed to open the control FIFO %s\n", trig.fifo);
+	}
+#endif
 
 	fprintf(stderr, "Reading samples in async mode...\n");
-	r = fx2adc_read(dev, fx2adc_callback, (void *)file, 0, out_block_size);
+	r = fx2adc_read(dev, fx2adc_callback, (void *)&wr, 0, out_block_size);
 
 	if (do_exit)
 		fprintf(stderr, "\nUser cancel, exiting...\n");
 	else
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);
 
-	if (file != stdout)
-		fclose(file);
+	writer_finish();
+	pthread_join(writer, NULL);
+#ifndef _WIN32
+	if (trig.fifo_running) {
+		do_exit = 1;
+		pthread_join(trig.fifo_thread, NULL);
+	}
+#endif
+
+	fprintf(stderr, "Write buffer: %.1f MB, high-water mark %.1f MB (%.0f%%)\n",
+		wr.size / 1e6, wr.high_water / 1e6, 100.0 * wr.high_water / wr.size);
+	if (wr.lost)
+		fprintf(stderr, "%llu samples lost due to the disk being too slow\n",
+			(unsigned long long)(wr.lost / channels));
+	if (flac.in_bytes)
+		fprintf(stderr, "FLAC: %.1f MB compressed to %.1f MB (%.1f%%)\n",
+			flac.in_bytes / 1e6, flac.out_bytes / 1e6,
+			100.0 * flac.out_bytes / flac.in_bytes);
+	if (trig.enabled)
+		fprintf(stderr, "%u events written\n", trig.events);
+	if (sched.num)
+		fprintf(stderr, "%u of %u windows captured\n", sched.cur, sched.num);
+#ifdef HAVE_VMSPLICE
+	if (vms.calls)
+		fprintf(stderr, "vmsplice: %llu calls\n", (unsigned long long)vms.calls);
+#endif
+
+close:
+	flac_stop();
+	meta_stop();
+	samples = wr.tail - seg.start;
+	if (trig.enabled || sched.files) {
+		/* the capture ended during an event or window */
+		if (trig.active || sched.active) {
+			if (output_finish(&out, samples) < 0)
+				fprintf(stderr, "Failed to complete %s: %s\n", out.name,
+					strerror(errno));
+			output_close(&out);
+			segment_log(samples);
+		}
+		if (seg.index)
+			fclose(seg.index);
+	} else if (output_finish(&out, samples) < 0)
+		fprintf(stderr, "Failed to complete %s: %s\n", out.name, strerror(errno));
+	output_close(&out);
+	if (seg.length) {
+		/* the capture ended right at the start of a file */
+		if (!samples && seg.num)
+			output_remove(out.name);
+		else
+			segment_log(samples);
+		if (seg.next.fd >= 0 || seg.next.file || seg.next.hdr || seg.next.ch[0]) {
+			output_close(&seg.next);
+			output_remove(seg.next.name);
+		}
+		if (seg.index)
+			fclose(seg.index);
+	}
+#ifdef HAVE_IO_URING
+	uring_exit();
+#endif
+release:
+	free(wr.buf);
+	free(split.buf[0]);
+	free(split.buf[1]);
+	resample_free(resampler.rs);
+	free(resampler.buf);
+	for (i = 0; i < sched.num; i++)
+		free(sched.win[i].name);
+	free(sched.win);
 
 	fx2adc_close(dev);
 	free (buffer);
-out:
+
 	return r >= 0 ? r : -r;
 }
@@ -20,11 +20,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* sendmmsg() */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #ifndef _WIN32
 #include <unistd.h>
@@ -36,6 +41,14 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -45,306 +58,3588 @@
 #include <pthread.h>
 
 #include "fx2adc.h"
+#include "fx2adc_shm.h"
+#include "convert.h"
+#include "resample.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+
+typedef int socklen_t;
+
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+#define poll WSAPoll
+#define usleep(t) Sleep((t)/1000)
+#else
+#define closesocket close
+#define SOCKADDR struct sockaddr
+#define SOCKET int
+#define SOCKET_ERROR -1
+#define INVALID_SOCKET -1
+#endif
+
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define HAVE_SENDMMSG 1
+#endif
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+#define HAVE_SHM 1
+#endif
+
+#if defined(ENABLE_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+#define DEFAULT_PORT_STR "1234"
+#define DEFAULT_SAMPLE_RATE_HZ 30000000
+#define DEFAULT_MAX_NUM_BUFFERS 100
+#define DEFAULT_MAX_CLIENTS 1
+#define DEFAULT_HOLDOFF_MS 100
+
+/* USB transfer size, every ring slot holds one transfer */
+#define DEFAULT_BUF_LENGTH (16 * 32 * 512)
+
+/* extra ring slots, so that a client can fall behind by the maximum
+ * number of buffers while the USB callback keeps writing */
+#define RING_GUARD_SLOTS 8
+
+/* maximum number of queued buffers gathered into a single send call */
+#define SEND_IOV_MAX 64
+
+/* maximum number of send calls waiting for zero-copy completion */
+#define ZEROCOPY_MAX_PENDING 64
+
+#define MAX_EVENTS 16
+
+/* default UDP datagram size, fits into a 1500 byte Ethernet MTU */
+#define DEFAULT_UDP_DGRAM_SIZE 1472
+#define MAX_UDP_DGRAM_SIZE 65507
+
+/* number of datagrams handed to the kernel with a single call */
+#define UDP_BATCH 64
+
+/*
+ * Ring of sample buffers. The USB callback copies every transfer into the
+ * next slot, the event loop sends the slots to the clients, each of which
+ * has its own read cursor. Slots are identified by a 64 bit sequence
+ * number, a slot that is referenced by a pending send is pinned and
+ * won't be overwritten.
+ */
+struct ring_slot {
+	unsigned char *data;
+	uint32_t len;
+	uint32_t samples;	/* number of samples in the slot */
+	uint8_t flags;		/* FRAME_FLAG_*, for compressed slots */
+	unsigned int pins;
+	uint64_t seq;
+	uint64_t sample;	/* index of the first sample in the slot */
+	uint64_t timestamp;	/* ns since the epoch of the first sample */
+};
+
+struct ring {
+	pthread_mutex_t lock;
+	struct ring_slot *slots;
+	uint32_t num;
+	uint32_t slot_size;
+	uint64_t head;		/* sequence number of the next slot */
+	uint64_t samples;	/* number of samples received so far */
+	uint32_t rate;		/* sample rate, for the timestamps */
+	uint64_t overruns;	/* buffers lost because the slot was pinned */
+	unsigned int channels;	/* of the next slot */
+	bool discont;		/* the channel mode changed before the next slot */
+#ifdef HAVE_SHM
+	struct fx2adc_shm_header *shm;	/* slots shared with local readers */
+	size_t shm_size;
+	int shm_fd;
+	int shm_ro_fd;			/* what the readers get */
+	struct fx2adc_shm_reader *shm_cursors[FX2ADC_SHM_MAX_READERS];
+#endif
+};
+
+#define RING_SEQ_WRITING UINT64_MAX
+
+struct send_stats {
+	uint64_t bytes;
+	uint64_t syscalls;
+	uint64_t zc_copied;
+#ifndef _WIN32
+	struct rusage ru_start;
+#endif
+};
+
+enum ev_type {
+	EV_LISTEN,
+	EV_WAKEUP,
+	EV_CLIENT,
+	EV_UDP,
+	EV_SHM_LISTEN,
+	EV_SHM_READER,
+	EV_URING,
+};
+
+/* every pollable object starts with this, the poller hands it back */
+struct ev_source {
+	enum ev_type type;
+	SOCKET fd;
+};
+
+#ifdef _WIN32
+#define __attribute__(x)
+#pragma pack(push, 1)
+#endif
+struct command{
+	unsigned char cmd;
+	unsigned int param;
+}__attribute__((packed));
+#ifdef _WIN32
+#pragma pack(pop)
+#endif
+
+/* fx2adc specific commands, rtl_tcp uses 0x01 - 0x0e */
+#define CMD_SET_FRAMING		0x80
+#define CMD_SET_FORMAT		0x81
+#define CMD_SET_DECIMATION	0x82
+#define CMD_SET_COMPRESSION	0x83
+#define CMD_SET_VDIV		0x84	/* (channel << 16) | mV, channel 0 or 1: CH1 */
+#define CMD_SET_EXT_CLOCK	0x85	/* Hz, via the Si5351 if present */
+#define CMD_SET_CHANNELS	0x86
+#define CMD_SET_QUEUE_DEPTH	0x87	/* buffers, 0: the -n setting */
+#define CMD_GET_STATS		0x88
+#define CMD_RESUME_HI		0x89	/* upper 32 bits for CMD_RESUME */
+#define CMD_RESUME		0x8a	/* last sample received, lower 32 bits */
+#define CMD_SET_OUTPUT_RATE	0x8b	/* Hz, 0: the rate of the device */
+
+/* parameters of CMD_SET_COMPRESSION */
+enum codec {
+	CODEC_NONE = 0,
+	CODEC_ZSTD,
+	CODEC_ZSTD_DELTA,	/* byte differences, 8 bit formats only */
+	CODEC_NUM
+};
+
+/*
+ * Header of every frame in framed mode, all fields in network byte order.
+ * Every ring slot is sent as one frame, the samples follow directly after
+ * the header.
+ */
+#define FRAME_MAGIC 0x46583246	/* "FX2F" */
+
+struct frame_header {
+	uint32_t magic;
+	uint16_t hdr_len;	/* offset of the samples */
+	uint8_t format;		/* convert_format_t */
+	uint8_t flags;
+	uint32_t seq;		/* frame sequence number */
+	uint32_t len;		/* bytes of samples */
+	uint64_t sample;	/* index of the first sample */
+	uint64_t timestamp;	/* ns since the epoch of the first sample */
+	uint64_t dropped;	/* samples lost since the previous frame */
+};
+
+/* frame header flags */
+#define FRAME_FLAG_ZSTD		0x01	/* samples are one zstd frame */
+#define FRAME_FLAG_DELTA	0x02	/* decompressed bytes are differences */
+#define FRAME_FLAG_DUAL		0x04	/* CH1 and CH2 interleaved */
+#define FRAME_FLAG_STATS	0x08	/* struct stats_reply instead of samples */
+#define FRAME_FLAG_DISCONT	0x10	/* first frame after the channel mode changed */
+
+/*
+ * Answer to CMD_GET_STATS, sent as a frame of its own with
+ * FRAME_FLAG_STATS set, all fields in network byte order. Stats frames
+ * don't advance the frame sequence number.
+ */
+struct stats_reply {
+	uint64_t samples;	/* received from the device */
+	uint64_t overruns;	/* buffers lost in the ring */
+	uint64_t dropped;	/* buffers this client was too slow for */
+	uint64_t bytes;		/* sent to this client */
+	uint32_t sample_rate;
+	uint32_t vdiv[2];	/* mV, 0 if not set yet */
+	uint32_t queue_depth;	/* buffers, for this client */
+	uint32_t queued;	/* buffers waiting for this client */
+	uint16_t clients;
+	uint8_t channels;
+	uint8_t ext_clock;
+	uint32_t ratio;		/* compression ratio x1000, 0 if uncompressed */
+	uint32_t cpu_us_per_mb;	/* compression time per MB of input */
+};
+
+struct zc_send {
+	uint32_t id;
+	uint64_t seq;
+	uint32_t count;
+};
+
+/*
+ * Converted output for one format and decimation, or resampled to an
+ * output rate instead, shared by all clients requesting it. The slots of
+ * the output ring have the same sequence numbers as the input slots they
+ * were converted from, so clients keep their position when switching
+ * between outputs.
+ *
+ * Compressed output is a stream of its own, it takes the slots of the
+ * input ring or of the stream with the same format and decimation and
+ * compresses them on the worker pool.
+ */
+struct conv_stream {
+	convert_format_t format;
+	unsigned int decim;
+	enum codec codec;
+	uint32_t out_rate;	/* 0: not resampled */
+	convert_t *conv;	/* NULL for compressed and resampled streams */
+	resample_t *rs;		/* with out_rate */
+	uint32_t in_rate;	/* the device rate rs was set up for */
+	struct ring *src;	/* the input ring or the one of src_stream */
+	struct conv_stream *src_stream;
+	struct ring ring;
+	uint64_t in_seq;	/* next input slot to convert */
+	uint64_t skipped;	/* input slots not converted in time */
+	unsigned int users;
+	unsigned int jobs;	/* slots queued or being compressed, pool.lock */
+	uint64_t bytes_in;	/* compression stats, ring lock */
+	uint64_t bytes_out;
+	uint64_t cpu_ns;
+	uint64_t stored;	/* slots sent uncompressed */
+	struct conv_stream *next;
+};
+
+struct client {
+	struct ev_source ev;
+	struct ring *ring;	/* the input ring or the one of conv */
+	struct conv_stream *conv;
+	convert_format_t format;
+	unsigned int decim;
+	enum codec codec;
+	uint32_t out_rate;
+	convert_format_t want_format;	/* switched at the next frame boundary */
+	unsigned int want_decim;
+	enum codec want_codec;
+	uint32_t want_rate;
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	uint64_t seq;		/* next slot to send */
+	uint32_t offset;	/* bytes of that slot already sent */
+	uint64_t dropped;	/* buffers skipped because the client was too slow */
+	uint32_t queue_depth;	/* 0: ring_max_lag() */
+	bool stats_pending;	/* CMD_GET_STATS, answered between frames */
+	uint32_t resume_hi;
+	uint64_t resume;	/* sample to continue with, applied between frames */
+	uint64_t resume_head;	/* queue_depth applies again from this slot on */
+	uint64_t next_sample;	/* sample expected at seq, for the dropped count */
+	uint32_t frame_seq;	/* sequence number of the frame at seq */
+	bool framed;
+	bool want_framed;	/* switched at the next frame boundary */
+	bool started;		/* samples are flowing, framing is fixed */
+	uint64_t start_ns;	/* start without a command at this time */
+	struct frame_header *frames;	/* one per ring slot, see frame_build() */
+	unsigned char *tail;	/* rest of a frame whose slot was dropped */
+	uint32_t tail_size;
+	uint32_t tail_len;
+	uint32_t tail_off;
+	bool want_out;
+	bool dead;
+	unsigned char cmd_buf[sizeof(struct command)];
+	unsigned int cmd_len;
+	struct send_stats stats;
+	int send_flags;
+	uint32_t zc_id;
+	struct zc_send zc[ZEROCOPY_MAX_PENDING];
+	unsigned int zc_first;
+	unsigned int zc_num;
+	bool zc_wait;		/* flush again once completions arrive */
+#ifdef HAVE_IO_URING
+	struct uring_op *ur_chain[SEND_IOV_MAX];	/* linked sends in flight */
+	unsigned int ur_num;
+	unsigned int ur_pending;	/* sends of the chain not completed yet */
+	size_t ur_bytes;		/* sent by the completed ones */
+	struct uring_op *ur_ops;	/* all ops holding slots, oldest first */
+	struct uring_op **ur_ops_tail;
+	int ur_error;
+	bool ur_waiting;		/* more data queued behind the chain */
+	bool ur_kick;			/* the chain completed, flush again */
+#endif
+	struct client *next;
+};
+
+/*
+ * Header of every UDP datagram, all fields in network byte order. The
+ * samples follow directly after the header, receivers can detect lost
+ * datagrams with the sequence number and place the samples on their
+ * timeline with the sample index.
+ */
+#define UDP_MAGIC 0x46583255	/* "FX2U" */
+#define UDP_MAGIC_DISCONT 0x46583244	/* "FX2D", after the channel mode changed */
+
+struct udp_header {
+	uint32_t magic;
+	uint32_t seq;		/* datagram sequence number */
+	uint64_t sample;	/* index of the first sample in the datagram */
+	uint64_t timestamp;	/* ns since the epoch of the first sample */
+};
+
+struct udp_output {
+	struct ev_source ev;
+	struct sockaddr_storage dst;
+	socklen_t dst_len;
+	uint32_t payload;	/* sample bytes per datagram */
+	uint64_t seq;		/* ring cursor */
+	uint32_t offset;
+	uint32_t dgram_seq;
+	bool want_out;
+	uint64_t datagrams;
+	uint64_t syscalls;
+	uint64_t dropped;
+};
+
+/* a local reader of the shared memory ring, see fx2adc_shm.h */
+struct shm_reader {
+	struct ev_source ev;
+	uint32_t index;
+	struct fx2adc_shm_reader *cursor;	/* mapped from the reader's memfd */
+	struct shm_reader *next;
+};
+
+typedef struct { /* structure size must be multiple of 2 bytes */
+	char magic[4];
+	uint32_t tuner_type;
+	uint32_t tuner_gain_count;
+} dongle_info_t;
+
+static fx2adc_dev_t *dev = NULL;
+
+static struct ring ring;
+static int llbuf_num = DEFAULT_MAX_NUM_BUFFERS;
+static bool ext_clock = false;
+static int vdiv_mv[2];
+static bool warm = false;		/* keep streaming without clients */
+static uint32_t history_ms = 0;		/* replayed to new clients */
+static uint32_t history_slots = 0;
+static uint32_t retain_ms = 0;		/* kept for resuming */
+static uint32_t retain_slots = 0;
+static uint32_t buf_num = 0;
+
+static struct conv_stream *conv_streams = NULL;
+
+#ifdef HAVE_ZSTD
+#define COMP_QUEUE_LEN 256
+#define COMP_MAX_THREADS 16
+#define COMP_MAX_JOBS 32	/* per stream */
+
+struct comp_job {
+	struct conv_stream *st;
+	uint64_t seq;
+};
+
+/* compression workers, they take slots from the queue in any order */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job was queued */
+	pthread_cond_t done;	/* a job was finished */
+	pthread_t threads[COMP_MAX_THREADS];
+	int num_threads;
+	struct comp_job queue[COMP_QUEUE_LEN];
+	unsigned int first;
+	unsigned int num;
+	bool exit;
+} pool;
+#endif
+static int comp_level = 1;
+static int comp_threads = 0;	/* 0: number of CPUs - 1 */
+
+static struct client *clients = NULL;
+static int num_clients = 0;
+static int max_clients = DEFAULT_MAX_CLIENTS;
+static struct ev_source listen_src = { EV_LISTEN, INVALID_SOCKET };
+static bool listening = false;
+
+static int use_zerocopy = 0;
+static bool default_framed = false;
+static uint32_t holdoff_ms = DEFAULT_HOLDOFF_MS;
+
+#ifdef HAVE_IO_URING
+#define URING_ENTRIES	256
+
+/* one send of a chain, a data send holds the pin of its slot until the
+ * kernel doesn't reference the slot anymore */
+struct uring_op {
+	struct client *c;	/* NULL once the client is gone */
+	struct ring *ring;	/* NULL for frame headers */
+	uint64_t seq;
+	bool in_chain;
+	bool notif;		/* zero-copy notification outstanding */
+	struct uring_op *next, **pprev;
+};
+
+static struct {
+	int fd;
+	struct ev_source ev;	/* eventfd signalled on completions */
+	void *ring_ptr;
+	size_t ring_len;
+	struct io_uring_sqe *sqes;
+	unsigned int *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail, *cq_flags;
+	unsigned int sq_entries, sq_mask, cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int to_submit;
+	bool zc;		/* send the slots with IORING_OP_SEND_ZC */
+	bool fixed;		/* the slots of the main ring are registered */
+	bool wake;
+	uint64_t enters, sends;
+} uring = { .fd = -1, .ev = { EV_URING, INVALID_SOCKET } };
+#endif
+static bool use_uring = false;
+
+static struct udp_output *udp = NULL;
+
+#ifdef HAVE_SHM
+static struct ev_source shm_listen_src = { EV_SHM_LISTEN, INVALID_SOCKET };
+#endif
+static const char *shm_path = NULL;
+static struct shm_reader *shm_readers = NULL;
+static int num_shm_readers = 0;
+
+static pthread_t usb_thread;
+static bool stream_running = false;
+static volatile int usb_done = 0;
+static int usb_result = 0;
+
+static volatile int do_exit = 0;
+
+
+void usage(void)
+{
+	fprintf(stderr, "fx2adc_tcp, a sample data server FX2 based USB scopes\n\n");
+	fprintf(stderr, "Usage:\t[-a listen address]\n");
+	fprintf(stderr, "\t[-p listen port (default: %s)]\n", DEFAULT_PORT_STR);
+	fprintf(stderr, "\t[-e (use external clock on IFCLK)]\n");
+	fprintf(stderr, "\t[-s samplerate in Hz (default: %d Hz)]\n", DEFAULT_SAMPLE_RATE_HZ);
+	fprintf(stderr, "\t[-v voltage divider in mV, default is the lowest setting the hardware supports\n");
+	fprintf(stderr, "\t[-b number of buffers (default: 15, set by library)]\n");
+	fprintf(stderr, "\t[-n max number of buffers to queue per client (default: %d)]\n", DEFAULT_MAX_NUM_BUFFERS);
+	fprintf(stderr, "\t[-c max number of clients (default: %d)]\n", DEFAULT_MAX_CLIENTS);
+	fprintf(stderr, "\t[-d device index (default: 0)]\n");
+	fprintf(stderr, "\t[-P ppm_error (default: 0)]\n");
+#ifdef HAVE_MSG_ZEROCOPY
+	fprintf(stderr, "\t[-z (send with MSG_ZEROCOPY)]\n");
+#endif
+#ifdef HAVE_IO_URING
+	fprintf(stderr, "\t[-U (send via io_uring, with -z from registered buffers without copying)]\n");
+#endif
+	fprintf(stderr, "\t[-F (send framed data with headers from the start, see README)]\n");
+	fprintf(stderr, "\t[-D ms to wait for the commands of a new client before sending (default: %d)]\n", DEFAULT_HOLDOFF_MS);
+	fprintf(stderr, "\t[-u address:port (additionally stream via UDP, e.g. to a multicast group)]\n");
+	fprintf(stderr, "\t[-M UDP datagram size (default: %d, up to 8972 with jumbo frames)]\n", DEFAULT_UDP_DGRAM_SIZE);
+	fprintf(stderr, "\t[-T multicast TTL (default: 1)]\n");
+	fprintf(stderr, "\t[-w (keep the device streaming while no client is connected)]\n");
+	fprintf(stderr, "\t[-H history in ms sent to new clients first (implies -w)]\n");
+	fprintf(stderr, "\t[-R ms kept in the ring for clients resuming after a reconnect (implies -w)]\n");
+#ifdef HAVE_SHM
+	fprintf(stderr, "\t[-L unix socket path (additionally share the sample ring with local readers)]\n");
+#endif
+#ifdef HAVE_ZSTD
+	fprintf(stderr, "\t[-Z zstd level for clients requesting compression (default: 1)]\n");
+#endif
+	fprintf(stderr, "\t[-j number of compression and resampler threads (default: number of CPUs - 1)]\n");
+	exit(1);
+}
+
+#ifdef _WIN32
+int gettimeofday(struct timeval *tv, void* ignored)
+{
+	FILETIME ft;
+	unsigned __int64 tmp = 0;
+	if (NULL != tv) {
+		GetSystemTimeAsFileTime(&ft);
+		tmp |= ft.dwHighDateTime;
+		tmp <<= 32;
+		tmp |= ft.dwLowDateTime;
+		tmp /= 10;
+#ifdef _MSC_VER
+		tmp -= 11644473600000000Ui64;
+#else
+		tmp -= 11644473600000000ULL;
+#endif
+		tv->tv_sec = (long)(tmp / 1000000UL);
+		tv->tv_usec = (long)(tmp % 1000000UL);
+	}
+	return 0;
+}
+#endif
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint64_t hton64(uint64_t x)
+{
+	return ((uint64_t)htonl((uint32_t)x) << 32) | htonl((uint32_t)(x >> 32));
+}
+
+#define ntoh64 hton64
+
+/*
+ * Wakeup source for the event loop, signalled by the USB thread when new
+ * data is available and by the signal handler. This is an eventfd on
+ * Linux, a pipe on other POSIX systems and a loopback UDP socket that
+ * sends to itself on Windows.
+ */
+static struct ev_source wakeup_src = { EV_WAKEUP, INVALID_SOCKET };
+#if !defined(HAVE_EPOLL) && !defined(_WIN32)
+static int wakeup_pipe_wr = -1;
+#endif
+
+static int wakeup_init(void)
+{
+#if defined(HAVE_EPOLL)
+	wakeup_src.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return wakeup_src.fd < 0 ? -1 : 0;
+#elif defined(_WIN32)
+	struct sockaddr_in sa;
+	int len = sizeof(sa);
+	u_long mode = 1;
+
+	wakeup_src.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (wakeup_src.fd == INVALID_SOCKET)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(wakeup_src.fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    getsockname(wakeup_src.fd, (struct sockaddr *)&sa, &len) ||
+	    connect(wakeup_src.fd, (struct sockaddr *)&sa, sizeof(sa)))
+		return -1;
+
+	ioctlsocket(wakeup_src.fd, FIONBIO, &mode);
+	return 0;
+#else
+	int fds[2];
+
+	if (pipe(fds))
+		return -1;
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+	wakeup_src.fd = fds[0];
+	wakeup_pipe_wr = fds[1];
+	return 0;
+#endif
+}
+
+/* async-signal-safe */
+static void wakeup_signal(void)
+{
+#if defined(HAVE_EPOLL)
+	uint64_t one = 1;
+	ssize_t r = write(wakeup_src.fd, &one, sizeof(one));
+#elif defined(_WIN32)
+	char one = 1;
+	send(wakeup_src.fd, &one, 1, 0);
+#else
+	char one = 1;
+	ssize_t r = write(wakeup_pipe_wr, &one, 1);
+#endif
+}
+
+static void wakeup_drain(void)
+{
+#if defined(HAVE_EPOLL)
+	uint64_t cnt;
+	ssize_t r = read(wakeup_src.fd, &cnt, sizeof(cnt));
+#elif defined(_WIN32)
+	char buf[64];
+
+	while (recv(wakeup_src.fd, buf, sizeof(buf), 0) > 0)
+		;
+#else
+	char buf[64];
+
+	while (read(wakeup_src.fd, buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
+#ifdef _WIN32
+BOOL WINAPI
+sighandler(int signum)
+{
+	if (CTRL_C_EVENT == signum) {
+		fprintf(stderr, "Signal caught, exiting!\n");
+		do_exit = 1;
+		wakeup_signal();
+		return TRUE;
+	}
+	return FALSE;
+}
+#else
+static void sighandler(int signum)
+{
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "Signal caught, exiting!\n");
+	do_exit = 1;
+	wakeup_signal();
+}
+#endif
+
+/*
+ * Minimal poller interface: epoll where available, poll() otherwise.
+ */
+#define POLLER_IN	0x1
+#define POLLER_OUT	0x2
+#define POLLER_ERR	0x4
+#define POLLER_HUP	0x8
+
+struct poller_event {
+	struct ev_source *src;
+	unsigned int events;
+};
+
+#ifdef HAVE_EPOLL
+static int epfd = -1;
+
+static int poller_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	return epfd < 0 ? -1 : 0;
+}
+
+static int poller_ctl(int op, struct ev_source *src, unsigned int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & POLLER_IN) ? EPOLLIN : 0) |
+		    ((events & POLLER_OUT) ? EPOLLOUT : 0);
+	ev.data.ptr = src;
+
+	return epoll_ctl(epfd, op, src->fd, &ev);
+}
+
+static int poller_add(struct ev_source *src, unsigned int events)
+{
+	return poller_ctl(EPOLL_CTL_ADD, src, events);
+}
+
+static int poller_mod(struct ev_source *src, unsigned int events)
+{
+	return poller_ctl(EPOLL_CTL_MOD, src, events);
+}
+
+static void poller_del(struct ev_source *src)
+{
+	poller_ctl(EPOLL_CTL_DEL, src, 0);
+}
+
+static int poller_wait(struct poller_event *out, int max, int timeout)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(epfd, ev, max < MAX_EVENTS ? max : MAX_EVENTS, timeout);
+
+	for (i = 0; i < n; i++) {
+		out[i].src = ev[i].data.ptr;
+		out[i].events = ((ev[i].events & EPOLLIN) ? POLLER_IN : 0) |
+				((ev[i].events & EPOLLOUT) ? POLLER_OUT : 0) |
+				((ev[i].events & EPOLLERR) ? POLLER_ERR : 0) |
+				((ev[i].events & EPOLLHUP) ? POLLER_HUP : 0);
+	}
+
+	return n;
+}
+#else
+#define POLLER_MAX_FDS 64
+
+static struct pollfd poll_fds[POLLER_MAX_FDS];
+static struct ev_source *poll_srcs[POLLER_MAX_FDS];
+static int poll_num = 0;
+
+static int poller_init(void)
+{
+	return 0;
+}
+
+static int poller_find(struct ev_source *src)
+{
+	int i;
+
+	for (i = 0; i < poll_num; i++)
+		if (poll_srcs[i] == src)
+			return i;
+
+	return -1;
+}
+
+static int poller_mod(struct ev_source *src, unsigned int events)
+{
+	int i = poller_find(src);
+
+	if (i < 0)
+		return -1;
+
+	poll_fds[i].events = ((events & POLLER_IN) ? POLLIN : 0) |
+			     ((events & POLLER_OUT) ? POLLOUT : 0);
+	return 0;
+}
+
+static int poller_add(struct ev_source *src, unsigned int events)
+{
+	if (poll_num == POLLER_MAX_FDS)
+		return -1;
+
+	poll_fds[poll_num].fd = src->fd;
+	poll_srcs[poll_num++] = src;
+
+	return poller_mod(src, events);
+}
+
+static void poller_del(struct ev_source *src)
+{
+	int i = poller_find(src);
+
+	if (i < 0)
+		return;
+
+	poll_num--;
+	poll_fds[i] = poll_fds[poll_num];
+	poll_srcs[i] = poll_srcs[poll_num];
+}
+
+static int poller_wait(struct poller_event *out, int max, int timeout)
+{
+	int i, n = 0;
+
+	if (poll(poll_fds, poll_num, timeout) < 0)
+		return -1;
+
+	for (i = 0; i < poll_num && n < max; i++) {
+		if (!poll_fds[i].revents)
+			continue;
+
+		out[n].src = poll_srcs[i];
+		out[n].events = ((poll_fds[i].revents & POLLIN) ? POLLER_IN : 0) |
+				((poll_fds[i].revents & POLLOUT) ? POLLER_OUT : 0) |
+				((poll_fds[i].revents & POLLERR) ? POLLER_ERR : 0) |
+				((poll_fds[i].revents & POLLHUP) ? POLLER_HUP : 0);
+		n++;
+	}
+
+	return n;
+}
+#endif
+
+#ifdef HAVE_SHM
+/*
+ * Place the slot data in a memfd, so that local readers can map it and
+ * get the samples without any copy. The header and the slot descriptors
+ * go into the first pages, see fx2adc_shm.h. Readers get the memfd
+ * reopened read-only, so that they can't map it writable.
+ */
+static int ring_alloc_shared(struct ring *r)
+{
+	struct fx2adc_shm_header *hdr;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t hdr_size, total;
+	unsigned char *data;
+	char path[64];
+	uint32_t i;
+
+	hdr_size = sizeof(*hdr) + r->num * sizeof(struct fx2adc_shm_slot);
+	hdr_size = (hdr_size + page - 1) & ~(page - 1);
+	total = hdr_size + (size_t)r->num * r->slot_size;
+
+	r->shm_fd = memfd_create("fx2adc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (r->shm_fd < 0)
+		return -1;
+
+	if (ftruncate(r->shm_fd, total))
+		return -1;
+
+	/* a reader shrinking the memfd would crash the server */
+	fcntl(r->shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", r->shm_fd);
+	r->shm_ro_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (r->shm_ro_fd < 0)
+		return -1;
+
+	hdr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, r->shm_fd, 0);
+	if (hdr == MAP_FAILED)
+		return -1;
+
+	hdr->magic = FX2ADC_SHM_MAGIC;
+	hdr->version = FX2ADC_SHM_VERSION;
+	hdr->num_slots = r->num;
+	hdr->slot_size = r->slot_size;
+	hdr->data_offset = hdr_size;
+	hdr->total_size = total;
+
+	data = (unsigned char *)hdr + hdr_size;
+	for (i = 0; i < r->num; i++) {
+		r->slots[i].data = data + (size_t)i * r->slot_size;
+		r->slots[i].seq = RING_SEQ_WRITING;
+		hdr->slots[i].seq = FX2ADC_SHM_SEQ_WRITING;
+	}
+
+	r->shm = hdr;
+	r->shm_size = total;
+
+	return 0;
+}
+
+/* called by the USB thread after a slot has been filled, with the ring
+ * lock held, which keeps the reader cursors mapped */
+static void ring_publish_shared(struct ring *r, struct ring_slot *slot)
+{
+	struct fx2adc_shm_header *hdr = r->shm;
+	struct fx2adc_shm_slot *s = &hdr->slots[slot - r->slots];
+	uint32_t i, waiters = 0;
+
+	s->len = slot->len;
+	s->sample = slot->sample;
+	s->timestamp = slot->timestamp;
+	s->flags = (slot->flags & FRAME_FLAG_DUAL ? FX2ADC_SHM_SLOT_DUAL : 0) |
+		   (slot->flags & FRAME_FLAG_DISCONT ? FX2ADC_SHM_SLOT_DISCONT : 0);
+	__atomic_store_n(&s->seq, slot->seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->head, slot->seq + 1, __ATOMIC_RELEASE);
+
+	/* only enter the kernel if a reader is actually sleeping */
+	__atomic_add_fetch(&hdr->head_futex, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < FX2ADC_SHM_MAX_READERS; i++) {
+		if (r->shm_cursors[i])
+			waiters |= __atomic_load_n(&r->shm_cursors[i]->waiters, __ATOMIC_SEQ_CST);
+	}
+	if (waiters)
+		syscall(SYS_futex, &hdr->head_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+static void ring_set_rate(struct ring *r, uint32_t rate)
+{
+	r->rate = rate;
+#ifdef HAVE_SHM
+	if (r->shm)
+		__atomic_store_n(&r->shm->sample_rate, rate, __ATOMIC_RELAXED);
+#endif
+}
+
+static int ring_alloc(struct ring *r, uint32_t num, uint32_t slot_size, bool shared)
+{
+	uint32_t i;
+
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+
+	r->slots = calloc(num, sizeof(struct ring_slot));
+	if (!r->slots)
+		return -1;
+
+	r->num = num;
+	r->slot_size = slot_size;
+	r->channels = 1;
+
+#ifdef HAVE_SHM
+	r->shm_fd = -1;
+	r->shm_ro_fd = -1;
+	if (shared)
+		return ring_alloc_shared(r);
+#endif
+
+	for (i = 0; i < num; i++) {
+		r->slots[i].data = malloc(slot_size);
+		if (!r->slots[i].data)
+			return -1;
+
+		r->slots[i].seq = RING_SEQ_WRITING;
+	}
+
+	return 0;
+}
+
+static void ring_free(struct ring *r)
+{
+	uint32_t i;
+
+#ifdef HAVE_SHM
+	if (r->shm) {
+		/* wake up all readers, they will see the closed flag */
+		__atomic_or_fetch(&r->shm->flags, FX2ADC_SHM_CLOSED, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&r->shm->head_futex, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &r->shm->head_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+		munmap(r->shm, r->shm_size);
+		close(r->shm_fd);
+		close(r->shm_ro_fd);
+		r->shm = NULL;
+	} else
+#endif
+	if (r->slots) {
+		for (i = 0; i < r->num; i++)
+			free(r->slots[i].data);
+	}
+
+	free(r->slots);
+	r->slots = NULL;
+
+	pthread_mutex_destroy(&r->lock);
+}
+
+static inline struct ring_slot *ring_slot(struct ring *r, uint64_t seq)
+{
+	return &r->slots[seq % r->num];
+}
+
+/* called with the ring lock held */
+static void ring_unpin(struct ring *r, uint64_t seq, uint32_t count)
+{
+	while (count--)
+		ring_slot(r, seq++)->pins--;
+}
+
+/* move a read cursor forward by len bytes */
+static void ring_advance(struct ring *r, uint64_t *seq, uint32_t *offset, size_t len)
+{
+	struct ring_slot *slot;
+
+	while (len) {
+		slot = ring_slot(r, *seq);
+		if (len < slot->len - *offset) {
+			*offset += len;
+			break;
+		}
+		len -= slot->len - *offset;
+		*offset = 0;
+		(*seq)++;
+	}
+}
+
+/* a reader may be behind by its queue length on top of the history or
+ * the retention, whichever is longer, called with the ring lock held */
+static uint64_t ring_max_lag(struct ring *r)
+{
+	uint64_t lag = (uint64_t)llbuf_num +
+		       (history_slots > retain_slots ? history_slots : retain_slots);
+
+	return lag < r->num - 1 ? lag : r->num - 1;
+}
+
+/* first slot for a new reader, history_ms back in time if possible,
+ * called with the ring lock held */
+static uint64_t ring_start_seq(struct ring *r)
+{
+	uint64_t n = ((uint64_t)history_ms * r->rate * r->channels / 1000 +
+		      r->slot_size - 1) / r->slot_size;
+
+	if (n > history_slots)
+		n = history_slots;
+	if (n > r->head)
+		n = r->head;
+
+	return r->head - n;
+}
+
+/* sample indices and rates count per channel, the slots hold both */
+static unsigned int slot_channels(const struct ring_slot *slot)
+{
+	return slot->flags & FRAME_FLAG_DUAL ? 2 : 1;
+}
+
+static void fx2adc_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	struct ring *r = ctx;
+	struct ring_slot *slot;
+	unsigned int ch;
+
+	if (do_exit)
+		return;
+
+	if (len > r->slot_size)
+		len = r->slot_size;
+
+	/* the mode is changed under the lock by the event loop; transfers
+	 * in flight at the switch may still hold samples of the old mode,
+	 * which the discontinuity flag tells the readers */
+	pthread_mutex_lock(&r->lock);
+	ch = r->channels;
+	slot = ring_slot(r, r->head);
+	if (slot->pins) {
+		/* a client is still sending the oldest slot, the samples
+		 * still count so that readers see the gap */
+		r->overruns++;
+		r->samples += len / ch;
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+	slot->seq = RING_SEQ_WRITING;
+	pthread_mutex_unlock(&r->lock);
+
+#ifdef HAVE_SHM
+	if (r->shm) {
+		/* readers check the sequence number again after reading */
+		__atomic_store_n(&r->shm->slots[slot - r->slots].seq,
+				 FX2ADC_SHM_SEQ_WRITING, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+#endif
+
+	memcpy(slot->data, buf, len);
+
+	/* the callback runs right after the last sample was received */
+	slot->timestamp = now_ns() - (r->rate ? len / ch * 1000000000ULL / r->rate : 0);
+
+	pthread_mutex_lock(&r->lock);
+	slot->len = len;
+	slot->samples = len / ch;
+	slot->flags = ch == 2 ? FRAME_FLAG_DUAL : 0;
+	if (r->discont && ch == r->channels) {
+		slot->flags |= FRAME_FLAG_DISCONT;
+		r->discont = false;
+	}
+	slot->sample = r->samples;
+	r->samples += len / ch;
+	slot->seq = r->head++;
+#ifdef HAVE_SHM
+	if (r->shm)
+		ring_publish_shared(r, slot);
+#endif
+	pthread_mutex_unlock(&r->lock);
+
+	wakeup_signal();
+}
+
+static void *usb_worker(void *arg)
+{
+	usb_result = fx2adc_read(dev, fx2adc_callback, &ring,
+				 buf_num, DEFAULT_BUF_LENGTH);
+	usb_done = 1;
+	wakeup_signal();
+
+	return NULL;
+}
+
+static void stream_start(void)
+{
+	if (stream_running)
+		return;
+
+	usb_done = 0;
+	if (pthread_create(&usb_thread, NULL, usb_worker, NULL)) {
+		fprintf(stderr, "Failed to create USB thread\n");
+		return;
+	}
+
+	stream_running = true;
+}
+
+static void stream_stop(void)
+{
+	if (!stream_running)
+		return;
+
+	/* the USB thread might not have started streaming yet */
+	while (!usb_done) {
+		fx2adc_cancel_async(dev);
+		usleep(10000);
+	}
+
+	pthread_join(usb_thread, NULL);
+	stream_running = false;
+}
+
+static void send_stats_init(struct send_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#ifndef _WIN32
+#ifdef RUSAGE_THREAD
+	getrusage(RUSAGE_THREAD, &stats->ru_start);
+#else
+	getrusage(RUSAGE_SELF, &stats->ru_start);
+#endif
+#endif
+}
+
+static void print_send_stats(struct send_stats *stats)
+{
+	double mbytes = stats->bytes / 1e6;
+#ifndef _WIN32
+	struct rusage ru;
+	double cpu;
+
+#ifdef RUSAGE_THREAD
+	getrusage(RUSAGE_THREAD, &ru);
+#else
+	getrusage(RUSAGE_SELF, &ru);
+#endif
+	cpu = (ru.ru_utime.tv_sec - stats->ru_start.ru_utime.tv_sec) +
+	      (ru.ru_stime.tv_sec - stats->ru_start.ru_stime.tv_sec) +
+	      (ru.ru_utime.tv_usec - stats->ru_start.ru_utime.tv_usec) / 1e6 +
+	      (ru.ru_stime.tv_usec - stats->ru_start.ru_stime.tv_usec) / 1e6;
+#endif
+
+	if (!stats->bytes)
+		return;
+
+	fprintf(stderr, "sent %.1f MB in %llu send calls (%.2f calls/MB)\n",
+		mbytes, (unsigned long long)stats->syscalls,
+		stats->syscalls / mbytes);
+#ifndef _WIN32
+	fprintf(stderr, "event loop CPU time %.3f s (%.3f s/GB)\n",
+		cpu, cpu / (mbytes / 1e3));
+#endif
+}
+
+static int send_iov(SOCKET sock, struct iovec *iov, int iovcnt, int flags)
+{
+#ifdef _WIN32
+	WSABUF bufs[SEND_IOV_MAX];
+	DWORD sent = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		bufs[i].buf = iov[i].iov_base;
+		bufs[i].len = (ULONG)iov[i].iov_len;
+	}
+
+	if (WSASend(sock, bufs, iovcnt, &sent, 0, NULL, NULL))
+		return SOCKET_ERROR;
+
+	return (int)sent;
+#else
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	return sendmsg(sock, &msg, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+#endif
+}
+
+static bool send_would_block(void)
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static void client_want_out(struct client *c, bool want)
+{
+	if (c->want_out == want)
+		return;
+
+	c->want_out = want;
+	poller_mod(&c->ev, POLLER_IN | (want ? POLLER_OUT : 0));
+}
+
+/* Waiting for zero-copy completions, the socket may well be writable, so
+ * don't poll for that until zc_reap() released something. */
+static int client_zc_wait(struct client *c)
+{
+	c->zc_wait = true;
+	client_want_out(c, false);
+	return 0;
+}
+
+#ifdef HAVE_MSG_ZEROCOPY
+/* Read zero-copy completion notifications from the socket error queue and
+ * unpin all slots the kernel does not reference anymore. Returns -1 if
+ * the socket has a real error. */
+static int zc_reap(struct client *c)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	struct zc_send *zs;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(c->ev.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			/* slots were released, continue sending */
+			if (c->zc_wait) {
+				c->zc_wait = false;
+				client_want_out(c, true);
+			}
+			return 0;
+		}
+
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm)
+			continue;
+
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			return -1;
+
+		/* the kernel had to fall back to copying (e.g. on loopback) */
+		if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !c->stats.zc_copied++)
+			fprintf(stderr, "zero-copy send fell back to copying\n");
+
+		/* sends [ee_info, ee_data] are completed, notifications for
+		 * TCP arrive in order, so everything up to ee_data is done */
+		pthread_mutex_lock(&c->ring->lock);
+		while (c->zc_num) {
+			zs = &c->zc[c->zc_first];
+			if ((int32_t)(zs->id - serr->ee_data) > 0)
+				break;
+
+			ring_unpin(c->ring, zs->seq, zs->count);
+			c->zc_first = (c->zc_first + 1) % ZEROCOPY_MAX_PENDING;
+			c->zc_num--;
+		}
+		pthread_mutex_unlock(&c->ring->lock);
+	}
+}
+#endif
+
+/* -j default, the event loop and the USB thread need a core as well */
+static int default_threads(void)
+{
+	int n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n > 2 ? n - 1 : 1;
+}
+
+#ifdef HAVE_ZSTD
+static uint64_t thread_cpu_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+	return 0;
+}
+
+/* Compress one slot, both the input and the output slot have been
+ * claimed by comp_queue(). Slots that don't get smaller are sent as
+ * they are. */
+static void comp_slot(struct conv_stream *st, uint64_t seq, ZSTD_CCtx *cctx,
+		      unsigned char *scratch)
+{
+	struct ring_slot *in = ring_slot(st->src, seq);
+	struct ring_slot *out = ring_slot(&st->ring, seq);
+	const unsigned char *data = in->data;
+	uint8_t flags = in->flags | FRAME_FLAG_ZSTD;
+	uint64_t start = thread_cpu_ns();
+	size_t len;
+	uint32_t i;
+
+	if (st->codec == CODEC_ZSTD_DELTA && in->len) {
+		scratch[0] = in->data[0];
+		for (i = 1; i < in->len; i++)
+			scratch[i] = in->data[i] - in->data[i - 1];
+		data = scratch;
+		flags |= FRAME_FLAG_DELTA;
+	}
+
+	len = ZSTD_compress2(cctx, out->data, st->ring.slot_size, data, in->len);
+	if (ZSTD_isError(len) || len >= in->len) {
+		memcpy(out->data, in->data, in->len);
+		len = in->len;
+		flags = in->flags;
+	}
+
+	pthread_mutex_lock(&st->ring.lock);
+	out->len = len;
+	out->flags = flags;
+	out->samples = in->samples;
+	out->sample = in->sample;
+	out->timestamp = in->timestamp;
+	out->seq = seq;
+
+	/* slots are finished in any order, publish the ones in sequence */
+	while (ring_slot(&st->ring, st->ring.head)->seq == st->ring.head)
+		st->ring.head++;
+
+	st->bytes_in += in->len;
+	st->bytes_out += len;
+	st->cpu_ns += thread_cpu_ns() - start;
+	if (!(flags & FRAME_FLAG_ZSTD))
+		st->stored++;
+	pthread_mutex_unlock(&st->ring.lock);
+
+	pthread_mutex_lock(&st->src->lock);
+	in->pins--;
+	pthread_mutex_unlock(&st->src->lock);
+}
+
+static void *comp_worker(void *arg)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	unsigned char *scratch = malloc(ring.slot_size);
+	struct comp_job job;
+
+	if (!cctx || !scratch) {
+		fprintf(stderr, "Failed to set up compression worker\n");
+		do_exit = 1;
+		wakeup_signal();
+		return NULL;
+	}
+
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, comp_level);
+
+	while (1) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.num && !pool.exit)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.exit) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		job = pool.queue[pool.first];
+		pool.first = (pool.first + 1) % COMP_QUEUE_LEN;
+		pool.num--;
+		pthread_mutex_unlock(&pool.lock);
+
+		comp_slot(job.st, job.seq, cctx, scratch);
+
+		pthread_mutex_lock(&pool.lock);
+		job.st->jobs--;
+		pthread_cond_broadcast(&pool.done);
+		pthread_mutex_unlock(&pool.lock);
+
+		wakeup_signal();
+	}
+
+	ZSTD_freeCCtx(cctx);
+	free(scratch);
+
+	return NULL;
+}
+
+static int pool_start(void)
+{
+	int i;
+
+	if (pool.num_threads)
+		return 0;
+
+	if (!comp_threads)
+		comp_threads = default_threads();
+	if (comp_threads > COMP_MAX_THREADS)
+		comp_threads = COMP_MAX_THREADS;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	for (i = 0; i < comp_threads; i++) {
+		if (pthread_create(&pool.threads[i], NULL, comp_worker, NULL))
+			break;
+		pool.num_threads++;
+	}
+
+	if (!pool.num_threads)
+		return -1;
+
+	fprintf(stderr, "compressing on %d threads, zstd level %d\n",
+		pool.num_threads, comp_level);
+
+	return 0;
+}
+
+static void pool_stop(void)
+{
+	int i;
+
+	if (!pool.num_threads)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.exit = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.num_threads; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.num_threads = 0;
+}
+
+/* Hand the new input slots of a compressed stream to the workers. As
+ * with conv_run(), a pinned output slot stalls the stream, and if it
+ * falls behind too far the missing slots are left out. */
+static void comp_queue(struct conv_stream *st)
+{
+	struct ring_slot *in, *out;
+	uint64_t lag, max_lag;
+	unsigned int jobs;
+
+	while (1) {
+		pthread_mutex_lock(&pool.lock);
+		jobs = st->jobs;
+		if (pool.num == COMP_QUEUE_LEN || jobs >= COMP_MAX_JOBS) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		pthread_mutex_lock(&st->src->lock);
+		lag = st->src->head - st->in_seq;
+		if (!lag || (int64_t)lag < 0) {
+			pthread_mutex_unlock(&st->src->lock);
+			break;
+		}
+
+		/* the output head can only jump once all jobs are done */
+		max_lag = ring_max_lag(st->src);
+		in = ring_slot(st->src, st->in_seq);
+		if (lag > max_lag || in->seq != st->in_seq) {
+			if (jobs) {
+				pthread_mutex_unlock(&st->src->lock);
+				break;
+			}
+			if (lag > max_lag) {
+				st->skipped += lag - max_lag;
+				st->in_seq += lag - max_lag;
+			} else {
+				/* not converted in time by the source stream */
+				st->skipped++;
+				st->in_seq++;
+			}
+			pthread_mutex_unlock(&st->src->lock);
+
+			pthread_mutex_lock(&st->ring.lock);
+			st->ring.head = st->in_seq;
+			pthread_mutex_unlock(&st->ring.lock);
+			continue;
+		}
+
+		in->pins++;
+		pthread_mutex_unlock(&st->src->lock);
+
+		pthread_mutex_lock(&st->ring.lock);
+		out = ring_slot(&st->ring, st->in_seq);
+		if (out->pins) {
+			pthread_mutex_unlock(&st->ring.lock);
+			pthread_mutex_lock(&st->src->lock);
+			in->pins--;
+			pthread_mutex_unlock(&st->src->lock);
+			break;
+		}
+		out->seq = RING_SEQ_WRITING;
+		pthread_mutex_unlock(&st->ring.lock);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.queue[(pool.first + pool.num) % COMP_QUEUE_LEN] =
+			(struct comp_job){ st, st->in_seq };
+		pool.num++;
+		st->jobs++;
+		pthread_cond_signal(&pool.work);
+		pthread_mutex_unlock(&pool.lock);
+
+		st->in_seq++;
+	}
+}
+#endif
+
+static void conv_put(struct conv_stream *st);
+
+static struct conv_stream *conv_get(convert_format_t format, unsigned int decim,
+				     uint32_t out_rate, enum codec codec, uint64_t seq)
+{
+	struct conv_stream *st;
+	size_t slot_size;
+
+	/* resampling takes the place of the decimation */
+	if (out_rate)
+		decim = 1;
+
+	for (st = conv_streams; st; st = st->next) {
+		if (st->format == format && st->decim == decim &&
+		    st->out_rate == out_rate && st->codec == codec) {
+			st->users++;
+			return st;
+		}
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+
+	st->format = format;
+	st->decim = decim;
+	st->out_rate = out_rate;
+	st->codec = codec;
+	st->src = &ring;
+
+	if (codec != CODEC_NONE) {
+#ifdef HAVE_ZSTD
+		/* compress the converted samples, if any */
+		if (format != CONVERT_U8 || decim != 1 || out_rate) {
+			st->src_stream = conv_get(format, decim, out_rate, CODEC_NONE, seq);
+			if (!st->src_stream)
+				goto err;
+			st->src = &st->src_stream->ring;
+		}
+
+		slot_size = ZSTD_compressBound(st->src->slot_size);
+		if (pool_start())
+			goto err;
+#else
+		goto err;
+#endif
+	} else if (out_rate) {
+		st->in_rate = ring.rate;
+		st->rs = resample_new(ring.rate, out_rate, format,
+				      comp_threads ? comp_threads : default_threads());
+		if (!st->rs)
+			goto err;
+		/* room for a lower device rate as well */
+		slot_size = ring.slot_size * convert_sample_size(format);
+		if (slot_size < resample_max_out(st->rs, ring.slot_size))
+			slot_size = resample_max_out(st->rs, ring.slot_size);
+	} else {
+		st->conv = convert_new(format, decim);
+		if (!st->conv)
+			goto err;
+		slot_size = convert_max_out(st->conv, ring.slot_size);
+	}
+
+	if (ring_alloc(&st->ring, ring.num, slot_size, false))
+		goto err;
+
+	/* start with the slot the first client is at */
+	st->ring.head = seq;
+	st->in_seq = seq;
+	st->users = 1;
+
+	st->next = conv_streams;
+	conv_streams = st;
+
+	if (codec != CODEC_NONE)
+		fprintf(stderr, "compressing format %d, decimation %u%s\n", format, decim,
+			codec == CODEC_ZSTD_DELTA ? " with delta coding" : "");
+	else if (st->rs)
+		fprintf(stderr, "resampling format %d to %.3f Hz\n", format,
+			resample_rate(st->rs));
+	else
+		fprintf(stderr, "converting to format %d, decimation %u\n", format, decim);
+
+	return st;
+err:
+	ring_free(&st->ring);
+	convert_free(st->conv);
+	resample_free(st->rs);
+	if (st->src_stream)
+		conv_put(st->src_stream);
+	free(st);
+	return NULL;
+}
+
+static void conv_put(struct conv_stream *st)
+{
+	struct conv_stream **p;
+
+	if (--st->users)
+		return;
+
+	for (p = &conv_streams; *p != st; p = &(*p)->next)
+		;
+	*p = st->next;
+
+#ifdef HAVE_ZSTD
+	/* queued slots still reference the stream */
+	if (st->codec != CODEC_NONE) {
+		pthread_mutex_lock(&pool.lock);
+		while (st->jobs)
+			pthread_cond_wait(&pool.done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	if (st->bytes_in)
+		fprintf(stderr, "compressed %.1f MB to %.1f MB (ratio %.2f), "
+			"%.2f ms CPU per MB, %llu buffers not compressible\n",
+			st->bytes_in / 1e6, st->bytes_out / 1e6,
+			(double)st->bytes_in / st->bytes_out,
+			st->cpu_ns / 1e6 / (st->bytes_in / 1e6),
+			(unsigned long long)st->stored);
+#endif
+
+	if (st->skipped)
+		fprintf(stderr, "%llu buffers not %s in time\n",
+			(unsigned long long)st->skipped,
+			st->codec != CODEC_NONE ? "compressed" : "converted");
+
+	ring_free(&st->ring);
+	convert_free(st->conv);
+	resample_free(st->rs);
+	if (st->src_stream)
+		conv_put(st->src_stream);
+	free(st);
+}
+
+/* a client converts the samples to another format, decimates or
+ * resamples them */
+static bool conv_busy(void)
+{
+	struct conv_stream *st;
+
+	for (st = conv_streams; st; st = st->next)
+		if (st->conv || st->rs)
+			return true;
+
+	return false;
+}
+
+/* Convert all new input slots of a stream. An output slot still
+ * referenced by a zero-copy send stalls the conversion, if it falls
+ * behind too far the missing slots are left out. */
+static void conv_run(struct conv_stream *st)
+{
+	struct ring_slot *in, *out;
+	uint64_t lag, max_lag, sample;
+	unsigned int up = 1, down = 1;
+	double at;
+	resample_t *rs;
+	size_t len;
+
+	/* the device rate changed, the ratio has to follow */
+	if (st->rs && ring.rate && st->in_rate != ring.rate) {
+		rs = resample_new(ring.rate, st->out_rate, st->format,
+				  comp_threads ? comp_threads : default_threads());
+		if (rs && resample_max_out(rs, ring.slot_size) > st->ring.slot_size) {
+			resample_free(rs);
+			rs = NULL;
+		}
+		if (rs) {
+			resample_free(st->rs);
+			st->rs = rs;
+		} else {
+			fprintf(stderr, "Can't resample from %u Hz to %u Hz\n", ring.rate,
+				st->out_rate);
+		}
+		st->in_rate = ring.rate;
+	}
+	if (st->rs)
+		resample_ratio(st->rs, &up, &down);
+	else
+		down = st->decim;
+
+	while (1) {
+		pthread_mutex_lock(&ring.lock);
+		lag = ring.head - st->in_seq;
+		if (!lag) {
+			pthread_mutex_unlock(&ring.lock);
+			break;
+		}
+
+		max_lag = ring_max_lag(&ring);
+		if (lag > max_lag) {
+			st->skipped += lag - max_lag;
+			st->in_seq += lag - max_lag;
+		}
+
+		in = ring_slot(&ring, st->in_seq);
+		in->pins++;
+		pthread_mutex_unlock(&ring.lock);
+
+		pthread_mutex_lock(&st->ring.lock);
+		out = ring_slot(&st->ring, st->in_seq);
+		if (out->pins) {
+			pthread_mutex_unlock(&st->ring.lock);
+			pthread_mutex_lock(&ring.lock);
+			in->pins--;
+			pthread_mutex_unlock(&ring.lock);
+			break;
+		}
+		out->seq = RING_SEQ_WRITING;
+		pthread_mutex_unlock(&st->ring.lock);
+
+		if (st->rs)
+			len = resample_run(st->rs, in->data, in->len, in->sample, out->data, &sample);
+		else
+			len = convert_run(st->conv, in->data, in->len, in->sample, out->data, &sample);
+
+		pthread_mutex_lock(&st->ring.lock);
+		out->len = len;
+		out->samples = len / convert_sample_size(st->format);
+		out->flags = in->flags;
+		out->sample = sample;
+		/* the first output may be centered on a sample of the
+		 * previous slot, see convert_run(), or between two */
+		at = (double)sample * down / up - (double)in->sample;
+		out->timestamp = in->timestamp + (ring.rate ?
+			(int64_t)(at * 1e9 / ring.rate) : 0);
+		out->seq = st->in_seq;
+		st->ring.head = st->in_seq + 1;
+		pthread_mutex_unlock(&st->ring.lock);
+
+		pthread_mutex_lock(&ring.lock);
+		in->pins--;
+		pthread_mutex_unlock(&ring.lock);
+
+		st->in_seq++;
+	}
+}
+
+/* the client has to move to the ring of another stream */
+static bool client_ring_switch_pending(struct client *c)
+{
+	return c->format != c->want_format || c->decim != c->want_decim ||
+	       c->codec != c->want_codec || c->out_rate != c->want_rate;
+}
+
+static bool client_switch_pending(struct client *c)
+{
+	return c->framed != c->want_framed || client_ring_switch_pending(c);
+}
+
+/* apply the requested framing and output, called between frames */
+static void client_switch(struct client *c)
+{
+	struct conv_stream *st = NULL;
+
+	c->framed = c->want_framed;
+
+	/* differences of multi-byte samples don't compress any better */
+	if (c->want_codec == CODEC_ZSTD_DELTA && convert_sample_size(c->want_format) != 1)
+		c->want_codec = CODEC_ZSTD;
+
+	if (!client_ring_switch_pending(c))
+		return;
+
+	/* the converter would mix the interleaved channels into one signal */
+	if (ring.channels == 2 && (c->want_format != CONVERT_U8 || c->want_decim != 1 ||
+			      c->want_rate)) {
+		fprintf(stderr, "Format, decimation and output rate are not supported in dual-channel mode\n");
+		c->want_format = c->format;
+		c->want_decim = c->decim;
+		c->want_rate = c->out_rate;
+		if (!client_ring_switch_pending(c))
+			return;
+	}
+
+	if (c->want_format != CONVERT_U8 || c->want_decim != 1 ||
+	    c->want_codec != CODEC_NONE || c->want_rate) {
+		st = conv_get(c->want_format, c->want_decim, c->want_rate, c->want_codec, c->seq);
+		if (!st) {
+			fprintf(stderr, "Failed to set up format %d, decimation %u, output rate %u, compression %d\n",
+				c->want_format, c->want_decim, c->want_rate, c->want_codec);
+			c->want_format = c->format;
+			c->want_decim = c->decim;
+			c->want_codec = c->codec;
+			c->want_rate = c->out_rate;
+			return;
+		}
+	}
+
+	if (c->conv)
+		conv_put(c->conv);
+
+	c->conv = st;
+	c->ring = st ? &st->ring : &ring;
+	c->format = c->want_format;
+	c->decim = c->want_decim;
+	c->codec = c->want_codec;
+	c->out_rate = c->want_rate;
+
+	/* sample indices count output samples now */
+	c->next_sample = UINT64_MAX;
+}
+
+/* Header of the frame for a slot. Headers are kept per client and slot,
+ * as zero-copy sends reference them until the slot is unpinned. Called
+ * with the ring lock held. */
+static struct frame_header *frame_build(struct client *c, uint64_t seq,
+					uint32_t frame_seq, uint64_t expected)
+{
+	struct frame_header *h = &c->frames[seq % c->ring->num];
+	struct ring_slot *slot = ring_slot(c->ring, seq);
+
+	h->magic = htonl(FRAME_MAGIC);
+	h->hdr_len = htons(sizeof(*h));
+	h->format = c->format;
+	h->flags = slot->flags;
+	h->seq = htonl(frame_seq);
+	h->len = htonl(slot->len);
+	h->sample = hton64(slot->sample);
+	h->timestamp = hton64(slot->timestamp);
+	/* after a resume the first frame may repeat samples */
+	h->dropped = hton64(expected == UINT64_MAX || slot->sample < expected ?
+			    0 : slot->sample - expected);
+
+	return h;
+}
+
+static uint32_t client_frame_len(struct client *c, struct ring_slot *slot)
+{
+	return (c->framed ? sizeof(struct frame_header) : 0) + slot->len;
+}
+
+/* move the cursor of a client forward by len bytes */
+static void client_advance(struct client *c, size_t len)
+{
+	struct ring_slot *slot;
+	uint32_t frame_len;
+
+	while (len) {
+		slot = ring_slot(c->ring, c->seq);
+		frame_len = client_frame_len(c, slot);
+		if (len < frame_len - c->offset) {
+			c->offset += len;
+			break;
+		}
+		len -= frame_len - c->offset;
+		c->offset = 0;
+		c->next_sample = slot->sample + slot->samples;
+		c->frame_seq++;
+		c->seq++;
+	}
+}
+
+static int client_tail_reserve(struct client *c, uint32_t size)
+{
+	unsigned char *tail;
+
+	if (c->tail_size >= size)
+		return 0;
+
+	tail = realloc(c->tail, size);
+	if (!tail)
+		return -1;
+
+	c->tail = tail;
+	c->tail_size = size;
+
+	return 0;
+}
+
+/* The slot of a partially sent frame is about to be dropped, keep the
+ * rest of the frame so that the client doesn't lose the framing. Called
+ * with the ring lock held. */
+static int client_save_tail(struct client *c)
+{
+	struct frame_header *h = &c->frames[c->seq % c->ring->num];
+	struct ring_slot *slot = ring_slot(c->ring, c->seq);
+	uint32_t len = ntohl(h->len);
+
+	/* the slot size depends on the output format */
+	if (client_tail_reserve(c, sizeof(*h) + c->ring->slot_size) < 0)
+		return -1;
+
+	memcpy(c->tail, h, sizeof(*h));
+	if (slot->seq == c->seq)
+		memcpy(c->tail + sizeof(*h), slot->data, len);
+	else	/* already overwritten, only the length matters now, the
+		 * client won't be able to decompress such a frame */
+		memset(c->tail + sizeof(*h), 0, len);
+
+	c->tail_len = sizeof(*h) + len;
+	c->tail_off = c->offset;
+	c->next_sample = slot->seq == c->seq ? ntoh64(h->sample) + slot->samples : UINT64_MAX;
+	c->frame_seq++;
+
+	return 0;
+}
+
+static int client_flush_tail(struct client *c)
+{
+	struct iovec iov;
+	int r;
+
+	iov.iov_base = c->tail + c->tail_off;
+	iov.iov_len = c->tail_len - c->tail_off;
+
+	/* the tail buffer gets reused, so no zero-copy here */
+	r = send_iov(c->ev.fd, &iov, 1, 0);
+	c->stats.syscalls++;
+
+	if (r == SOCKET_ERROR)
+		return send_would_block() ? 0 : -1;
+
+	c->stats.bytes += r;
+	c->tail_off += r;
+	if (c->tail_off == c->tail_len)
+		c->tail_len = 0;
+
+	return 0;
+}
+
+/*
+ * Move the cursor back to the slot with the requested sample, or to the
+ * oldest slot still in the ring. The input ring is searched, the slots of
+ * converted streams have the same sequence numbers.
+ */
+static void client_resume(struct client *c)
+{
+	struct ring_slot *slot;
+	uint64_t sample = c->resume * c->want_decim;
+	uint64_t seq, oldest;
+	unsigned int up, down;
+
+	/* the input sample a resampled output was taken at */
+	if (c->conv && c->conv->rs && c->want_rate == c->out_rate) {
+		resample_ratio(c->conv->rs, &up, &down);
+		sample = c->resume * down / up;
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	oldest = ring.head - (ring.head < ring_max_lag(&ring) ? ring.head : ring_max_lag(&ring));
+	for (seq = ring.head; seq > oldest; seq--) {
+		slot = ring_slot(&ring, seq - 1);
+		if (slot->seq != seq - 1)
+			break;
+		if (slot->sample <= sample) {
+			/* not received yet, continue live */
+			if (sample - slot->sample >= slot->samples)
+				break;
+			seq--;
+			break;
+		}
+	}
+	c->resume_head = ring.head;
+	pthread_mutex_unlock(&ring.lock);
+
+	fprintf(stderr, "client %s %s resumes at sample %llu, %llu buffers back\n",
+		c->host, c->port, (unsigned long long)c->resume,
+		(unsigned long long)(ring.head - seq));
+
+	c->seq = seq;
+	c->resume = UINT64_MAX;
+}
+
+/* queue a stats frame, it is sent like the rest of a dropped frame */
+static int client_send_stats(struct client *c)
+{
+	struct frame_header *h;
+	struct stats_reply *st;
+	uint64_t max_lag, queued;
+	uint64_t bytes_in = 0, bytes_out = 0, cpu_ns = 0;
+
+	c->stats_pending = false;
+
+	if (client_tail_reserve(c, sizeof(*h) + sizeof(*st)) < 0)
+		return -1;
+
+	h = (struct frame_header *)c->tail;
+	st = (struct stats_reply *)(c->tail + sizeof(*h));
+
+	pthread_mutex_lock(&c->ring->lock);
+	max_lag = ring_max_lag(c->ring);
+	queued = c->ring->head - c->seq;
+	pthread_mutex_unlock(&c->ring->lock);
+
+	if ((int64_t)queued < 0)
+		queued = 0;
+
+	if (c->conv && c->conv->codec != CODEC_NONE) {
+		pthread_mutex_lock(&c->conv->ring.lock);
+		bytes_in = c->conv->bytes_in;
+		bytes_out = c->conv->bytes_out;
+		cpu_ns = c->conv->cpu_ns;
+		pthread_mutex_unlock(&c->conv->ring.lock);
+	}
+
+	h->magic = htonl(FRAME_MAGIC);
+	h->hdr_len = htons(sizeof(*h));
+	h->format = c->format;
+	h->flags = FRAME_FLAG_STATS;
+	h->seq = htonl(c->frame_seq);
+	h->len = htonl(sizeof(*st));
+	h->sample = hton64(c->next_sample == UINT64_MAX ? 0 : c->next_sample);
+	h->timestamp = hton64(now_ns());
+	h->dropped = 0;
+
+	pthread_mutex_lock(&ring.lock);
+	st->samples = hton64(ring.samples);
+	st->overruns = hton64(ring.overruns);
+	pthread_mutex_unlock(&ring.lock);
+	st->dropped = hton64(c->dropped);
+	st->bytes = hton64(c->stats.bytes);
+	st->sample_rate = htonl(fx2adc_get_sample_rate(dev));
+	st->vdiv[0] = htonl(vdiv_mv[0]);
+	st->vdiv[1] = htonl(vdiv_mv[1]);
+	st->queue_depth = htonl(c->queue_depth && c->queue_depth < max_lag ?
+				c->queue_depth : max_lag);
+	st->queued = htonl(queued);
+	st->clients = htons(num_clients);
+	st->channels = ring.channels;
+	st->ext_clock = ext_clock;
+	st->ratio = htonl(bytes_out ? bytes_in * 1000 / bytes_out : 0);
+	st->cpu_us_per_mb = htonl(bytes_in ? cpu_ns * 1000 / bytes_in : 0);
+
+	c->tail_len = sizeof(*h) + sizeof(*st);
+	c->tail_off = 0;
+
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring without liburing, only the few pieces needed here: every
+ * client gets one chain of linked sends in flight, the chains of all
+ * clients are submitted with a single io_uring_enter() per loop iteration.
+ */
+static int uring_enter(unsigned int submit, unsigned int wait)
+{
+	int r;
+
+	r = syscall(__NR_io_uring_enter, uring.fd, submit, wait,
+		    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	uring.enters++;
+	if (r > 0)
+		uring.to_submit -= (unsigned int)r < uring.to_submit ? (unsigned int)r : uring.to_submit;
+
+	return r;
+}
+
+static bool uring_op_supported(int op)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	bool r = false;
+
+	probe = calloc(1, len);
+	if (!probe)
+		return false;
+
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+		r = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return r;
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	struct iovec *bufs;
+	unsigned char *ptr;
+	size_t sq_len, cq_len;
+	uint32_t i;
+	int efd;
+
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring.fd < 0)
+		return -1;
+
+	/* 5.5, older kernels are not worth the extra mapping */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+		goto err;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	uring.ring_len = sq_len > cq_len ? sq_len : cq_len;
+
+	uring.ring_ptr = mmap(NULL, uring.ring_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (uring.ring_ptr == MAP_FAILED)
+		goto err;
+
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		munmap(uring.ring_ptr, uring.ring_len);
+		goto err;
+	}
+
+	ptr = uring.ring_ptr;
+	uring.sq_head = (unsigned int *)(ptr + p.sq_off.head);
+	uring.sq_tail = (unsigned int *)(ptr + p.sq_off.tail);
+	uring.sq_array = (unsigned int *)(ptr + p.sq_off.array);
+	uring.sq_mask = *(unsigned int *)(ptr + p.sq_off.ring_mask);
+	uring.sq_entries = p.sq_entries;
+	uring.cq_head = (unsigned int *)(ptr + p.cq_off.head);
+	uring.cq_tail = (unsigned int *)(ptr + p.cq_off.tail);
+	uring.cq_mask = *(unsigned int *)(ptr + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+	uring.cq_flags = p.cq_off.flags ? (unsigned int *)(ptr + p.cq_off.flags) : NULL;
+
+	/* completions wake up the event loop only while a client waits */
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0 || syscall(__NR_io_uring_register, uring.fd,
+			       IORING_REGISTER_EVENTFD, &efd, 1)) {
+		if (efd >= 0)
+			close(efd);
+		goto err_unmap;
+	}
+	uring.ev.fd = efd;
+	uring.wake = true;
+	poller_add(&uring.ev, POLLER_IN);
+
+#ifdef IORING_RECVSEND_FIXED_BUF
+	if (use_zerocopy) {
+		uring.zc = uring_op_supported(IORING_OP_SEND_ZC);
+		if (!uring.zc)
+			fprintf(stderr, "io_uring zero-copy sends not supported, copying\n");
+	}
+
+	/* the main ring is sent from registered buffers, this needs
+	 * enough RLIMIT_MEMLOCK for the whole ring */
+	bufs = uring.zc ? calloc(ring.num, sizeof(*bufs)) : NULL;
+	if (bufs) {
+		for (i = 0; i < ring.num; i++) {
+			bufs[i].iov_base = ring.slots[i].data;
+			bufs[i].iov_len = ring.slot_size;
+		}
+		uring.fixed = syscall(__NR_io_uring_register, uring.fd,
+				      IORING_REGISTER_BUFFERS, bufs, ring.num) == 0;
+		if (!uring.fixed)
+			fprintf(stderr, "Failed to register the ring with io_uring (%s), "
+				"check ulimit -l\n", strerror(errno));
+		free(bufs);
+	}
+#else
+	(void)bufs;
+	(void)i;
+	if (use_zerocopy)
+		fprintf(stderr, "io_uring zero-copy sends not supported, copying\n");
+#endif
+
+	return 0;
+
+err_unmap:
+	munmap(uring.sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+	munmap(uring.ring_ptr, uring.ring_len);
+err:
+	close(uring.fd);
+	uring.fd = -1;
+	return -1;
+}
+
+static void uring_exit(void)
+{
+	if (uring.fd < 0)
+		return;
+
+	if (uring.sends)
+		fprintf(stderr, "io_uring: %llu sends in %llu system calls\n",
+			(unsigned long long)uring.sends,
+			(unsigned long long)uring.enters);
+
+	poller_del(&uring.ev);
+	close(uring.ev.fd);
+	munmap(uring.sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+	munmap(uring.ring_ptr, uring.ring_len);
+	close(uring.fd);
+	uring.fd = -1;
+}
+
+static void uring_submit(void)
+{
+	if (uring.to_submit)
+		uring_enter(uring.to_submit, 0);
+}
+
+/* called once the kernel is done with the slot and the client cursor
+ * has moved past it */
+static void uring_op_free(struct uring_op *op)
+{
+	if (op->ring) {
+		pthread_mutex_lock(&op->ring->lock);
+		ring_slot(op->ring, op->seq)->pins--;
+		pthread_mutex_unlock(&op->ring->lock);
+	}
+
+	if (op->pprev) {
+		*op->pprev = op->next;
+		if (op->next)
+			op->next->pprev = op->pprev;
+		else
+			op->c->ur_ops_tail = op->pprev;
+	}
+
+	free(op);
+}
+
+static void uring_chain_done(struct client *c)
+{
+	struct uring_op *op;
+	unsigned int i;
+
+	/* advance while the slots are still pinned */
+	pthread_mutex_lock(&c->ring->lock);
+	client_advance(c, c->ur_bytes);
+	pthread_mutex_unlock(&c->ring->lock);
+
+	c->stats.bytes += c->ur_bytes;
+	c->ur_bytes = 0;
+
+	for (i = 0; i < c->ur_num; i++) {
+		op = c->ur_chain[i];
+		op->in_chain = false;
+		if (!op->notif)
+			uring_op_free(op);
+	}
+
+	c->ur_num = 0;
+	c->ur_kick = true;
+}
+
+static void uring_reap(void)
+{
+	unsigned int head = *uring.cq_head;
+	unsigned int tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	struct uring_op *op;
+	struct client *c;
+
+	for (; head != tail; head++) {
+		cqe = &uring.cqes[head & uring.cq_mask];
+		op = (struct uring_op *)(uintptr_t)cqe->user_data;
+		if (!op)	/* cancel requests */
+			continue;
+
+#ifdef IORING_CQE_F_NOTIF
+		if (cqe->flags & IORING_CQE_F_NOTIF) {
+			op->notif = false;
+			if (!op->in_chain)
+				uring_op_free(op);
+			continue;
+		}
+		if (cqe->flags & IORING_CQE_F_MORE)
+			op->notif = true;
+#endif
+
+		/* after a short send the rest of the chain is canceled,
+		 * the bytes sent so far still count */
+		c = op->c;
+		if (!c) {
+			if (!op->notif)
+				free(op);
+			continue;
+		}
+		if (cqe->res >= 0)
+			c->ur_bytes += cqe->res;
+		else if (cqe->res != -ECANCELED && !c->ur_error)
+			c->ur_error = -cqe->res;
+
+		if (!--c->ur_pending)
+			uring_chain_done(c);
+	}
+
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* returns true if completions came in before the eventfd got enabled */
+static bool uring_set_wake(void)
+{
+	struct client *c;
+	bool wake = false;
+
+	for (c = clients; c && !wake; c = c->next)
+		wake = !c->dead && c->ur_num && c->ur_waiting;
+
+	if (uring.cq_flags && wake != uring.wake) {
+		uring.wake = wake;
+		__atomic_store_n(uring.cq_flags, wake ? 0 : IORING_CQ_EVENTFD_DISABLED,
+				 __ATOMIC_RELEASE);
+	}
+
+	return *uring.cq_head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+}
+
+static void uring_drain(void)
+{
+	uint64_t v;
+
+	if (read(uring.ev.fd, &v, sizeof(v)) < 0)
+		return;
+}
+
+/*
+ * Queue the iovecs of a client as a chain of linked sends, which the
+ * kernel runs in order. MSG_WAITALL keeps a send going until all of it
+ * is sent, on kernels without it a short send cancels the rest.
+ */
+static int uring_send(struct client *c, struct iovec *iov, uint32_t *iov_slot, int iovcnt)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_op *op;
+	struct ring_slot *slot;
+	unsigned int tail;
+	int i;
+
+	/* a chain must not be split between two submissions */
+	if (uring.sq_entries - (*uring.sq_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE)) <
+	    (unsigned int)iovcnt)
+		uring_submit();
+
+	for (i = 0; i < iovcnt; i++) {
+		c->ur_chain[i] = calloc(1, sizeof(struct uring_op));
+		if (!c->ur_chain[i]) {
+			while (i--)
+				free(c->ur_chain[i]);
+			return -1;
+		}
+	}
+
+	tail = *uring.sq_tail;
+	for (i = 0; i < iovcnt; i++) {
+		op = c->ur_chain[i];
+		slot = ring_slot(c->ring, c->seq + iov_slot[i]);
+
+		op->c = c;
+		op->seq = c->seq + iov_slot[i];
+		op->in_chain = true;
+		if ((unsigned char *)iov[i].iov_base >= slot->data &&
+		    (unsigned char *)iov[i].iov_base < slot->data + c->ring->slot_size)
+			op->ring = c->ring;
+
+		op->pprev = c->ur_ops_tail;
+		*c->ur_ops_tail = op;
+		c->ur_ops_tail = &op->next;
+
+		sqe = &uring.sqes[tail & uring.sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->ev.fd;
+		sqe->addr = (uintptr_t)iov[i].iov_base;
+		sqe->len = iov[i].iov_len;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = (uintptr_t)op;
+		if (i < iovcnt - 1)
+			sqe->flags = IOSQE_IO_LINK;
+#ifdef IORING_RECVSEND_FIXED_BUF
+		/* headers are tiny and get rebuilt, they are always copied */
+		if (op->ring && uring.zc) {
+			sqe->opcode = IORING_OP_SEND_ZC;
+			if (uring.fixed && c->ring == &ring) {
+				sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+				sqe->buf_index = slot - ring.slots;
+			}
+		}
+#endif
+		uring.sq_array[tail & uring.sq_mask] = tail & uring.sq_mask;
+		tail++;
+	}
+
+	__atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+	uring.to_submit += iovcnt;
+	uring.sends += iovcnt;
+
+	c->ur_num = iovcnt;
+	c->ur_pending = iovcnt;
+	c->ur_waiting = false;
+
+	return 0;
+}
+
+/* stop the chain of a client that is going away and wait for it */
+static void uring_cancel(struct client *c)
+{
+#ifdef IORING_ASYNC_CANCEL_FD
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	if (*uring.sq_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries)
+		uring_submit();
+
+	tail = *uring.sq_tail;
+	sqe = &uring.sqes[tail & uring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = c->ev.fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	uring.sq_array[tail & uring.sq_mask] = tail & uring.sq_mask;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.to_submit++;
+#else
+	shutdown(c->ev.fd, SHUT_RDWR);
+#endif
+
+	while (c->ur_num) {
+		if (uring_enter(uring.to_submit, 1) < 0 && errno != EINTR && errno != EBUSY)
+			break;
+		uring_reap();
+	}
+}
+
+/* the socket is closed, the kernel doesn't reference our buffers anymore */
+static void uring_release(struct client *c)
+{
+	struct uring_op *op;
+
+	while ((op = c->ur_ops)) {
+		c->ur_ops = op->next;
+		if (op->ring) {
+			pthread_mutex_lock(&op->ring->lock);
+			ring_slot(op->ring, op->seq)->pins--;
+			pthread_mutex_unlock(&op->ring->lock);
+		}
+		/* freed with its notification */
+		op->c = NULL;
+		op->ring = NULL;
+		op->in_chain = false;
+		op->pprev = NULL;
+		op->next = NULL;
+	}
+	c->ur_ops_tail = &c->ur_ops;
+}
+#endif
+
+/*
+ * Send as much queued data as the socket accepts, with all ready slots
+ * gathered into a single send call. Returns -1 if the client is gone.
+ */
+static int client_flush(struct client *c)
+{
+	struct iovec iov[SEND_IOV_MAX];
+	uint32_t iov_slot[SEND_IOV_MAX];
+	struct frame_header *h;
+	struct ring_slot *slot;
+	uint64_t lag, max_lag, seq, expected, resume;
+	uint32_t covered, nslots, max_slots, offset;
+	size_t total, left;
+	int iovcnt, i, r;
+
+	/* waiting for the commands of a new client */
+	if (!c->started) {
+		client_want_out(c, false);
+		return 0;
+	}
+
+#ifdef HAVE_IO_URING
+	c->ur_kick = false;
+	if (c->ur_error) {
+		fprintf(stderr, "client %s %s: %s\n", c->host, c->port, strerror(c->ur_error));
+		return -1;
+	}
+
+	/* one chain at a time, the next one starts when it completed */
+	if (c->ur_num) {
+		c->ur_waiting = true;
+
+		/* pinned slots stall the ring for everyone else */
+		pthread_mutex_lock(&c->ring->lock);
+		r = c->ring->head - c->ur_ops->seq > ring_max_lag(c->ring);
+		pthread_mutex_unlock(&c->ring->lock);
+		if (r) {
+			fprintf(stderr, "client %s %s too slow for io_uring sends\n",
+				c->host, c->port);
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
+	while (1) {
+		if (c->tail_len) {
+			if (client_flush_tail(c) < 0)
+				return -1;
+			if (c->tail_len) {
+				client_want_out(c, true);
+				return 0;
+			}
+		}
+
+		/* framing, output and position are switched between frames only */
+		if (!c->offset && (client_switch_pending(c) || c->resume != UINT64_MAX)) {
+			/* the kernel may still reference slots of the old ring */
+			if (c->zc_num && client_ring_switch_pending(c))
+				return client_zc_wait(c);
+#ifdef HAVE_IO_URING
+			if (c->ur_ops && client_ring_switch_pending(c))
+				return 0;
+#endif
+
+			/* before the switch, a new stream starts at the resumed slot */
+			resume = c->resume;
+			if (resume != UINT64_MAX)
+				client_resume(c);
+			if (client_switch_pending(c))
+				client_switch(c);
+			if (resume != UINT64_MAX)
+				c->next_sample = resume;
+		}
+
+		/* stats go out between frames as well */
+		if (!c->offset && c->stats_pending && c->framed) {
+			if (client_send_stats(c) < 0)
+				return -1;
+			continue;
+		}
+
+		pthread_mutex_lock(&c->ring->lock);
+
+		max_lag = ring_max_lag(c->ring);
+
+		/* Slots referenced by zero-copy sends can't be released
+		 * without closing the socket, so a client that doesn't
+		 * read anymore would stall the ring for everyone else. */
+		if (c->zc_num && c->ring->head - c->zc[c->zc_first].seq > max_lag) {
+			pthread_mutex_unlock(&c->ring->lock);
+			fprintf(stderr, "client %s %s too slow for zero-copy sends\n",
+				c->host, c->port);
+			return -1;
+		}
+
+		/* the kernel still references too many of our slots */
+		if (c->zc_num == ZEROCOPY_MAX_PENDING) {
+			pthread_mutex_unlock(&c->ring->lock);
+			return client_zc_wait(c);
+		}
+
+		/* a lowered queue depth would drop the slots just resumed,
+		 * it only applies once the client has caught up */
+		if (c->queue_depth && c->queue_depth < max_lag && c->seq >= c->resume_head)
+			max_lag = c->queue_depth;
+
+		/* a stream might not have converted our slot yet */
+		lag = c->ring->head - c->seq;
+		if (!lag || (int64_t)lag < 0) {
+			pthread_mutex_unlock(&c->ring->lock);
+			client_want_out(c, false);
+			return 0;
+		}
+
+		/* client is too slow, drop the oldest buffers */
+		if (lag > max_lag) {
+			if (!c->dropped)
+				fprintf(stderr, "client %s %s too slow, dropping buffers\n",
+					c->host, c->port);
+			if (c->framed && c->offset && client_save_tail(c) < 0) {
+				pthread_mutex_unlock(&c->ring->lock);
+				return -1;
+			}
+			c->dropped += lag - max_lag;
+			c->seq += lag - max_lag;
+			c->offset = 0;
+		}
+
+		/* skip slots a stream didn't convert in time */
+		while (c->seq != c->ring->head && ring_slot(c->ring, c->seq)->seq != c->seq) {
+			c->dropped++;
+			c->seq++;
+			c->offset = 0;
+		}
+
+		if (c->seq == c->ring->head) {
+			pthread_mutex_unlock(&c->ring->lock);
+			client_want_out(c, false);
+			return 0;
+		}
+
+		max_slots = c->framed ? SEND_IOV_MAX / 2 : SEND_IOV_MAX;
+		if (client_switch_pending(c))
+			max_slots = 1;
+
+		if (c->tail_len) {
+			pthread_mutex_unlock(&c->ring->lock);
+			continue;
+		}
+
+		total = 0;
+		iovcnt = 0;
+		offset = c->offset;
+		expected = c->next_sample;
+		for (nslots = 0, seq = c->seq;
+		     nslots < max_slots && seq != c->ring->head; nslots++, seq++) {
+			slot = ring_slot(c->ring, seq);
+			if (slot->seq != seq)
+				break;
+			slot->pins++;
+
+			if (c->framed) {
+				h = frame_build(c, seq, c->frame_seq + nslots, expected);
+				if (offset < sizeof(*h)) {
+					iov_slot[iovcnt] = nslots;
+					iov[iovcnt].iov_base = (char *)h + offset;
+					iov[iovcnt].iov_len = sizeof(*h) - offset;
+					total += iov[iovcnt++].iov_len;
+					offset = 0;
+				} else {
+					offset -= sizeof(*h);
+				}
+			}
+
+			iov_slot[iovcnt] = nslots;
+			iov[iovcnt].iov_base = slot->data + offset;
+			iov[iovcnt].iov_len = slot->len - offset;
+			total += iov[iovcnt++].iov_len;
+			offset = 0;
+			expected = slot->sample + slot->samples;
+		}
+
+		pthread_mutex_unlock(&c->ring->lock);
+
+#ifdef HAVE_IO_URING
+		/* the sends keep the pins, client_advance() follows once
+		 * the whole chain completed */
+		if (uring.fd >= 0) {
+			if (uring_send(c, iov, iov_slot, iovcnt) < 0) {
+				pthread_mutex_lock(&c->ring->lock);
+				ring_unpin(c->ring, c->seq, nslots);
+				pthread_mutex_unlock(&c->ring->lock);
+				return -1;
+			}
+			c->stats.syscalls++;
+			return 0;
+		}
+#endif
+
+		r = send_iov(c->ev.fd, iov, iovcnt, c->send_flags);
+		c->stats.syscalls++;
+
+		/* number of slots the kernel may still reference */
+		covered = 0;
+		if (r > 0 && c->send_flags) {
+			for (left = r, i = 0; i < iovcnt && left; i++) {
+				left -= left < iov[i].iov_len ? left : iov[i].iov_len;
+				covered = iov_slot[i] + 1;
+			}
+		}
+
+		/* advance while the slots are still pinned */
+		seq = c->seq;
+		pthread_mutex_lock(&c->ring->lock);
+		if (r > 0)
+			client_advance(c, r);
+		ring_unpin(c->ring, seq + covered, nslots - covered);
+		pthread_mutex_unlock(&c->ring->lock);
+
+		if (covered) {
+			struct zc_send *zs = &c->zc[(c->zc_first + c->zc_num) % ZEROCOPY_MAX_PENDING];
+
+			zs->id = c->zc_id++;
+			zs->seq = seq;
+			zs->count = covered;
+			c->zc_num++;
+		}
+
+		if (r == SOCKET_ERROR) {
+			if (send_would_block()) {
+				client_want_out(c, true);
+				return 0;
+			}
+#ifdef HAVE_MSG_ZEROCOPY
+			/* too much memory pinned, wait for completions */
+			if (c->send_flags && errno == ENOBUFS)
+				return client_zc_wait(c);
+#endif
+			return -1;
+		}
+
+		c->stats.bytes += r;
+
+		if ((size_t)r < total) {
+			client_want_out(c, true);
+			return 0;
+		}
+	}
+}
+
+static void client_close(struct client *c)
+{
+	if (c->dead)
+		return;
+
+#ifdef HAVE_IO_URING
+	if (c->ur_num)
+		uring_cancel(c);
+#endif
+
+	poller_del(&c->ev);
+	closesocket(c->ev.fd);
+
+#ifdef HAVE_IO_URING
+	uring_release(c);
+#endif
+
+	/* after the reset the kernel doesn't reference our buffers anymore */
+	pthread_mutex_lock(&c->ring->lock);
+	while (c->zc_num) {
+		ring_unpin(c->ring, c->zc[c->zc_first].seq, c->zc[c->zc_first].count);
+		c->zc_first = (c->zc_first + 1) % ZEROCOPY_MAX_PENDING;
+		c->zc_num--;
+	}
+	pthread_mutex_unlock(&c->ring->lock);
+
+	if (c->conv)
+		conv_put(c->conv);
+	c->conv = NULL;
+	c->ring = &ring;
+
+	fprintf(stderr, "client %s %s disconnected\n", c->host, c->port);
+	if (c->dropped)
+		fprintf(stderr, "dropped %llu buffers for slow client\n",
+			(unsigned long long)c->dropped);
+	print_send_stats(&c->stats);
+
+	c->dead = true;
+	num_clients--;
+}
+
+static void clients_reap(void)
+{
+	struct client **pc = &clients;
+	struct client *c;
+
+	while ((c = *pc)) {
+		if (c->dead) {
+			*pc = c->next;
+			free(c->frames);
+			free(c->tail);
+			free(c);
+		} else {
+			pc = &c->next;
+		}
+	}
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Submit the queued sends and keep the clients going whose chain
+ * completed right away, which is the common case as long as the socket
+ * buffers have room, until there is nothing left to do without waiting.
+ */
+static void uring_run(void)
+{
+	struct client *c;
+	bool again;
+
+	do {
+		uring_submit();
+		uring_reap();
+
+		again = false;
+		for (c = clients; c; c = c->next) {
+			if (c->dead || !c->ur_kick)
+				continue;
+			again = true;
+			if (client_flush(c) < 0)
+				client_close(c);
+		}
+
+		if (!again)
+			again = uring_set_wake();
+	} while (again);
+}
+#endif
+
+/*
+ * Framing is chosen before the first sample is sent, a client switching
+ * at runtime couldn't tell where the first frame starts: the magic is a
+ * valid sequence of samples as well.
+ */
+static int client_set_framing(struct client *c, bool enable)
+{
+	if (c->started && enable != c->want_framed) {
+		fprintf(stderr, "client %s %s: framing can only be changed before "
+			"the first sample, ignoring command\n", c->host, c->port);
+		return -1;
+	}
+
+	if (enable && !c->frames) {
+		c->frames = calloc(ring.num, sizeof(struct frame_header));
+		if (!c->frames) {
+			fprintf(stderr, "Failed to allocate frame headers.\n");
+			return -1;
+		}
+	}
+
+	c->want_framed = enable;
+
+	return 0;
+}
+
+/* Start sending to clients that didn't send a command within the
+ * hold-off time, returns the time in ms until the next one is due, or -1
+ * if there is none. */
+static int clients_start(void)
+{
+	struct client *c;
+	uint64_t now = now_ns();
+	int64_t next = -1, left;
+
+	for (c = clients; c; c = c->next) {
+		if (c->dead || c->started)
+			continue;
+
+		left = (int64_t)(c->start_ns - now);
+		if (left <= 0) {
+			c->started = true;
+			if (client_flush(c) < 0)
+				client_close(c);
+		} else if (next < 0 || left < next) {
+			next = left;
+		}
+	}
+
+	return next < 0 ? -1 : (int)((next + 999999) / 1000000);
+}
+
+static void handle_command(struct client *c, struct command *cmd)
+{
+	uint32_t param = ntohl(cmd->param);
+	int ch;
+
+	switch(cmd->cmd) {
+	case 0x01:
+		break;
+	case 0x02:
+		fprintf(stderr, "set sample rate %d\n", param);
+		if (fx2adc_set_sample_rate(dev, param, false) == 0) {
+			ring_set_rate(&ring, fx2adc_get_sample_rate(dev));
+			ext_clock = false;
+		}
+		break;
+	case 0x03:
+		fprintf(stderr, "set gain mode %d\n", param);
+		//fx2adc_set_tuner_gain_mode(dev, param);
+		break;
+	case 0x04:
+		fprintf(stderr, "set gain %d\n", param);
+		//fx2adc_set_tuner_gain(dev, param);
+		break;
+	case CMD_SET_FRAMING:
+		fprintf(stderr, "%s framing for %s %s\n", param ? "enable" : "disable",
+			c->host, c->port);
+		client_set_framing(c, param != 0);
+		break;
+	case CMD_SET_FORMAT:
+		fprintf(stderr, "set format %d for %s %s\n", param, c->host, c->port);
+		if (param < CONVERT_NUM_FORMATS)
+			c->want_format = param;
+		break;
+	case CMD_SET_DECIMATION:
+		fprintf(stderr, "set decimation %d for %s %s\n", param, c->host, c->port);
+		if (param >= 1 && param <= CONVERT_MAX_DECIMATION)
+			c->want_decim = param;
+		break;
+	case CMD_SET_OUTPUT_RATE:
+		fprintf(stderr, "set output rate %u for %s %s\n", param, c->host, c->port);
+		c->want_rate = param;
+		break;
+	case CMD_SET_COMPRESSION:
+		fprintf(stderr, "set compression %d for %s %s\n", param, c->host, c->port);
+#ifdef HAVE_ZSTD
+		if (param >= CODEC_NUM)
+			break;
+		/* compressed samples can't be sent without the length */
+		if (param != CODEC_NONE && client_set_framing(c, true) < 0)
+			break;
+		c->want_codec = param;
+#else
+		fprintf(stderr, "compression not supported by this build\n");
+#endif
+		break;
+	case CMD_SET_VDIV:
+		ch = (param >> 16) == 2 ? 2 : 1;
+		fprintf(stderr, "set voltage divider %d mV on channel %d\n",
+			param & 0xffff, ch);
+		if (fx2adc_set_vdiv(dev, ch, param & 0xffff) == 0)
+			vdiv_mv[ch - 1] = fx2adc_get_vdiv(dev);
+		break;
+	case CMD_SET_EXT_CLOCK:
+		fprintf(stderr, "set external clock %d\n", param);
+		if (fx2adc_set_sample_rate(dev, param, true) == 0) {
+			ring_set_rate(&ring, fx2adc_get_sample_rate(dev));
+			ext_clock = true;
+		}
+		break;
+	case CMD_SET_CHANNELS:
+		fprintf(stderr, "set %d channel mode\n", param);
+		if (param == 2 && conv_busy()) {
+			fprintf(stderr, "Format, decimation and output rate are not supported in dual-channel mode\n");
+			break;
+		}
+		if (fx2adc_set_channels(dev, param) == 0 && (unsigned int)param != ring.channels) {
+			pthread_mutex_lock(&ring.lock);
+			ring.channels = param;
+			ring.discont = true;
+			pthread_mutex_unlock(&ring.lock);
+		}
+		break;
+	case CMD_SET_QUEUE_DEPTH:
+		fprintf(stderr, "set queue depth %d for %s %s\n", param, c->host, c->port);
+		c->queue_depth = param;
+		break;
+	case CMD_RESUME_HI:
+		c->resume_hi = param;
+		break;
+	case CMD_RESUME:
+		/* the client can only tell where the resume took effect
+		 * from the sample index in the frame headers */
+		if (client_set_framing(c, true) < 0)
+			break;
+		c->resume = (((uint64_t)c->resume_hi << 32) | param) + 1;
+		break;
+	case CMD_GET_STATS:
+		/* the reply needs framing to be told apart from the samples */
+		if (client_set_framing(c, true) == 0)
+			c->stats_pending = true;
+		break;
+	default:
+		break;
+	}
+}
+
+/* read and execute commands, returns -1 if the client is gone */
+static int client_read(struct client *c)
+{
+	bool cmd = false;
+	int received;
+
+	while (1) {
+		received = recv(c->ev.fd, (char *)c->cmd_buf + c->cmd_len,
+				sizeof(c->cmd_buf) - c->cmd_len, 0);
+
+		if (received == 0)
+			return -1;
+
+		if (received == SOCKET_ERROR) {
+			if (!send_would_block())
+				return -1;
+			/* the commands sent right after connecting are
+			 * applied, start without waiting for the hold-off */
+			if (cmd && !c->started && !c->cmd_len) {
+				c->started = true;
+				client_want_out(c, true);
+			}
+			return 0;
+		}
+
+		c->cmd_len += received;
+		if (c->cmd_len == sizeof(c->cmd_buf)) {
+			handle_command(c, (struct command *)c->cmd_buf);
+			c->cmd_len = 0;
+			cmd = true;
+		}
+	}
+}
+
+static int udp_open(const char *spec, uint32_t dgram_size, int ttl)
+{
+	struct addrinfo hints, *res;
+	char host[NI_MAXHOST];
+	const char *port, *end;
+	size_t len;
+	int bufsize = 4 * 1024 * 1024;
+#ifdef _WIN32
+	u_long blockmode = 1;
+#endif
+
+	/* address:port or [IPv6 address]:port */
+	port = strrchr(spec, ':');
+	if (!port)
+		return -1;
+
+	if (spec[0] == '[' && (end = strchr(spec, ']')) && end + 1 == port) {
+		spec++;
+		len = end - spec;
+	} else {
+		len = port - spec;
+	}
+	port++;
+
+	if (len >= sizeof(host))
+		return -1;
+
+	memcpy(host, spec, len);
+	host[len] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	if (getaddrinfo(host, port, &hints, &res)) {
+		fprintf(stderr, "Failed to resolve UDP destination %s\n", spec);
+		return -1;
+	}
+
+	udp = calloc(1, sizeof(*udp));
+	if (!udp) {
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	udp->ev.type = EV_UDP;
+	/* whole sample pairs in dual-channel mode */
+	udp->payload = (dgram_size - sizeof(struct udp_header)) & ~1U;
+	memcpy(&udp->dst, res->ai_addr, res->ai_addrlen);
+	udp->dst_len = res->ai_addrlen;
+
+	udp->ev.fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	freeaddrinfo(res);
+
+	if (udp->ev.fd == INVALID_SOCKET)
+		return -1;
+
+	if (udp->dst.ss_family == AF_INET6)
+		setsockopt(udp->ev.fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char *)&ttl, sizeof(ttl));
+	else
+		setsockopt(udp->ev.fd, IPPROTO_IP, IP_MULTICAST_TTL, (char *)&ttl, sizeof(ttl));
+
+	setsockopt(udp->ev.fd, SOL_SOCKET, SO_SNDBUF, (char *)&bufsize, sizeof(bufsize));
+
+#ifdef _WIN32
+	ioctlsocket(udp->ev.fd, FIONBIO, &blockmode);
+#else
+	fcntl(udp->ev.fd, F_SETFL, fcntl(udp->ev.fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	fprintf(stderr, "Streaming to UDP %s port %s, %u samples per datagram\n",
+		host, port, udp->payload);
+
+	return 0;
+}
+
+static void udp_close(void)
+{
+	if (!udp)
+		return;
+
+	closesocket(udp->ev.fd);
+
+	if (udp->datagrams)
+		fprintf(stderr, "sent %llu UDP datagrams in %llu send calls (%.2f calls/MB)\n",
+			(unsigned long long)udp->datagrams,
+			(unsigned long long)udp->syscalls,
+			udp->syscalls / (udp->datagrams * udp->payload / 1e6));
+	if (udp->dropped)
+		fprintf(stderr, "dropped %llu buffers for UDP output\n",
+			(unsigned long long)udp->dropped);
+
+	free(udp);
+	udp = NULL;
+}
+
+/* returns the number of datagrams sent, or -1 on error */
+static int udp_send_batch(struct iovec (*iov)[3], int num)
+{
+#if defined(HAVE_SENDMMSG)
+	struct mmsghdr msgs[UDP_BATCH];
+	int i;
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (i = 0; i < num; i++) {
+		msgs[i].msg_hdr.msg_name = &udp->dst;
+		msgs[i].msg_hdr.msg_namelen = udp->dst_len;
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = iov[i][2].iov_len ? 3 : 2;
+	}
 
-#ifdef _WIN32
-#pragma comment(lib, "ws2_32.lib")
+	udp->syscalls++;
+	return sendmmsg(udp->ev.fd, msgs, num, MSG_DONTWAIT);
+#elif defined(_WIN32)
+	WSABUF bufs[3];
+	DWORD sent;
+	int i, j;
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < 3; j++) {
+			bufs[j].buf = iov[i][j].iov_base;
+			bufs[j].len = (ULONG)iov[i][j].iov_len;
+		}
 
-typedef int socklen_t;
+		udp->syscalls++;
+		if (WSASendTo(udp->ev.fd, bufs, iov[i][2].iov_len ? 3 : 2, &sent, 0,
+			      (struct sockaddr *)&udp->dst, udp->dst_len, NULL, NULL))
+			return i ? i : SOCKET_ERROR;
+	}
 
+	return num;
 #else
-#define closesocket close
-#define SOCKADDR struct sockaddr
-#define SOCKET int
-#define SOCKET_ERROR -1
+	struct msghdr msg;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &udp->dst;
+		msg.msg_namelen = udp->dst_len;
+		msg.msg_iov = iov[i];
+		msg.msg_iovlen = iov[i][2].iov_len ? 3 : 2;
+
+		udp->syscalls++;
+		if (sendmsg(udp->ev.fd, &msg, MSG_DONTWAIT) < 0)
+			return i ? i : SOCKET_ERROR;
+	}
+
+	return num;
 #endif
+}
 
-#define DEFAULT_PORT_STR "1234"
-#define DEFAULT_SAMPLE_RATE_HZ 30000000
-#define DEFAULT_MAX_NUM_BUFFERS 500
+/*
+ * Packetize all complete datagrams that are available in the ring. A
+ * datagram may span two slots, the remainder of the last slot is sent
+ * as soon as the next one arrives.
+ */
+static void udp_flush(void)
+{
+	struct udp_header hdr[UDP_BATCH];
+	struct iovec iov[UDP_BATCH][3];
+	struct ring_slot *slot, *next;
+	uint64_t lag, max_lag, seq, pinned;
+	uint32_t offset, need, chunk;
+	int num, i, r;
+
+	while (1) {
+		pthread_mutex_lock(&ring.lock);
+
+		lag = ring.head - udp->seq;
+		max_lag = ring_max_lag(&ring);
+		if (lag > max_lag) {
+			udp->dropped += lag - max_lag;
+			udp->seq += lag - max_lag;
+			udp->offset = 0;
+		}
 
-static SOCKET s;
+		/* build up to UDP_BATCH complete datagrams */
+		seq = udp->seq;
+		offset = udp->offset;
+		pinned = 0;
+		for (num = 0; num < UDP_BATCH; num++) {
+			if (seq == ring.head)
+				break;
 
-static pthread_t tcp_worker_thread;
-static pthread_t command_thread;
-static pthread_cond_t exit_cond;
-static pthread_mutex_t exit_cond_lock;
+			slot = ring_slot(&ring, seq);
+			need = udp->payload;
+			chunk = slot->len - offset < need ? slot->len - offset : need;
+
+			/* the second part has to be in the next slot, unless
+			 * samples were lost in between: the header promises a
+			 * contiguous run, so end the datagram at the slot */
+			next = ring_slot(&ring, seq + 1);
+			if (chunk < need && seq + 1 != ring.head &&
+			    (next->sample != slot->sample + slot->samples ||
+			     (next->flags & FRAME_FLAG_DISCONT)))
+				need = chunk;
+			if (chunk < need && (seq + 1 == ring.head || next->len < need - chunk))
+				break;
 
-static pthread_mutex_t ll_mutex;
-static pthread_cond_t cond;
+			hdr[num].magic = htonl(!offset && (slot->flags & FRAME_FLAG_DISCONT) ?
+					       UDP_MAGIC_DISCONT : UDP_MAGIC);
+			hdr[num].seq = htonl(udp->dgram_seq + num);
+			hdr[num].sample = hton64(slot->sample + offset / slot_channels(slot));
+			hdr[num].timestamp = hton64(slot->timestamp +
+				(ring.rate ? offset / slot_channels(slot) *
+				 1000000000ULL / ring.rate : 0));
+
+			iov[num][0].iov_base = &hdr[num];
+			iov[num][0].iov_len = sizeof(hdr[num]);
+			iov[num][1].iov_base = slot->data + offset;
+			iov[num][1].iov_len = chunk;
+			iov[num][2].iov_len = 0;
+
+			offset += chunk;
+			if (offset == slot->len) {
+				seq++;
+				offset = 0;
+			}
 
-struct llist {
-	char *data;
-	size_t len;
-	struct llist *next;
-};
+			if (chunk < need) {
+				slot = ring_slot(&ring, seq);
+				iov[num][2].iov_base = slot->data;
+				iov[num][2].iov_len = need - chunk;
+				offset = need - chunk;
+			}
+		}
 
-typedef struct { /* structure size must be multiple of 2 bytes */
-	char magic[4];
-	uint32_t tuner_type;
-	uint32_t tuner_gain_count;
-} dongle_info_t;
+		if (!num) {
+			pthread_mutex_unlock(&ring.lock);
+			if (udp->want_out) {
+				poller_del(&udp->ev);
+				udp->want_out = false;
+			}
+			return;
+		}
 
-static fx2adc_dev_t *dev = NULL;
+		/* pin all slots the batch refers to */
+		pinned = seq - udp->seq + (offset ? 1 : 0);
+		for (i = 0; i < (int)pinned; i++)
+			ring_slot(&ring, udp->seq + i)->pins++;
 
-static int global_numq = 0;
-static struct llist *ll_buffers = 0;
-static int llbuf_num = DEFAULT_MAX_NUM_BUFFERS;
+		pthread_mutex_unlock(&ring.lock);
 
-static volatile int do_exit = 0;
+		r = udp_send_batch(iov, num);
 
+		pthread_mutex_lock(&ring.lock);
+		ring_unpin(&ring, udp->seq, pinned);
+		pthread_mutex_unlock(&ring.lock);
 
-void usage(void)
+		if (r == SOCKET_ERROR) {
+			if (send_would_block()) {
+				r = 0;
+			} else {
+				fprintf(stderr, "UDP send failed: %s\n", strerror(errno));
+				/* skip, so that we don't retry forever */
+				r = num;
+			}
+		}
+
+		for (i = 0; i < r; i++)
+			ring_advance(&ring, &udp->seq, &udp->offset,
+				     iov[i][1].iov_len + iov[i][2].iov_len);
+		udp->dgram_seq += r;
+		udp->datagrams += r;
+
+		/* the socket buffer is full, the rest is sent from the event
+		 * loop once it drains, also after the last USB buffer */
+		if (r < num) {
+			if (!udp->want_out) {
+				poller_add(&udp->ev, POLLER_OUT);
+				udp->want_out = true;
+			}
+			return;
+		}
+
+		if (udp->want_out) {
+			poller_del(&udp->ev);
+			udp->want_out = false;
+		}
+	}
+}
+
+static void set_listening(bool enable)
 {
-	fprintf(stderr, "fx2adc_tcp, a sample data server FX2 based USB scopes\n\n");
-	fprintf(stderr, "Usage:\t[-a listen address]\n");
-	fprintf(stderr, "\t[-p listen port (default: %s)]\n", DEFAULT_PORT_STR);
-	fprintf(stderr, "\t[-e (use external clock on IFCLK)]\n");
-	fprintf(stderr, "\t[-s samplerate in Hz (default: %d Hz)]\n", DEFAULT_SAMPLE_RATE_HZ);
-	fprintf(stderr, "\t[-v voltage divider in mV, default is the lowest setting the hardware supports\n");
-	fprintf(stderr, "\t[-b number of buffers (default: 15, set by library)]\n");
-	fprintf(stderr, "\t[-n max number of linked list buffers to keep (default: %d)]\n", DEFAULT_MAX_NUM_BUFFERS);
-	fprintf(stderr, "\t[-d device index (default: 0)]\n");
-	fprintf(stderr, "\t[-P ppm_error (default: 0)]\n");
-	exit(1);
+	if (listening == enable)
+		return;
+
+	if (enable)
+		poller_add(&listen_src, POLLER_IN);
+	else
+		poller_del(&listen_src);
+
+	listening = enable;
 }
 
-#ifdef _WIN32
-int gettimeofday(struct timeval *tv, void* ignored)
+static void accept_clients(void)
 {
-	FILETIME ft;
-	unsigned __int64 tmp = 0;
-	if (NULL != tv) {
-		GetSystemTimeAsFileTime(&ft);
-		tmp |= ft.dwHighDateTime;
-		tmp <<= 32;
-		tmp |= ft.dwLowDateTime;
-		tmp /= 10;
-#ifdef _MSC_VER
-		tmp -= 11644473600000000Ui64;
+	struct sockaddr_storage remote;
+	struct linger ling = {1,0};
+	struct client *c;
+	socklen_t rlen;
+	SOCKET sd;
+#ifdef _WIN32
+	u_long blockmode = 1;
+#endif
+
+	while (num_clients < max_clients) {
+		rlen = sizeof(remote);
+		sd = accept(listen_src.fd, (struct sockaddr *)&remote, &rlen);
+		if (sd == INVALID_SOCKET)
+			break;
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			closesocket(sd);
+			break;
+		}
+
+		c->ev.type = EV_CLIENT;
+		c->ev.fd = sd;
+#ifdef HAVE_IO_URING
+		c->ur_ops_tail = &c->ur_ops;
+#endif
+
+#ifdef _WIN32
+		ioctlsocket(sd, FIONBIO, &blockmode);
 #else
-		tmp -= 11644473600000000ULL;
+		fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
 #endif
-		tv->tv_sec = (long)(tmp / 1000000UL);
-		tv->tv_usec = (long)(tmp % 1000000UL);
+		setsockopt(sd, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
+
+		getnameinfo((struct sockaddr *)&remote, rlen,
+			    c->host, NI_MAXHOST,
+			    c->port, NI_MAXSERV, NI_NUMERICSERV);
+		fprintf(stderr, "client accepted! %s %s\n", c->host, c->port);
+
+#ifdef HAVE_MSG_ZEROCOPY
+		if (use_zerocopy && !use_uring) {
+			int one = 1;
+
+			if (setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+				fprintf(stderr, "SO_ZEROCOPY not supported, using regular sends\n");
+			else
+				c->send_flags = MSG_ZEROCOPY;
+		}
+#endif
+
+		send_stats_init(&c->stats);
+
+		if (poller_add(&c->ev, POLLER_IN)) {
+			closesocket(sd);
+			free(c);
+			break;
+		}
+
+		/* start streaming with the next buffer, or the history */
+		pthread_mutex_lock(&ring.lock);
+		c->seq = ring_start_seq(&ring);
+		pthread_mutex_unlock(&ring.lock);
+		c->next_sample = UINT64_MAX;
+
+		c->ring = &ring;
+		c->format = c->want_format = CONVERT_U8;
+		c->decim = c->want_decim = 1;
+		c->codec = c->want_codec = CODEC_NONE;
+		c->out_rate = c->want_rate = 0;
+		c->resume = UINT64_MAX;
+
+		if (default_framed && client_set_framing(c, true) == 0)
+			c->framed = true;
+
+		/* give the client a moment to choose framing and output */
+		c->start_ns = now_ns() + holdoff_ms * 1000000ULL;
+		c->started = holdoff_ms == 0;
+
+		c->next = clients;
+		clients = c;
+		num_clients++;
 	}
-	return 0;
+
+	if (num_clients >= max_clients)
+		set_listening(false);
 }
 
-BOOL WINAPI
-sighandler(int signum)
+#ifdef HAVE_SHM
+static int shm_listen(const char *path)
 {
-	if (CTRL_C_EVENT == signum) {
-		fprintf(stderr, "Signal caught, exiting!\n");
-		do_exit = 1;
-		fx2adc_cancel_async(dev);
-		return TRUE;
+	struct sockaddr_un sa;
+	SOCKET sd;
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd == INVALID_SOCKET)
+		return -1;
+
+	/* remove the socket of a previous run */
+	unlink(path);
+
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(sd, FX2ADC_SHM_MAX_READERS)) {
+		closesocket(sd);
+		return -1;
 	}
-	return FALSE;
+
+	shm_listen_src.fd = sd;
+
+	return poller_add(&shm_listen_src, POLLER_IN);
 }
-#else
-static void sighandler(int signum)
+
+/* hand the read-only ring and its own cursor memfd to a new reader */
+static int shm_send_hello(SOCKET sd, uint32_t index, int cursor_fd)
 {
-	signal(SIGPIPE, SIG_IGN);
-	fprintf(stderr, "Signal caught, exiting!\n");
-	fx2adc_cancel_async(dev);
-	do_exit = 1;
+	struct fx2adc_shm_hello hello;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	int fds[2] = { ring.shm_ro_fd, cursor_fd };
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	memset(&hello, 0, sizeof(hello));
+	hello.magic = FX2ADC_SHM_MAGIC;
+	hello.version = FX2ADC_SHM_VERSION;
+	hello.reader = index;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	return sendmsg(sd, &msg, MSG_NOSIGNAL) == sizeof(hello) ? 0 : -1;
 }
-#endif
 
-void fx2adc_callback(unsigned char *buf, uint32_t len, void *ctx)
+/* every reader gets a memfd of its own for its cursor, so that it can't
+ * disturb the others */
+static struct fx2adc_shm_reader *shm_cursor_new(int *fd)
 {
-	if(!do_exit) {
-		struct llist *rpt = (struct llist*)malloc(sizeof(struct llist));
-		rpt->data = (char*)malloc(len);
-		memcpy(rpt->data, buf, len);
-		rpt->len = len;
-		rpt->next = NULL;
+	struct fx2adc_shm_reader *cursor;
+
+	*fd = memfd_create("fx2adc-reader", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (*fd < 0)
+		return NULL;
+
+	if (ftruncate(*fd, sizeof(*cursor)) == 0) {
+		fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+		cursor = mmap(NULL, sizeof(*cursor), PROT_READ | PROT_WRITE,
+			      MAP_SHARED, *fd, 0);
+		if (cursor != MAP_FAILED)
+			return cursor;
+	}
 
-		pthread_mutex_lock(&ll_mutex);
+	close(*fd);
+	return NULL;
+}
 
-		if (ll_buffers == NULL) {
-			ll_buffers = rpt;
-		} else {
-			struct llist *cur = ll_buffers;
-			int num_queued = 0;
+static void shm_accept(void)
+{
+	struct fx2adc_shm_reader *cursor;
+	struct shm_reader *rd;
+	uint32_t i;
+	SOCKET sd;
+	int fd, r;
+
+	while (1) {
+		sd = accept4(shm_listen_src.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sd == INVALID_SOCKET)
+			break;
 
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
+		for (i = 0; i < FX2ADC_SHM_MAX_READERS; i++) {
+			if (!ring.shm_cursors[i])
+				break;
+		}
 
-			if(llbuf_num && llbuf_num == num_queued-2){
-				struct llist *curelem;
+		rd = i < FX2ADC_SHM_MAX_READERS ? calloc(1, sizeof(*rd)) : NULL;
+		if (!rd) {
+			fprintf(stderr, "rejecting shared memory reader, too many readers\n");
+			closesocket(sd);
+			continue;
+		}
 
-				free(ll_buffers->data);
-				curelem = ll_buffers->next;
-				free(ll_buffers);
-				ll_buffers = curelem;
-			}
+		cursor = shm_cursor_new(&fd);
+		if (!cursor) {
+			closesocket(sd);
+			free(rd);
+			continue;
+		}
 
-			cur->next = rpt;
+		rd->ev.type = EV_SHM_READER;
+		rd->ev.fd = sd;
+		rd->index = i;
+		rd->cursor = cursor;
+
+		/* start reading with the next buffer, or the history */
+		pthread_mutex_lock(&ring.lock);
+		cursor->seq = ring_start_seq(&ring);
+		ring.shm_cursors[i] = cursor;
+		pthread_mutex_unlock(&ring.lock);
+
+		r = shm_send_hello(sd, i, fd);
+		close(fd);
+		if (r || poller_add(&rd->ev, POLLER_IN)) {
+			pthread_mutex_lock(&ring.lock);
+			ring.shm_cursors[i] = NULL;
+			pthread_mutex_unlock(&ring.lock);
+			munmap(cursor, sizeof(*cursor));
+			closesocket(sd);
+			free(rd);
+			continue;
+		}
 
-			if (num_queued > global_numq)
-				fprintf(stderr, "ll+, now %d\n", num_queued);
-			else if (num_queued < global_numq)
-				fprintf(stderr, "ll-, now %d\n", num_queued);
+		fprintf(stderr, "shared memory reader %u attached\n", i);
 
-			global_numq = num_queued;
-		}
-		pthread_cond_signal(&cond);
-		pthread_mutex_unlock(&ll_mutex);
+		rd->next = shm_readers;
+		shm_readers = rd;
+		num_shm_readers++;
 	}
 }
 
-static void *tcp_worker(void *arg)
+static void shm_reader_close(struct shm_reader *rd)
 {
-	struct llist *curelem,*prev;
-	int bytesleft,bytessent, index;
-	struct timeval tv= {1,0};
-	struct timespec ts;
-	struct timeval tp;
-	fd_set writefds;
-	int r = 0;
-
-	while(1) {
-		if(do_exit)
-			pthread_exit(0);
-
-		pthread_mutex_lock(&ll_mutex);
-		gettimeofday(&tp, NULL);
-		ts.tv_sec  = tp.tv_sec+5;
-		ts.tv_nsec = tp.tv_usec * 1000;
-		r = pthread_cond_timedwait(&cond, &ll_mutex, &ts);
-		if(r == ETIMEDOUT) {
-			pthread_mutex_unlock(&ll_mutex);
-			fprintf(stderr, "worker cond timeout\n");
-			sighandler(0);
-			pthread_exit(NULL);
-		}
-
-		curelem = ll_buffers;
-		ll_buffers = 0;
-		pthread_mutex_unlock(&ll_mutex);
-
-		while(curelem != 0) {
-			bytesleft = curelem->len;
-			index = 0;
-			bytessent = 0;
-			while(bytesleft > 0) {
-				FD_ZERO(&writefds);
-				FD_SET(s, &writefds);
-				tv.tv_sec = 1;
-				tv.tv_usec = 0;
-				r = select(s+1, NULL, &writefds, NULL, &tv);
-				if(r) {
-					bytessent = send(s,  &curelem->data[index], bytesleft, 0);
-					bytesleft -= bytessent;
-					index += bytessent;
-				}
-				if(bytessent == SOCKET_ERROR || do_exit) {
-						fprintf(stderr, "worker socket bye\n");
-						sighandler(0);
-						pthread_exit(NULL);
-				}
-			}
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
-		}
-	}
+	struct shm_reader **p;
+
+	fprintf(stderr, "shared memory reader %u detached, %llu buffers dropped\n",
+		rd->index, (unsigned long long)__atomic_load_n(&rd->cursor->dropped,
+							       __ATOMIC_RELAXED));
+
+	/* the USB thread looks at the cursors with the lock held */
+	pthread_mutex_lock(&ring.lock);
+	ring.shm_cursors[rd->index] = NULL;
+	pthread_mutex_unlock(&ring.lock);
+	munmap(rd->cursor, sizeof(*rd->cursor));
+
+	poller_del(&rd->ev);
+	closesocket(rd->ev.fd);
+
+	for (p = &shm_readers; *p != rd; p = &(*p)->next)
+		;
+	*p = rd->next;
+
+	free(rd);
+	num_shm_readers--;
 }
 
-#ifdef _WIN32
-#define __attribute__(x)
-#pragma pack(push, 1)
-#endif
-struct command{
-	unsigned char cmd;
-	unsigned int param;
-}__attribute__((packed));
-#ifdef _WIN32
-#pragma pack(pop)
-#endif
-static void *command_worker(void *arg)
-{
-	int left, received = 0;
-	fd_set readfds;
-	struct command cmd={0, 0};
-	struct timeval tv= {1, 0};
-	int r = 0;
-	uint32_t tmp;
-
-	while(1) {
-		left=sizeof(cmd);
-		while(left >0) {
-			FD_ZERO(&readfds);
-			FD_SET(s, &readfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(s+1, &readfds, NULL, NULL, &tv);
-			if(r) {
-				received = recv(s, (char*)&cmd+(sizeof(cmd)-left), left, 0);
-				left -= received;
-			}
-			if(received == SOCKET_ERROR || do_exit) {
-				fprintf(stderr, "comm recv bye\n");
-				sighandler(0);
-				pthread_exit(NULL);
-			}
-		}
-		switch(cmd.cmd) {
-		case 0x01:
-			break;
-		case 0x02:
-			fprintf(stderr, "set sample rate %d\n", ntohl(cmd.param));
-			fx2adc_set_sample_rate(dev, ntohl(cmd.param), false);
-			break;
-		case 0x03:
-			fprintf(stderr, "set gain mode %d\n", ntohl(cmd.param));
-			//fx2adc_set_tuner_gain_mode(dev, ntohl(cmd.param));
-			break;
-		case 0x04:
-			fprintf(stderr, "set gain %d\n", ntohl(cmd.param));
-		//	fx2adc_set_tuner_gain(dev, ntohl(cmd.param));
-			break;
-		default:
-			break;
-		}
-		cmd.cmd = 0xff;
-	}
+/* readers never send anything, the socket only tells us when they are gone */
+static void shm_reader_event(struct shm_reader *rd)
+{
+	char buf[64];
+	ssize_t n;
+
+	while ((n = recv(rd->ev.fd, buf, sizeof(buf), 0)) > 0)
+		;
+
+	if (n == 0 || !send_would_block())
+		shm_reader_close(rd);
 }
+#endif
 
 int main(int argc, char **argv)
 {
-	int r, opt, i;
+	int r, opt, i, n;
 	char *addr = "127.0.0.1";
 	const char *port = DEFAULT_PORT_STR;
-	uint32_t frequency = 100000000, samp_rate = DEFAULT_SAMPLE_RATE_HZ;
-	struct sockaddr_storage local, remote;
+	uint32_t samp_rate = DEFAULT_SAMPLE_RATE_HZ;
+	struct sockaddr_storage local;
 	struct addrinfo *ai;
 	struct addrinfo *aiHead;
 	struct addrinfo  hints = { 0 };
 	char hostinfo[NI_MAXHOST];
 	char portinfo[NI_MAXSERV];
-	char remhostinfo[NI_MAXHOST];
-	char remportinfo[NI_MAXSERV];
 	int aiErr;
-	uint32_t buf_num = 0;
 	int dev_index = 0;
 	int vdiv = 0;
 	int ppm_error = 0;
-	struct llist *curelem,*prev;
-	pthread_attr_t attr;
-	void *status;
-	struct timeval tv = {1,0};
 	struct linger ling = {1,0};
-	SOCKET listensocket = 0;
-	socklen_t rlen;
-	fd_set readfds;
+	SOCKET listensocket = INVALID_SOCKET;
 	u_long blockmode = 1;
-	dongle_info_t dongle_info;
-	bool use_ext_clk = false;
+	struct poller_event events[MAX_EVENTS];
+	struct client *c;
+	struct conv_stream *st;
+	bool data_ready;
+	const char *udp_dst = NULL;
+	int udp_dgram_size = DEFAULT_UDP_DGRAM_SIZE;
+	int udp_ttl = 1;
+	uint32_t ring_slots;
 
 #ifdef _WIN32
 	WSADATA wsd;
@@ -353,7 +3648,7 @@ int main(int argc, char **argv)
 	struct sigaction sigact, sigign;
 #endif
 
-	while ((opt = getopt(argc, argv, "a:p:s:v:b:n:d:e")) != -1) {
+	while ((opt = getopt(argc, argv, "a:p:s:v:b:n:c:d:ezFD:u:M:T:L:wH:R:Z:j:U")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = (uint32_t)atoi(optarg);
@@ -376,8 +3671,52 @@ int main(int argc, char **argv)
 		case 'n':
 			llbuf_num = atoi(optarg);
 			break;
+		case 'c':
+			max_clients = atoi(optarg);
+			break;
 		case 'e':
-			use_ext_clk = true;
+			ext_clock = true;
+			break;
+		case 'z':
+			use_zerocopy = 1;
+			break;
+		case 'F':
+			default_framed = true;
+			break;
+		case 'D':
+			holdoff_ms = (uint32_t)atoi(optarg);
+			break;
+		case 'u':
+			udp_dst = optarg;
+			break;
+		case 'M':
+			udp_dgram_size = atoi(optarg);
+			break;
+		case 'T':
+			udp_ttl = atoi(optarg);
+			break;
+		case 'L':
+			shm_path = optarg;
+			break;
+		case 'w':
+			warm = true;
+			break;
+		case 'H':
+			history_ms = (uint32_t)atoi(optarg);
+			warm = true;
+			break;
+		case 'R':
+			retain_ms = (uint32_t)atoi(optarg);
+			warm = true;
+			break;
+		case 'Z':
+			comp_level = atoi(optarg);
+			break;
+		case 'j':
+			comp_threads = atoi(optarg);
+			break;
+		case 'U':
+			use_uring = true;
 			break;
 		default:
 			usage();
@@ -388,8 +3727,13 @@ int main(int argc, char **argv)
 	if (argc < optind)
 		usage();
 
-	if (dev_index < 0) {
-		exit(1);
+	if (dev_index < 0 || llbuf_num < 1 || max_clients < 1 || comp_threads < 0)
+		usage();
+
+	if (udp_dgram_size <= (int)sizeof(struct udp_header) ||
+	    udp_dgram_size > MAX_UDP_DGRAM_SIZE) {
+		fprintf(stderr, "Invalid UDP datagram size.\n");
+		usage();
 	}
 
 	fx2adc_open(&dev, (uint32_t)dev_index);
@@ -398,11 +3742,62 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+#ifndef HAVE_SHM
+	if (shm_path) {
+		fprintf(stderr, "Shared memory output is not supported on this platform.\n");
+		exit(1);
+	}
+#endif
+
+	/* the ring has to hold the history or the retention, whichever is
+	 * longer, in addition to the client queues */
+	history_slots = ((uint64_t)history_ms * samp_rate / 1000 +
+			 DEFAULT_BUF_LENGTH - 1) / DEFAULT_BUF_LENGTH;
+	retain_slots = ((uint64_t)retain_ms * samp_rate / 1000 +
+			DEFAULT_BUF_LENGTH - 1) / DEFAULT_BUF_LENGTH;
+
+	ring_slots = llbuf_num + (history_slots > retain_slots ? history_slots : retain_slots);
+
+	if (ring_alloc(&ring, ring_slots + RING_GUARD_SLOTS, DEFAULT_BUF_LENGTH,
+		       shm_path != NULL) ||
+	    poller_init() || wakeup_init()) {
+		fprintf(stderr, "Failed to allocate resources.\n");
+		exit(1);
+	}
+
+	poller_add(&wakeup_src, POLLER_IN);
+
+	if (use_uring) {
+#ifdef HAVE_IO_URING
+		if (uring_init())
+			fprintf(stderr, "io_uring not available (%s), using sendmsg()\n",
+				strerror(errno));
+		use_uring = uring.fd >= 0;
+#else
+		fprintf(stderr, "io_uring support not compiled in, using sendmsg()\n");
+		use_uring = false;
+#endif
+	}
+
+	if (udp_dst && udp_open(udp_dst, udp_dgram_size, udp_ttl)) {
+		fprintf(stderr, "Failed to set up UDP output to %s.\n", udp_dst);
+		exit(1);
+	}
+
+#ifdef HAVE_SHM
+	if (shm_path && shm_listen(shm_path)) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", shm_path, strerror(errno));
+		exit(1);
+	}
+#endif
+
 #ifndef _WIN32
 	sigact.sa_handler = sighandler;
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = 0;
 	sigign.sa_handler = SIG_IGN;
+	sigemptyset(&sigign.sa_mask);
+	sigign.sa_flags = 0;
 	sigaction(SIGINT, &sigact, NULL);
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGQUIT, &sigact, NULL);
@@ -412,21 +3807,18 @@ int main(int argc, char **argv)
 #endif
 
 	/* Set the sample rate */
-	r = fx2adc_set_sample_rate(dev, samp_rate, use_ext_clk);
+	r = fx2adc_set_sample_rate(dev, samp_rate, ext_clock);
 	if (r < 0)
 		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
 
+	ring_set_rate(&ring, fx2adc_get_sample_rate(dev));
+
 	if (vdiv > 0) {
 		r = fx2adc_set_vdiv(dev, 1, vdiv);
 		if (r < 0)
 			fprintf(stderr, "WARNING: Failed to set the voltage divider.\n");
 	}
-
-	pthread_mutex_init(&exit_cond_lock, NULL);
-	pthread_mutex_init(&ll_mutex, NULL);
-	pthread_mutex_init(&exit_cond_lock, NULL);
-	pthread_cond_init(&cond, NULL);
-	pthread_cond_init(&exit_cond, NULL);
+	vdiv_mv[0] = fx2adc_get_vdiv(dev);
 
 	hints.ai_flags  = AI_PASSIVE; /* Server mode. */
 	hints.ai_family = PF_UNSPEC;  /* IPv4 or IPv6. */
@@ -472,72 +3864,176 @@ int main(int argc, char **argv)
 	r = fcntl(listensocket, F_SETFL, r | O_NONBLOCK);
 #endif
 
-	while(1) {
-		fprintf(stderr, "listening...\n");
-		fprintf(stderr, "Use the device argument 'rtl_tcp=%s:%s' in OsmoSDR "
-		       "(gr-osmosdr) source\n"
-		       "to receive samples in GRC and control "
-		       "rtl_tcp parameters (frequency, gain, ...).\n",
-		       hostinfo, portinfo);
-		listen(listensocket,1);
-
-		while(1) {
-			FD_ZERO(&readfds);
-			FD_SET(listensocket, &readfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(listensocket+1, &readfds, NULL, NULL, &tv);
-			if(do_exit) {
-				goto out;
-			} else if(r) {
-				rlen = sizeof(remote);
-				s = accept(listensocket,(struct sockaddr *)&remote, &rlen);
+	listen(listensocket, max_clients);
+	listen_src.fd = listensocket;
+	set_listening(true);
+
+	fprintf(stderr, "listening...\n");
+	fprintf(stderr, "Use the device argument 'rtl_tcp=%s:%s' in OsmoSDR "
+	       "(gr-osmosdr) source\n"
+	       "to receive samples in GRC and control "
+	       "rtl_tcp parameters (frequency, gain, ...).\n",
+	       hostinfo, portinfo);
+
+	r = 0;
+	while (!do_exit) {
+		/* the UDP output and warm mode stream all the time */
+		if ((warm || num_clients || num_shm_readers || udp) && !stream_running) {
+			stream_start();
+		} else if (!warm && !num_clients && !num_shm_readers && !udp && stream_running) {
+			stream_stop();
+			fprintf(stderr, "all clients gone, listening...\n");
+		}
+
+		n = poller_wait(events, MAX_EVENTS, clients_start());
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		data_ready = false;
+		for (i = 0; i < n; i++) {
+			switch (events[i].src->type) {
+			case EV_LISTEN:
+				accept_clients();
+				break;
+			case EV_WAKEUP:
+				wakeup_drain();
+				data_ready = true;
+				break;
+			case EV_CLIENT:
+				c = (struct client *)events[i].src;
+				if (c->dead)
+					break;
+				if (events[i].events & POLLER_HUP) {
+					client_close(c);
+					break;
+				}
+				/* with MSG_ZEROCOPY, completions are signalled
+				 * via the error queue */
+				if (events[i].events & POLLER_ERR) {
+#ifdef HAVE_MSG_ZEROCOPY
+					if (!c->send_flags || zc_reap(c) < 0) {
+#endif
+						client_close(c);
+						break;
+#ifdef HAVE_MSG_ZEROCOPY
+					}
+#endif
+				}
+				if ((events[i].events & POLLER_IN) && client_read(c) < 0) {
+					client_close(c);
+					break;
+				}
+				/* answer right away, not with the next buffer */
+				if (c->stats_pending && !c->want_out && client_flush(c) < 0) {
+					client_close(c);
+					break;
+				}
+				if ((events[i].events & POLLER_OUT) && client_flush(c) < 0)
+					client_close(c);
+				break;
+			case EV_UDP:
+				udp_flush();
+				break;
+			case EV_SHM_LISTEN:
+#ifdef HAVE_SHM
+				shm_accept();
+#endif
+				break;
+			case EV_SHM_READER:
+#ifdef HAVE_SHM
+				shm_reader_event((struct shm_reader *)events[i].src);
+#endif
+				break;
+			case EV_URING:
+#ifdef HAVE_IO_URING
+				uring_drain();
+#endif
 				break;
 			}
 		}
 
-		setsockopt(s, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
+#ifdef HAVE_IO_URING
+		if (uring.fd >= 0)
+			uring_reap();
+#endif
 
-		getnameinfo((struct sockaddr *)&remote, rlen,
-			    remhostinfo, NI_MAXHOST,
-			    remportinfo, NI_MAXSERV, NI_NUMERICSERV);
-		fprintf(stderr, "client accepted! %s %s\n", remhostinfo, remportinfo);
+		if (data_ready) {
+			/* once per output configuration, not per client */
+			for (st = conv_streams; st; st = st->next) {
+				if (st->conv || st->rs)
+					conv_run(st);
+			}
+#ifdef HAVE_ZSTD
+			for (st = conv_streams; st; st = st->next) {
+				if (st->codec != CODEC_NONE)
+					comp_queue(st);
+			}
+#endif
 
-		memset(&dongle_info, 0, sizeof(dongle_info));
-		memcpy(&dongle_info.magic, "RTL0", 4);
+			for (c = clients; c; c = c->next) {
+				if (!c->dead && client_flush(c) < 0)
+					client_close(c);
+			}
+
+			if (udp && !udp->want_out)
+				udp_flush();
+		}
 
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-		r = pthread_create(&tcp_worker_thread, &attr, tcp_worker, NULL);
-		r = pthread_create(&command_thread, &attr, command_worker, NULL);
-		pthread_attr_destroy(&attr);
+#ifdef HAVE_IO_URING
+		if (uring.fd >= 0)
+			uring_run();
+#endif
 
-		r = fx2adc_read(dev, fx2adc_callback, NULL, buf_num, 0);
+		clients_reap();
 
-		pthread_join(tcp_worker_thread, &status);
-		pthread_join(command_thread, &status);
+		if (stream_running && usb_done) {
+			/* fx2adc_read() returned without being canceled */
+			stream_stop();
+			fprintf(stderr, "Library error %d, exiting...\n", usb_result);
+			r = usb_result;
+			break;
+		}
 
-		closesocket(s);
+		if (num_clients < max_clients)
+			set_listening(true);
+	}
 
-		fprintf(stderr, "all threads dead..\n");
-		curelem = ll_buffers;
-		ll_buffers = 0;
+	stream_stop();
 
-		while(curelem != 0) {
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
-		}
+	for (c = clients; c; c = c->next)
+		client_close(c);
+	clients_reap();
 
-		do_exit = 0;
-		global_numq = 0;
+#ifdef HAVE_IO_URING
+	uring_exit();
+#endif
+
+#ifdef HAVE_ZSTD
+	pool_stop();
+#endif
+
+	if (ring.overruns)
+		fprintf(stderr, "%llu buffers lost due to ring overruns\n",
+			(unsigned long long)ring.overruns);
+
+	udp_close();
+
+#ifdef HAVE_SHM
+	while (shm_readers)
+		shm_reader_close(shm_readers);
+
+	if (shm_listen_src.fd != INVALID_SOCKET) {
+		closesocket(shm_listen_src.fd);
+		unlink(shm_path);
 	}
+#endif
 
-out:
 	fx2adc_close(dev);
 	closesocket(listensocket);
-	closesocket(s);
+	ring_free(&ring);
 #ifdef _WIN32
 	WSACleanup();
 #endif
@@ -26,6 +26,7 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
@@ -45,6 +46,8 @@
 #include "getopt/getopt.h"
 #endif
 
+#include <pthread.h>
+
 #include "fx2adc.h"
 
 #define DEFAULT_SAMPLE_RATE		30000000
@@ -52,11 +55,35 @@
 #define MINIMAL_BUF_LENGTH		512
 #define MAXIMAL_BUF_LENGTH		(256 * 16384)
 
+#define DEFAULT_BUF_NUMBER		15
+
 #define MHZ(x)	((x)*1000*1000)
 
 #define PPM_DURATION			10
 #define PPM_DUMP_TIME			5
 
+#define SWEEP_DURATION			5
+#define SWEEP_SETTLE_MS			500
+#define SWEEP_MAX_PPM			200
+#define SWEEP_MAX_VALUES		32
+#define SWEEP_TIMEOUT			5
+#define SWEEP_BUF_NUMS			"4,8,15,32"
+#define SWEEP_BUF_LENGTHS		"65536,262144,1048576"
+#define SWEEP_RATES			"48e6,30e6,24e6,16e6,8e6"
+
+/* values below 2 * HIST_SUB ns are exact, above that there are
+ * HIST_SUB buckets per power of two, within 1 / HIST_SUB */
+#define HIST_SUB_BITS			6
+#define HIST_SUB			(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS			((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define PROBE_RAMP			"30e6:60e6:1e6"
+#define PROBE_STEP_MS			1000
+#define PROBE_SETTLE_MS			300
+#define PROBE_RESOLUTION		100000
+#define PROBE_BUF_NUM			"15"
+#define PROBE_BUF_LENGTH		"262144"
+
 struct time_generic
 /* holds all the platform specific values */
 {
@@ -82,6 +109,89 @@ static uint32_t dropped_samples = 0;
 
 static unsigned int ppm_duration = PPM_DURATION;
 
+/*
+ * Sweep: every combination of buffer count, buffer length and rate is
+ * streamed for a while, after a settling time. The callback records
+ * the bytes and the gaps between completions. A setting is sustainable
+ * if no transfer failed, the samples arrived at the nominal rate and no
+ * gap was as long as the queued buffers last, beyond which the FIFO of
+ * the FX2 overflows.
+ */
+struct sweep_run {
+	uint32_t buf_num;
+	uint32_t buf_len;
+	uint32_t rate;		/* nominal, as set */
+	bool ext_clock;
+	int result;		/* of fx2adc_read() */
+	double achieved;	/* samples per second */
+	double ppm;
+	double interval_us;	/* mean time between completions */
+	double jitter_us;	/* its standard deviation */
+	double max_gap_ms;
+	double inflight_ms;	/* the time the queued buffers cover */
+	fx2adc_xfer_stats_t xs;
+	bool sustainable;
+};
+
+static struct {
+	unsigned int duration;	/* seconds per run */
+	uint64_t start_ns;	/* first completion */
+	uint64_t first_ns;	/* first one after settling */
+	uint64_t last_ns;
+	uint64_t bytes;		/* after first_ns */
+	uint64_t gaps;
+	double mean, m2;	/* of the gaps in ns, running */
+	double max;
+	volatile sig_atomic_t timed_out;
+} sweep = { .duration = SWEEP_DURATION };
+
+/*
+ * Latency histograms of the PPM measurement: the time between transfer
+ * completions and the time spent in the callback, which includes the
+ * PPM output. The callback only increments a bucket, a reporter thread
+ * prints the percentiles. There are two sets of histograms, at the end
+ * of a period the callback switches to the other one and hands the full
+ * one to the reporter. A gap at least as long as the queued buffers last
+ * is a stall, the FIFO of the FX2 overflows with it.
+ */
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+static struct {
+	struct hist gap[2], cb[2];
+	uint64_t stalls[2];
+	unsigned int cur;	/* the set the callback fills */
+	struct hist gap_all, cb_all;
+	uint64_t stalls_all;
+	uint64_t period_ns;
+	uint64_t stall_ns;
+	uint64_t last_ns;	/* previous completion */
+	uint64_t next_ns;	/* end of the period */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool pending;		/* the other set waits for the reporter */
+	bool stop;
+} lat;
+
+/*
+ * Probe: with a Si5351, the rate can be changed while the device keeps
+ * streaming. A reader thread runs fx2adc_read(), the main thread ramps
+ * the external clock and measures every step like a sweep run, then
+ * narrows down the edge where drops start by bisection. The highest
+ * clean rate has to hold for the sweep duration.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;	/* of the sweep counters */
+	bool running;
+	int result;
+	uint32_t buf_num, buf_len;
+} probe;
+
 void usage(void)
 {
 	fprintf(stderr,
@@ -89,7 +199,20 @@ void usage(void)
 		"Usage:\n"
 		"\t[-s samplerate (default: 30e6 = 30 MHz)]\n"
 		"\t[-d device_index (default: 0)]\n"
-		"\t[-p[seconds] enable PPM error measurement (default: 10 seconds)]\n");
+		"\t[-p[seconds] enable PPM error measurement (default: 10 seconds),\n"
+		"\t    with percentiles of the completion gaps and callback times]\n"
+		"\t[-S sweep buffer settings and rates, report what is sustainable]\n"
+		"\t[-N buffer counts to sweep (default: " SWEEP_BUF_NUMS ")]\n"
+		"\t[-b buffer lengths to sweep (default: " SWEEP_BUF_LENGTHS ")]\n"
+		"\t[-r internal clock rates to sweep (default: " SWEEP_RATES ")]\n"
+		"\t[-E external clock rates to sweep, set with the Si5351]\n"
+		"\t[-t seconds per sweep run (default: %d)]\n"
+		"\t[-J file to write the sweep results to as JSON, '-' for stdout]\n"
+		"\t[-P probe the highest rate the host sustains, ramping the Si5351;\n"
+		"\t    with the first -N and -b values (default: " PROBE_BUF_NUM " of "
+		PROBE_BUF_LENGTH "), holds the result for -t seconds]\n"
+		"\t[-R probe ramp start:stop:step in Hz (default: " PROBE_RAMP ")]\n",
+		SWEEP_DURATION);
 	exit(1);
 }
 
@@ -214,10 +337,623 @@ static void ppm_test(uint32_t len)
 	nsamples = 0;
 }
 
+static uint64_t time_ns(void)
+{
+	static struct time_generic tg;
+
+	ppm_gettime(&tg);
+	return (uint64_t)tg.tv_sec * 1000000000ULL + (uint64_t)tg.tv_nsec;
+}
+
+/* a running mean and variance, Welford's method */
+static void stats_add(double *mean, double *m2, uint64_t n, double x)
+{
+	double d = x - *mean;
+
+	*mean += d / n;
+	*m2 += d * (x - *mean);
+}
+
+static void sweep_reset(void)
+{
+	sweep.start_ns = sweep.first_ns = sweep.last_ns = 0;
+	sweep.bytes = sweep.gaps = 0;
+	sweep.mean = sweep.m2 = sweep.max = 0;
+	sweep.timed_out = 0;
+}
+
+/* a completion at now, the rate is taken from the bytes after the
+ * first one */
+static void sweep_account(uint64_t now, uint32_t len)
+{
+	uint64_t gap;
+
+	if (!sweep.first_ns) {
+		sweep.first_ns = now;
+		sweep.last_ns = now;
+		return;
+	}
+
+	gap = now - sweep.last_ns;
+	stats_add(&sweep.mean, &sweep.m2, ++sweep.gaps, (double)gap);
+	if (gap > sweep.max)
+		sweep.max = gap;
+	sweep.bytes += len;
+	sweep.last_ns = now;
+}
+
+static void sweep_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	uint64_t now = time_ns();
+
+	if (!sweep.start_ns)
+		sweep.start_ns = now;
+
+	if (now < sweep.start_ns + SWEEP_SETTLE_MS * 1000000ULL)
+		return;
+
+	sweep_account(now, len);
+
+	if (now - sweep.first_ns >= sweep.duration * 1000000000ULL)
+		fx2adc_cancel_async(dev);
+}
+
+/* comma separated numbers like 30e6,48e6 */
+static unsigned int parse_list(const char *str, double *vals)
+{
+	unsigned int n = 0;
+	char *end;
+
+	while (*str && n < SWEEP_MAX_VALUES) {
+		vals[n] = strtod(str, &end);
+		if (end == str || vals[n] <= 0)
+			return 0;
+		n++;
+		str = end;
+		if (*str == ',')
+			str++;
+	}
+
+	return n;
+}
+
+#ifndef _WIN32
+/* a run that stops delivering, e.g. all transfers timed out */
+static void sweep_timeout(int signum)
+{
+	sweep.timed_out = 1;
+	fx2adc_cancel_async(dev);
+}
+#endif
+
+/* the results of a run from the completions since the reset and the
+ * transfer counters since before, if given */
+static void sweep_evaluate(struct sweep_run *run, const fx2adc_xfer_stats_t *before)
+{
+	uint64_t errors;
+	double span;
+
+	fx2adc_get_xfer_stats(dev, &run->xs);
+	if (before) {
+		run->xs.completed -= before->completed;
+		run->xs.bytes -= before->bytes;
+		run->xs.short_xfers -= before->short_xfers;
+		run->xs.errors -= before->errors;
+		run->xs.timeouts -= before->timeouts;
+		run->xs.stalls -= before->stalls;
+		run->xs.overflows -= before->overflows;
+		run->xs.resubmit_failed -= before->resubmit_failed;
+	}
+
+	span = (double)(sweep.last_ns - sweep.first_ns);
+	run->achieved = span > 0 ? sweep.bytes * 1e9 / span : 0;
+	run->ppm = 1e6 * (run->achieved / run->rate - 1.);
+	run->interval_us = sweep.mean / 1e3;
+	run->jitter_us = sweep.gaps > 1 ? sqrt(sweep.m2 / (sweep.gaps - 1)) / 1e3 : 0;
+	run->max_gap_ms = sweep.max / 1e6;
+	run->inflight_ms = (double)run->buf_num * run->buf_len * 1e3 / run->rate;
+
+	errors = run->xs.errors + run->xs.timeouts + run->xs.stalls + run->xs.overflows +
+		 run->xs.resubmit_failed;
+	run->sustainable = run->result == 0 && !run->xs.dev_lost && !errors && sweep.gaps &&
+			   fabs(run->ppm) <= SWEEP_MAX_PPM && run->max_gap_ms < run->inflight_ms;
+}
+
+static void sweep_one(struct sweep_run *run)
+{
+	sweep_reset();
+
+	if (fx2adc_set_sample_rate(dev, run->rate, run->ext_clock) < 0)
+		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
+	run->rate = fx2adc_get_sample_rate(dev);
+
+#ifndef _WIN32
+	alarm(SWEEP_SETTLE_MS / 1000 + sweep.duration + SWEEP_TIMEOUT);
+#endif
+	run->result = fx2adc_read(dev, sweep_callback, run, run->buf_num, run->buf_len);
+#ifndef _WIN32
+	alarm(0);
+#endif
+	if (sweep.timed_out)
+		run->result = -ETIMEDOUT;
+
+	sweep_evaluate(run, NULL);
+}
+
+static void sweep_header(void)
+{
+	printf("%5s %8s %10s %4s %12s %9s %11s %9s %10s %11s %6s %s\n",
+	       "bufs", "length", "rate", "clk", "achieved", "ppm", "interval_us", "jitter_us",
+	       "max_gap_ms", "inflight_ms", "errors", "sustainable");
+}
+
+static void sweep_print(const struct sweep_run *run)
+{
+	printf("%5u %8u %10u %4s %12.0f %9.1f %11.1f %9.1f %10.2f %11.2f %6llu %s\n",
+	       run->buf_num, run->buf_len, run->rate, run->ext_clock ? "ext" : "int",
+	       run->achieved, run->ppm, run->interval_us, run->jitter_us, run->max_gap_ms,
+	       run->inflight_ms,
+	       (unsigned long long)(run->xs.errors + run->xs.timeouts + run->xs.stalls +
+				    run->xs.overflows + run->xs.resubmit_failed),
+	       run->sustainable ? "yes" : "no");
+	fflush(stdout);
+}
+
+static void sweep_json(FILE *f, const struct sweep_run *runs, unsigned int num)
+{
+	const struct sweep_run *run;
+	unsigned int i;
+
+	fprintf(f, "{\n  \"device\": \"%s\",\n  \"seconds_per_run\": %u,\n  \"runs\": [",
+		fx2adc_get_device_name(0), sweep.duration);
+	for (i = 0; i < num; i++) {
+		run = &runs[i];
+		fprintf(f, "%s\n    {\"buf_num\": %u, \"buf_len\": %u, \"rate\": %u, "
+			"\"clock\": \"%s\", \"result\": %d, \"achieved\": %.1f, "
+			"\"ppm\": %.2f, \"interval_us\": %.2f, \"jitter_us\": %.2f, "
+			"\"max_gap_ms\": %.3f, \"inflight_ms\": %.3f, \"transfers\": %llu, "
+			"\"short\": %llu, \"errors\": %llu, \"timeouts\": %llu, "
+			"\"stalls\": %llu, \"overflows\": %llu, \"resubmit_failed\": %llu, "
+			"\"dev_lost\": %s, \"sustainable\": %s}",
+			i ? "," : "", run->buf_num, run->buf_len, run->rate,
+			run->ext_clock ? "external" : "internal", run->result, run->achieved,
+			run->ppm, run->interval_us, run->jitter_us, run->max_gap_ms,
+			run->inflight_ms, (unsigned long long)run->xs.completed,
+			(unsigned long long)run->xs.short_xfers,
+			(unsigned long long)run->xs.errors, (unsigned long long)run->xs.timeouts,
+			(unsigned long long)run->xs.stalls, (unsigned long long)run->xs.overflows,
+			(unsigned long long)run->xs.resubmit_failed,
+			run->xs.dev_lost ? "true" : "false", run->sustainable ? "true" : "false");
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+/* every rate with every buffer setting, the rates outermost, so that the
+ * clock changes as rarely as possible */
+static int sweep_main(const char *nums, const char *lens, const char *rates,
+		      const char *ext_rates, const char *json)
+{
+	double num[SWEEP_MAX_VALUES], len[SWEEP_MAX_VALUES], rate[2 * SWEEP_MAX_VALUES];
+	unsigned int n_num, n_len, n_int, n_ext = 0, i, j, k, done = 0, total;
+	const struct sweep_run *best;
+	struct sweep_run *runs, *run;
+	FILE *f;
+
+	n_num = parse_list(nums, num);
+	n_len = parse_list(lens, len);
+	n_int = rates ? parse_list(rates, rate) : 0;
+	n_ext = ext_rates ? parse_list(ext_rates, rate + n_int) : 0;
+	if (!n_num || !n_len || (rates && !n_int) || (ext_rates && !n_ext)) {
+		fprintf(stderr, "Invalid list of buffer counts, lengths or rates\n");
+		return -1;
+	}
+	if (n_ext && !fx2adc_has_clockgen(dev)) {
+		fprintf(stderr, "No Si5351 found, the external clock rates are skipped\n");
+		n_ext = 0;
+	}
+	if (!n_int && !n_ext)
+		return -1;
+	for (j = 0; j < n_len; j++) {
+		if ((uint32_t)len[j] % 512 || len[j] < MINIMAL_BUF_LENGTH ||
+		    len[j] > MAXIMAL_BUF_LENGTH) {
+			fprintf(stderr, "Buffer lengths must be multiples of 512 from %u to %u\n",
+				MINIMAL_BUF_LENGTH, MAXIMAL_BUF_LENGTH);
+			return -1;
+		}
+	}
+
+	total = (n_int + n_ext) * n_num * n_len;
+	runs = calloc(total, sizeof(*runs));
+	if (!runs)
+		return -1;
+
+	fprintf(stderr, "Sweeping %u settings for %u seconds each...\n", total, sweep.duration);
+	sweep_header();
+	for (k = 0; k < n_int + n_ext && !do_exit; k++) {
+		for (i = 0; i < n_num && !do_exit; i++) {
+			for (j = 0; j < n_len && !do_exit; j++) {
+				run = &runs[done];
+				run->buf_num = (uint32_t)num[i];
+				run->buf_len = (uint32_t)len[j];
+				run->rate = (uint32_t)rate[k];
+				run->ext_clock = k >= n_int;
+				sweep_one(run);
+				/* a cancelled run doesn't count */
+				if (do_exit)
+					break;
+				sweep_print(run);
+				done++;
+			}
+		}
+	}
+
+	/* the stable setting with the lowest latency, for every rate */
+	for (k = 0; k < done; k += n_num * n_len) {
+		best = NULL;
+		for (i = k; i < done && i < k + n_num * n_len; i++) {
+			if (runs[i].sustainable && (!best || runs[i].inflight_ms < best->inflight_ms))
+				best = &runs[i];
+		}
+		if (best)
+			printf("%u Hz (%s): %u buffers of %u bytes, %.1f ms in flight\n",
+			       runs[k].rate, runs[k].ext_clock ? "external" : "internal",
+			       best->buf_num, best->buf_len, best->inflight_ms);
+		else
+			printf("%u Hz (%s): not sustainable\n", runs[k].rate,
+			       runs[k].ext_clock ? "external" : "internal");
+	}
+
+	if (json) {
+		f = strcmp(json, "-") ? fopen(json, "w") : stdout;
+		if (f) {
+			sweep_json(f, runs, done);
+			if (f != stdout)
+				fclose(f);
+		} else
+			fprintf(stderr, "Failed to open %s\n", json);
+	}
+
+	free(runs);
+
+	return 0;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !do_exit)
+		;
+#endif
+}
+
+static void probe_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	uint64_t now = time_ns();
+
+	/* counted from the start of a step on */
+	pthread_mutex_lock(&probe.lock);
+	if (sweep.start_ns)
+		sweep_account(now, len);
+	pthread_mutex_unlock(&probe.lock);
+}
+
+static void *probe_reader(void *arg)
+{
+	int r;
+
+	r = fx2adc_read(dev, probe_callback, NULL, probe.buf_num, probe.buf_len);
+
+	pthread_mutex_lock(&probe.lock);
+	probe.result = r;
+	probe.running = false;
+	pthread_mutex_unlock(&probe.lock);
+
+	return NULL;
+}
+
+/* switch the clock to rate and measure for ms milliseconds after it
+ * settled, returns whether the step was clean */
+static bool probe_step(uint32_t rate, unsigned int ms, struct sweep_run *run)
+{
+	fx2adc_xfer_stats_t before;
+
+	memset(run, 0, sizeof(*run));
+	run->buf_num = probe.buf_num;
+	run->buf_len = probe.buf_len;
+	run->ext_clock = true;
+
+	if (fx2adc_set_sample_rate(dev, rate, true) < 0)
+		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
+	run->rate = fx2adc_get_sample_rate(dev);
+	sleep_ms(PROBE_SETTLE_MS);
+
+	pthread_mutex_lock(&probe.lock);
+	sweep_reset();
+	sweep.start_ns = time_ns();
+	fx2adc_get_xfer_stats(dev, &before);
+	pthread_mutex_unlock(&probe.lock);
+
+	sleep_ms(ms);
+
+	pthread_mutex_lock(&probe.lock);
+	run->result = probe.running ? 0 : probe.result ? probe.result : -EIO;
+	sweep_evaluate(run, &before);
+	sweep.start_ns = 0;
+	pthread_mutex_unlock(&probe.lock);
+
+	if (!do_exit)
+		sweep_print(run);
+
+	return run->sustainable;
+}
+
+static bool probe_go_on(void)
+{
+	bool running;
+
+	pthread_mutex_lock(&probe.lock);
+	running = probe.running;
+	pthread_mutex_unlock(&probe.lock);
+
+	return running && !do_exit;
+}
+
+static int probe_main(const char *ramp, const char *nums, const char *lens)
+{
+	double num[SWEEP_MAX_VALUES], len[SWEEP_MAX_VALUES], start, stop, step;
+	uint32_t rate, lo = 0, hi = 0;
+	struct sweep_run run;
+	bool clean = false;
+
+	if (sscanf(ramp, "%lf:%lf:%lf", &start, &stop, &step) != 3 || start < 1e6 ||
+	    stop < start || step < PROBE_RESOLUTION) {
+		fprintf(stderr, "Invalid ramp %s, expected start:stop:step in Hz\n", ramp);
+		return -1;
+	}
+	if (!parse_list(nums, num) || !parse_list(lens, len) || (uint32_t)len[0] % 512) {
+		fprintf(stderr, "Invalid buffer count or length\n");
+		return -1;
+	}
+	if (!fx2adc_has_clockgen(dev)) {
+		fprintf(stderr, "The probe needs a Si5351 to set the external clock\n");
+		return -1;
+	}
+
+	probe.buf_num = (uint32_t)num[0];
+	probe.buf_len = (uint32_t)len[0];
+	probe.running = true;
+	pthread_mutex_init(&probe.lock, NULL);
+
+	fx2adc_set_sample_rate(dev, (uint32_t)start, true);
+	if (pthread_create(&probe.thread, NULL, probe_reader, NULL)) {
+		fprintf(stderr, "Failed to start the reader thread\n");
+		return -1;
+	}
+
+	fprintf(stderr, "Ramping the clock from %.3f to %.3f MHz in %.3f MHz steps, "
+		"%u buffers of %u bytes...\n", start / 1e6, stop / 1e6, step / 1e6,
+		probe.buf_num, probe.buf_len);
+	sweep_header();
+	for (rate = (uint32_t)start; rate <= stop && probe_go_on(); rate += (uint32_t)step) {
+		if (!probe_step(rate, PROBE_STEP_MS, &run)) {
+			hi = rate;
+			break;
+		}
+		lo = rate;
+	}
+
+	if (lo && hi && probe_go_on())
+		fprintf(stderr, "Drops from %.3f MHz on, searching the edge...\n", hi / 1e6);
+	while (lo && hi && hi - lo > PROBE_RESOLUTION && probe_go_on()) {
+		rate = lo + (hi - lo) / 2;
+		if (probe_step(rate, PROBE_STEP_MS, &run))
+			lo = rate;
+		else
+			hi = rate;
+	}
+
+	/* the edge has to hold for the whole duration, otherwise back off */
+	while (lo >= start && probe_go_on()) {
+		fprintf(stderr, "Holding %.3f MHz for %u seconds...\n", lo / 1e6, sweep.duration);
+		clean = probe_step(lo, sweep.duration * 1000, &run);
+		if (clean)
+			break;
+		lo -= PROBE_RESOLUTION;
+	}
+
+	fx2adc_cancel_async(dev);
+	pthread_join(probe.thread, NULL);
+
+	if (clean)
+		printf("Highest clean rate: %u Hz%s (%.1f PPM, jitter %.1f us, max gap %.2f ms "
+		       "over %u s)\n", run.rate, hi ? "" : ", the end of the ramp", run.ppm,
+		       run.jitter_us, run.max_gap_ms, sweep.duration);
+	else if (!do_exit)
+		printf("No clean rate from %.3f MHz on\n", start / 1e6);
+
+	return clean ? 0 : -1;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int msb, shift;
+
+	if (v < 2 * HIST_SUB)
+		return (unsigned int)v;
+
+#ifdef __GNUC__
+	msb = 63 - __builtin_clzll(v);
+#else
+	for (msb = 0; v >> (msb + 1); msb++)
+		;
+#endif
+	shift = msb - HIST_SUB_BITS;
+
+	return (shift + 1) * HIST_SUB + (unsigned int)(v >> shift) - HIST_SUB;
+}
+
+/* the largest value that falls into bucket i */
+static uint64_t hist_value(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < 2 * HIST_SUB)
+		return i;
+
+	shift = i / HIST_SUB - 1;
+
+	return ((uint64_t)(i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count[hist_index(v)]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->count[i] += from->count[i];
+	to->total += from->total;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+/* the value p of all values are less or equal to */
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t n = 0, rank = (uint64_t)ceil(h->total * p);
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n += h->count[i];
+		if (n && n >= rank)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+static void hist_print(const char *name, const struct hist *h)
+{
+	printf("%s [us] p50: %.1f p99: %.1f p99.9: %.1f max: %.1f", name,
+	       hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+	       hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+static void lat_print(const struct hist *gap, const struct hist *cb, uint64_t stalls)
+{
+	hist_print("gap", gap);
+	printf(", ");
+	hist_print("callback", cb);
+	printf(", stalls: %" PRIu64, stalls);
+}
+
+static void *lat_reporter(void *arg)
+{
+	unsigned int done;
+
+	pthread_mutex_lock(&lat.lock);
+	while (1) {
+		while (!lat.pending && !lat.stop)
+			pthread_cond_wait(&lat.cond, &lat.lock);
+		if (!lat.pending)
+			break;
+		done = lat.cur ^ 1;
+		pthread_mutex_unlock(&lat.lock);
+
+		lat.stalls_all += lat.stalls[done];
+		hist_merge(&lat.gap_all, &lat.gap[done]);
+		hist_merge(&lat.cb_all, &lat.cb[done]);
+		lat_print(&lat.gap[done], &lat.cb[done], lat.stalls[done]);
+		printf(" (%" PRIu64 " total)\n", lat.stalls_all);
+		memset(&lat.gap[done], 0, sizeof(lat.gap[done]));
+		memset(&lat.cb[done], 0, sizeof(lat.cb[done]));
+		lat.stalls[done] = 0;
+
+		pthread_mutex_lock(&lat.lock);
+		lat.pending = false;
+	}
+	pthread_mutex_unlock(&lat.lock);
+
+	return NULL;
+}
+
+static int lat_start(uint32_t buf_num, uint32_t buf_len)
+{
+	lat.period_ns = (ppm_duration ? ppm_duration : 1) * 1000000000ULL;
+	lat.stall_ns = (uint64_t)buf_num * buf_len * 1000000000ULL / samp_rate;
+	pthread_mutex_init(&lat.lock, NULL);
+	pthread_cond_init(&lat.cond, NULL);
+
+	return pthread_create(&lat.thread, NULL, lat_reporter, NULL);
+}
+
+/* after the read returned, with the rest of the last period */
+static void lat_stop(void)
+{
+	pthread_mutex_lock(&lat.lock);
+	lat.stop = true;
+	pthread_cond_signal(&lat.cond);
+	pthread_mutex_unlock(&lat.lock);
+	pthread_join(lat.thread, NULL);
+
+	lat.stalls_all += lat.stalls[lat.cur];
+	hist_merge(&lat.gap_all, &lat.gap[lat.cur]);
+	hist_merge(&lat.cb_all, &lat.cb[lat.cur]);
+	if (!lat.gap_all.total)
+		return;
+
+	printf("all %" PRIu64 " completions: ", lat.cb_all.total);
+	lat_print(&lat.gap_all, &lat.cb_all, lat.stalls_all);
+	printf("\n");
+}
+
+/* hand the current set to the reporter, unless it is still busy with
+ * the other one, then the period is extended */
+static void lat_switch(void)
+{
+	pthread_mutex_lock(&lat.lock);
+	if (!lat.pending) {
+		lat.cur ^= 1;
+		lat.pending = true;
+		pthread_cond_signal(&lat.cond);
+	}
+	pthread_mutex_unlock(&lat.lock);
+}
+
 static void fx2adc_callback(unsigned char *buf, uint32_t len, void *ctx)
 {
-	//printf("callback!\n");
+	uint64_t now = time_ns(), gap;
+	unsigned int cur = lat.cur;
+
+	if (lat.last_ns) {
+		gap = now - lat.last_ns;
+		hist_add(&lat.gap[cur], gap);
+		if (gap >= lat.stall_ns)
+			lat.stalls[cur]++;
+	} else {
+		lat.next_ns = now + lat.period_ns;
+	}
+	lat.last_ns = now;
+
 	ppm_test(len);
+
+	hist_add(&lat.cb[cur], time_ns() - now);
+
+	if (now >= lat.next_ns) {
+		lat.next_ns += lat.period_ns;
+		lat_switch();
+	}
 }
 
 int main(int argc, char **argv)
@@ -232,8 +968,13 @@ int main(int argc, char **argv)
 	uint32_t out_block_size = DEFAULT_BUF_LENGTH;
 	int count;
 	bool use_ext_clk = false;
+	bool sweep_mode = false;
+	const char *sweep_nums = NULL, *sweep_lens = NULL;
+	const char *sweep_rates = NULL, *sweep_ext = NULL, *sweep_file = NULL;
+	bool probe_mode = false;
+	const char *probe_ramp = PROBE_RAMP;
 
-	while ((opt = getopt(argc, argv, "d:s:p:he")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:p:heSN:b:r:E:t:J:PR:")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = (uint32_t)atoi(optarg);
@@ -248,6 +989,33 @@ int main(int argc, char **argv)
 			if (optarg)
 				ppm_duration = atoi(optarg);
 			break;
+		case 'S':
+			sweep_mode = true;
+			break;
+		case 'N':
+			sweep_nums = optarg;
+			break;
+		case 'b':
+			sweep_lens = optarg;
+			break;
+		case 'r':
+			sweep_rates = optarg;
+			break;
+		case 'E':
+			sweep_ext = optarg;
+			break;
+		case 't':
+			sweep.duration = (unsigned int)atoi(optarg);
+			break;
+		case 'J':
+			sweep_file = optarg;
+			break;
+		case 'P':
+			probe_mode = true;
+			break;
+		case 'R':
+			probe_ramp = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -278,6 +1046,29 @@ int main(int argc, char **argv)
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
 #endif
 
+	if (!sweep.duration)
+		sweep.duration = 1;
+
+	if (probe_mode) {
+		r = probe_main(probe_ramp, sweep_nums ? sweep_nums : PROBE_BUF_NUM,
+			       sweep_lens ? sweep_lens : PROBE_BUF_LENGTH);
+		goto exit;
+	}
+
+	if (sweep_mode) {
+#ifndef _WIN32
+		sigact.sa_handler = sweep_timeout;
+		sigaction(SIGALRM, &sigact, NULL);
+#endif
+		/* without -r, only the external rates if there are any */
+		if (!sweep_rates && !sweep_ext)
+			sweep_rates = SWEEP_RATES;
+		r = sweep_main(sweep_nums ? sweep_nums : SWEEP_BUF_NUMS,
+			       sweep_lens ? sweep_lens : SWEEP_BUF_LENGTHS,
+			       sweep_rates, sweep_ext, sweep_file);
+		goto exit;
+	}
+
 	/* Set the sample rate */
 	r = fx2adc_set_sample_rate(dev, samp_rate, use_ext_clk);
 	if (r < 0)
@@ -289,8 +1080,15 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Reporting PPM error measurement every %u seconds...\n", ppm_duration);
 	fprintf(stderr, "Press ^C after a few minutes.\n");
 
+	if (lat_start(DEFAULT_BUF_NUMBER, out_block_size)) {
+		fprintf(stderr, "Failed to start the reporter thread\n");
+		r = -1;
+		goto exit;
+	}
+
 	r = fx2adc_read(dev, fx2adc_callback, NULL,
-			      0, out_block_size);
+			      DEFAULT_BUF_NUMBER, out_block_size);
+	lat_stop();
 
 	if (do_exit)
 		fprintf(stderr, "\nUser cancel, exiting...\n");
@@ -189,12 +189,15 @@ struct fx2adc_dev {
 
 	uint32_t rate; /* Hz */
 	uint32_t vdiv; /* mV */
+	int channels;
 
 	/* status */
 	bool clockgen_present;
+	bool ext_clock;		/* the FX2 was switched to the external clock */
 	int dev_lost;
 	int driver_active;
 	unsigned int xfer_errors;
+	fx2adc_xfer_stats_t stats;
 	char manufact[256];
 	char product[256];
 };
@@ -422,7 +425,7 @@ int fx2adc_set_vdiv(fx2adc_dev_t *dev, int channel, int vdiv)
 			vdiv, closest_result);
 	}
 
-	dev->vdiv = millivolts;
+	dev->vdiv = closest_result;
 
 	return fx2adc_write_control(dev, cmd, vdiv_reg[closest_index]);
 }
@@ -437,7 +440,7 @@ int fx2adc_get_vdiv(fx2adc_dev_t *dev)
 
 int fx2adc_set_sample_rate(fx2adc_dev_t *dev, uint32_t samp_rate, bool ext_clock)
 {
-	int r = 0;
+	int r = 0, ret;
 	const uint64_t samplerate_values[] = {SAMPLERATE_VALUES};
 	const uint8_t samplerate_regs[] = {SAMPLERATE_REGS};
 	uint32_t i;
@@ -453,11 +456,24 @@ int fx2adc_set_sample_rate(fx2adc_dev_t *dev, uint32_t samp_rate, bool ext_clock
 			si5351_SetupCLK0(samp_rate, SI5351_DRIVE_STRENGTH_8MA);
 			si5351_EnableOutputs(1);
 		}
-		fx2adc_write_control(dev, USE_EXTERNAL_CLK, 1);
+		r = fx2adc_write_control(dev, USE_EXTERNAL_CLK, 1);
+		if (r < 0)
+			return r;
+		dev->ext_clock = true;
 		r = fx2adc_write_control(dev, SAMPLERATE_REG, 0);
 		dev->rate = samp_rate;
 	} else {
-		//fx2adc_write_control(dev, USE_EXTERNAL_CLK, 0);
+		/* switch back from the external clock, if it was used; the
+		 * internal rate is programmed even if that fails */
+		if (dev->ext_clock) {
+			if (dev->clockgen_present)
+				si5351_EnableOutputs(0);
+			r = fx2adc_write_control(dev, USE_EXTERNAL_CLK, 0);
+			if (r < 0)
+				fprintf(stderr, "Failed to switch back to the internal clock\n");
+			else
+				dev->ext_clock = false;
+		}
 
 		for (i = 0; i < ARRAY_SIZE(samplerate_values); i++) {
 			error = (int32_t)samplerate_values[i] - samp_rate;
@@ -474,7 +490,9 @@ int fx2adc_set_sample_rate(fx2adc_dev_t *dev, uint32_t samp_rate, bool ext_clock
 					samp_rate, samplerate_values[closest_index]);
 		}
 
-		r = fx2adc_write_control(dev, SAMPLERATE_REG, samplerate_regs[closest_index]);
+		ret = fx2adc_write_control(dev, SAMPLERATE_REG, samplerate_regs[closest_index]);
+		if (ret < 0)
+			r = ret;
 		dev->rate = samplerate_values[closest_index];
 	}
 
@@ -489,6 +507,58 @@ uint32_t fx2adc_get_sample_rate(fx2adc_dev_t *dev)
 	return dev->rate;
 }
 
+/* the channel mode can be changed while the event thread streams */
+static inline int channels_get(fx2adc_dev_t *dev)
+{
+#ifdef __GNUC__
+	return __atomic_load_n(&dev->channels, __ATOMIC_RELAXED);
+#else
+	return *(volatile int *)&dev->channels;
+#endif
+}
+
+static inline void channels_set(fx2adc_dev_t *dev, int channels)
+{
+#ifdef __GNUC__
+	__atomic_store_n(&dev->channels, channels, __ATOMIC_RELAXED);
+#else
+	*(volatile int *)&dev->channels = channels;
+#endif
+}
+
+int fx2adc_set_channels(fx2adc_dev_t *dev, int channels)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (channels < 1 || channels > NUM_CHANNELS)
+		return -EINVAL;
+
+	r = fx2adc_write_control(dev, CHANNELS_REG, channels);
+	if (!r)
+		channels_set(dev, channels);
+
+	return r;
+}
+
+int fx2adc_get_channels(fx2adc_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	return channels_get(dev);
+}
+
+int fx2adc_has_clockgen(fx2adc_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	return dev->clockgen_present ? 1 : 0;
+}
+
 static const fx2adc_devinfo_t *find_known_device(uint16_t vid, uint16_t pid, uint16_t prod_ver, bool *configured)
 {
 	unsigned int i;
@@ -657,8 +727,9 @@ void fx2adc_init_hardware(fx2adc_dev_t *dev)
 	int r;
 	uint8_t vdiv_index = dev->devinfo->vdivs_size - 1;
 
-	/* for now, only use one channel */
+	/* single channel by default, see fx2adc_set_channels() */
 	fx2adc_write_control(dev, CHANNELS_REG, 1);
+	dev->channels = 1;
 
 	/* write smallest possible voltage range as default */
 	fx2adc_write_control(dev, VDIV_CH1_REG, vdiv_reg[vdiv_index]);
@@ -898,20 +969,43 @@ static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
 	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
 		if (dev->cb) {
 			if (dev->devinfo->ch1_bitreversed) {
-				//FIXME distinguish between single and dual-channel mode
-
 				/* the Hantek PSO2020 has the ADC data lines of
-				 * channel 1 connected bit-reversed */
-				for (int i = 0; i < xfer->actual_length; i++)
+				 * channel 1 connected bit-reversed, in dual-channel
+				 * mode every other byte is from channel 2 */
+				int step = channels_get(dev) == 2 ? 2 : 1;
+
+				for (int i = 0; i < xfer->actual_length; i += step)
 					xfer->buffer[i] = bitrev(xfer->buffer[i]);
 			}
 
 			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
 		}
 
-		libusb_submit_transfer(xfer); /* resubmit transfer */
+		dev->stats.completed++;
+		dev->stats.bytes += xfer->actual_length;
+		if (xfer->actual_length < xfer->length)
+			dev->stats.short_xfers++;
+
+		if (libusb_submit_transfer(xfer) < 0) /* resubmit transfer */
+			dev->stats.resubmit_failed++;
 		dev->xfer_errors = 0;
 	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
+		switch (xfer->status) {
+		case LIBUSB_TRANSFER_ERROR:
+			dev->stats.errors++;
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			dev->stats.timeouts++;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			dev->stats.stalls++;
+			break;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			dev->stats.overflows++;
+			break;
+		default:
+			break;
+		}
 #ifndef _WIN32
 		if (LIBUSB_TRANSFER_ERROR == xfer->status)
 			dev->xfer_errors++;
@@ -920,6 +1014,7 @@ static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
 		    LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
 #endif
 			dev->dev_lost = 1;
+			dev->stats.dev_lost = true;
 			fx2adc_cancel_async(dev);
 			fprintf(stderr, "cb transfer status: %d, "
 				"canceling...\n", xfer->status);
@@ -1064,6 +1159,7 @@ int fx2adc_read(fx2adc_dev_t *dev, fx2adc_read_cb_t cb, void *ctx,
 
 	dev->async_status = FX2ADC_RUNNING;
 	dev->async_cancel = 0;
+	memset(&dev->stats, 0, sizeof(dev->stats));
 
 	dev->cb = cb;
 	dev->cb_ctx = ctx;
@@ -1162,6 +1258,16 @@ int fx2adc_read(fx2adc_dev_t *dev, fx2adc_read_cb_t cb, void *ctx,
 	return r;
 }
 
+int fx2adc_get_xfer_stats(fx2adc_dev_t *dev, fx2adc_xfer_stats_t *stats)
+{
+	if (!dev || !stats)
+		return -1;
+
+	*stats = dev->stats;
+
+	return 0;
+}
+
 int fx2adc_cancel_async(fx2adc_dev_t *dev)
 {
 	if (!dev)
@@ -0,0 +1,555 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Polyphase resampler for arbitrary output rates
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#include "resample.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TAPS		32	/* per phase, without reducing the rate */
+#define TAPS_MAX	512
+#define CUTOFF		0.45	/* of the lower rate */
+#define KAISER_BETA	7.0
+#define COEF_BITS	14	/* the taps of a phase add up to 1 << COEF_BITS */
+#define MAX_THREADS	16
+#define MIN_SPLIT	16384	/* fewest outputs worth another thread */
+#define BATCH		256	/* outputs stored at once */
+
+/* a range of outputs for one thread */
+struct part {
+	int64_t n;		/* newest input of the first output */
+	unsigned int p;		/* its phase */
+	size_t count;
+	size_t offset;		/* index of the first output in out */
+};
+
+struct resample {
+	uint32_t in_rate;
+	unsigned int up, down;
+	convert_format_t format;
+	unsigned int taps;	/* per phase, a multiple of 8 */
+	int16_t *coefs;		/* up phases of taps, reversed */
+
+	int16_t *buf;		/* input samples - 128, from index base */
+	size_t buf_len, buf_size;
+	int64_t base;
+	uint64_t next_in;	/* index of the next input sample */
+	uint64_t k;		/* index of the next output sample */
+	int64_t n;		/* the newest input it needs */
+	unsigned int p;		/* and its phase, k * down % up */
+
+	/* parts[0] is computed by the calling thread */
+	pthread_t threads[MAX_THREADS];
+	unsigned int num_threads;
+	struct part parts[MAX_THREADS + 1];
+	unsigned int num_parts;
+	void *out;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	unsigned int gen;	/* incremented for every block */
+	unsigned int pending;	/* parts not done yet */
+	bool exit;
+};
+
+static const unsigned int sample_size[CONVERT_NUM_FORMATS] = {
+	[CONVERT_U8] = 1,
+	[CONVERT_S8] = 1,
+	[CONVERT_S16] = 2,
+	[CONVERT_F32] = 4,
+};
+
+static inline int32_t dot(const int16_t *a, const int16_t *b, unsigned int n)
+{
+	unsigned int i;
+#if defined(HAVE_SSE2)
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_load_si128((const __m128i *)(a + i)),
+							   _mm_loadu_si128((const __m128i *)(b + i))));
+		acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_load_si128((const __m128i *)(a + i + 8)),
+							   _mm_loadu_si128((const __m128i *)(b + i + 8))));
+	}
+	for (; i < n; i += 8)
+		acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_load_si128((const __m128i *)(a + i)),
+							   _mm_loadu_si128((const __m128i *)(b + i))));
+
+	acc0 = _mm_add_epi32(acc0, acc1);
+	acc0 = _mm_add_epi32(acc0, _mm_shuffle_epi32(acc0, 0x4e));
+	acc0 = _mm_add_epi32(acc0, _mm_shuffle_epi32(acc0, 0xb1));
+	return _mm_cvtsi128_si32(acc0);
+#elif defined(HAVE_NEON)
+	int32x4_t acc = vdupq_n_s32(0);
+	int32x2_t s;
+
+	for (i = 0; i < n; i += 8) {
+		int16x8_t va = vld1q_s16(a + i), vb = vld1q_s16(b + i);
+
+		acc = vmlal_s16(acc, vget_low_s16(va), vget_low_s16(vb));
+		acc = vmlal_s16(acc, vget_high_s16(va), vget_high_s16(vb));
+	}
+
+	s = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+	return vget_lane_s32(vpadd_s32(s, s), 0);
+#else
+	int32_t acc[4] = { 0, 0, 0, 0 };
+
+	for (i = 0; i < n; i += 4) {
+		acc[0] += a[i] * b[i];
+		acc[1] += a[i + 1] * b[i + 1];
+		acc[2] += a[i + 2] * b[i + 2];
+		acc[3] += a[i + 3] * b[i + 3];
+	}
+
+	return acc[0] + acc[1] + acc[2] + acc[3];
+#endif
+}
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; k < 50; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+
+	return sum;
+}
+
+/* The prototype runs at up times the input rate and is centered on tap
+ * up * taps / 2, so output k, at up-sampled index k * down, gets the
+ * taps p + j * up with p = k * down % up for the inputs n - j, where n is
+ * k * down / up + taps / 2. Every phase is scaled to unity gain at DC. */
+static int design_filter(resample_t *rs)
+{
+	unsigned int taps = rs->taps, up = rs->up, p, j, c;
+	double fc = CUTOFF * (rs->up < rs->down ? (double)rs->up / rs->down : 1.0);
+	double *h, t, sum;
+	int32_t q, qsum;
+	unsigned int big;
+
+	h = malloc(taps * sizeof(double));
+	if (!h)
+		return -1;
+
+	c = up * taps / 2;
+	for (p = 0; p < up; p++) {
+		sum = 0;
+		for (j = 0; j < taps; j++) {
+			double m = (double)p + (double)j * up - c;
+
+			t = m / up;
+			h[j] = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+			h[j] *= bessel_i0(KAISER_BETA * sqrt(fmax(0, 1 - (m / c) * (m / c)))) /
+				bessel_i0(KAISER_BETA);
+			sum += h[j];
+		}
+
+		/* the rounding error goes to the largest tap */
+		qsum = 0;
+		big = 0;
+		for (j = 0; j < taps; j++) {
+			q = (int32_t)lrint(h[j] / sum * (1 << COEF_BITS));
+			rs->coefs[p * taps + taps - 1 - j] = (int16_t)q;
+			qsum += q;
+			if (fabs(h[j]) > fabs(h[big]))
+				big = j;
+		}
+		rs->coefs[p * taps + taps - 1 - big] += (int16_t)((1 << COEF_BITS) - qsum);
+	}
+
+	free(h);
+
+	return 0;
+}
+
+/* closest fraction up / down to x with up <= RESAMPLE_MAX_PHASES, from
+ * the convergents of its continued fraction */
+static void approximate(double x, unsigned int *up, unsigned int *down)
+{
+	double h0 = 0, h1 = 1, k0 = 1, k1 = 0, h, k, a, r = x;
+	int i;
+
+	*up = 1;
+	*down = (unsigned int)lrint(1 / x);
+	if (!*down)
+		*down = 1;
+
+	for (i = 0; i < 32; i++) {
+		a = floor(r);
+		h = a * h1 + h0;
+		k = a * k1 + k0;
+		if (h > RESAMPLE_MAX_PHASES || k > UINT32_MAX / RESAMPLE_MAX_PHASES)
+			break;
+		if (h >= 1) {
+			*up = (unsigned int)h;
+			*down = (unsigned int)k;
+		}
+		if (r - a < 1e-12 || fabs(h / k - x) < 1e-15 * x)
+			break;
+		h0 = h1; h1 = h;
+		k0 = k1; k1 = k;
+		r = 1 / (r - a);
+	}
+}
+
+static void *worker(void *arg);
+
+resample_t *resample_new(uint32_t in_rate, double out_rate, convert_format_t format,
+			 unsigned int threads)
+{
+	resample_t *rs;
+	uint64_t g, a, b;
+	unsigned int i;
+	bool exact = false;
+
+	if (!in_rate || out_rate < 1 || format > CONVERT_F32 ||
+	    out_rate / in_rate > RESAMPLE_MAX_PHASES ||
+	    in_rate / out_rate > CONVERT_MAX_DECIMATION)
+		return NULL;
+
+	rs = calloc(1, sizeof(*rs));
+	if (!rs)
+		return NULL;
+
+	rs->in_rate = in_rate;
+	rs->format = format;
+	rs->next_in = UINT64_MAX;
+
+	/* exact if both rates are whole, otherwise the closest fraction */
+	if (out_rate == floor(out_rate)) {
+		a = (uint64_t)out_rate;
+		b = in_rate;
+		while (b) {
+			g = a % b;
+			a = b;
+			b = g;
+		}
+		if ((uint64_t)out_rate / a <= RESAMPLE_MAX_PHASES) {
+			rs->up = (unsigned int)((uint64_t)out_rate / a);
+			rs->down = (unsigned int)(in_rate / a);
+			exact = true;
+		}
+	}
+	if (!exact)
+		approximate(out_rate / in_rate, &rs->up, &rs->down);
+
+	/* the same transition band relative to the lower rate */
+	rs->taps = TAPS;
+	if (rs->down > rs->up)
+		rs->taps = (unsigned int)((uint64_t)TAPS * rs->down / rs->up + 7) & ~7u;
+	if (rs->taps > TAPS_MAX)
+		rs->taps = TAPS_MAX;
+
+#ifdef _WIN32
+	rs->coefs = _aligned_malloc((size_t)rs->up * rs->taps * sizeof(int16_t), 16);
+#else
+	if (posix_memalign((void **)&rs->coefs, 16, (size_t)rs->up * rs->taps * sizeof(int16_t)))
+		rs->coefs = NULL;
+#endif
+	if (!rs->coefs || design_filter(rs)) {
+		resample_free(rs);
+		return NULL;
+	}
+
+	pthread_mutex_init(&rs->lock, NULL);
+	pthread_cond_init(&rs->work, NULL);
+	pthread_cond_init(&rs->done, NULL);
+
+	if (threads > MAX_THREADS + 1)
+		threads = MAX_THREADS + 1;
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&rs->threads[rs->num_threads], NULL, worker, rs))
+			break;
+		rs->num_threads++;
+	}
+
+	return rs;
+}
+
+void resample_free(resample_t *rs)
+{
+	unsigned int i;
+
+	if (!rs)
+		return;
+
+	if (rs->num_threads) {
+		pthread_mutex_lock(&rs->lock);
+		rs->exit = true;
+		pthread_cond_broadcast(&rs->work);
+		pthread_mutex_unlock(&rs->lock);
+		for (i = 0; i < rs->num_threads; i++)
+			pthread_join(rs->threads[i], NULL);
+	}
+
+	if (rs->coefs) {
+		pthread_mutex_destroy(&rs->lock);
+		pthread_cond_destroy(&rs->work);
+		pthread_cond_destroy(&rs->done);
+	}
+
+#ifdef _WIN32
+	_aligned_free(rs->coefs);
+#else
+	free(rs->coefs);
+#endif
+	free(rs->buf);
+	free(rs);
+}
+
+double resample_rate(resample_t *rs)
+{
+	return (double)rs->in_rate * rs->up / rs->down;
+}
+
+void resample_ratio(resample_t *rs, unsigned int *up, unsigned int *down)
+{
+	*up = rs->up;
+	*down = rs->down;
+}
+
+size_t resample_max_out(resample_t *rs, size_t len)
+{
+	return ((uint64_t)len * rs->up / rs->down + 1) * sample_size[rs->format];
+}
+
+static void store(resample_t *rs, void *out, size_t k, const int32_t *acc, size_t count)
+{
+	const int32_t round = 1 << (COEF_BITS - 1);
+	uint8_t *o8 = (uint8_t *)out + k * sample_size[rs->format];
+	float *of = (float *)out + k;
+	size_t i;
+	int32_t v;
+
+	switch (rs->format) {
+	case CONVERT_U8:
+		for (i = 0; i < count; i++) {
+			v = ((acc[i] + round) >> COEF_BITS) + 128;
+			o8[i] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+		}
+		break;
+	case CONVERT_S8:
+		for (i = 0; i < count; i++) {
+			v = (acc[i] + round) >> COEF_BITS;
+			o8[i] = (uint8_t)(int8_t)(v < -128 ? -128 : (v > 127 ? 127 : v));
+		}
+		break;
+	case CONVERT_S16:
+		/* 8 more bits than the input, little endian on any host */
+		for (i = 0; i < count; i++) {
+			v = (acc[i] + (1 << (COEF_BITS - 9))) >> (COEF_BITS - 8);
+			v = v < -32768 ? -32768 : (v > 32767 ? 32767 : v);
+			o8[2 * i] = v & 0xff;
+			o8[2 * i + 1] = (v >> 8) & 0xff;
+		}
+		break;
+	case CONVERT_F32:
+		for (i = 0; i < count; i++)
+			of[i] = acc[i] * (1.0f / (128 << COEF_BITS));
+		break;
+	default:
+		break;
+	}
+}
+
+static void run_part(resample_t *rs, const struct part *pt)
+{
+	const unsigned int taps = rs->taps, up = rs->up;
+	const unsigned int step = rs->down / up, rest = rs->down % up;
+	int32_t acc[BATCH];
+	unsigned int p = pt->p;
+	size_t n = (size_t)(pt->n - rs->base) - (taps - 1);	/* oldest input */
+	size_t done, i, m;
+
+	for (done = 0; done < pt->count; done += m) {
+		m = pt->count - done < BATCH ? pt->count - done : BATCH;
+
+		for (i = 0; i < m; i++) {
+			acc[i] = dot(rs->coefs + (size_t)p * taps, rs->buf + n, taps);
+			n += step;
+			p += rest;
+			if (p >= up) {
+				p -= up;
+				n++;
+			}
+		}
+
+		store(rs, rs->out, pt->offset + done, acc, m);
+	}
+}
+
+static void *worker(void *arg)
+{
+	resample_t *rs = arg;
+	unsigned int gen = 0, i;
+
+	pthread_mutex_lock(&rs->lock);
+	while (1) {
+		while (!rs->exit && rs->gen == gen)
+			pthread_cond_wait(&rs->work, &rs->lock);
+		if (rs->exit)
+			break;
+		gen = rs->gen;
+
+		/* the parts beyond 0 go to whoever comes first */
+		while (rs->num_parts > 1) {
+			i = --rs->num_parts;
+			pthread_mutex_unlock(&rs->lock);
+			run_part(rs, &rs->parts[i]);
+			pthread_mutex_lock(&rs->lock);
+			if (!--rs->pending)
+				pthread_cond_signal(&rs->done);
+		}
+	}
+	pthread_mutex_unlock(&rs->lock);
+
+	return NULL;
+}
+
+/* output k is taken at input k * down / up, it needs inputs up to n and
+ * the taps - 1 before */
+static void seek(resample_t *rs, uint64_t k)
+{
+	uint64_t t = k * rs->down;
+
+	rs->k = k;
+	rs->n = (int64_t)(t / rs->up) + rs->taps / 2;
+	rs->p = (unsigned int)(t % rs->up);
+}
+
+size_t resample_run(resample_t *rs, const uint8_t *in, size_t len, uint64_t first,
+		    void *out, uint64_t *out_sample)
+{
+	const unsigned int taps = rs->taps;
+	int64_t end, keep;
+	uint64_t count, r0, t;
+	unsigned int i, parts;
+	int16_t *buf;
+	size_t size;
+
+	/* gap in the input, start over with the first output that has all
+	 * of its inputs, like convert_run() does */
+	if (first != rs->next_in) {
+		seek(rs, ((first + taps / 2) * rs->up + rs->down - 1) / rs->down);
+		rs->base = (int64_t)first;
+		rs->buf_len = 0;
+	}
+	rs->next_in = first + len;
+
+	if (rs->buf_len + len > rs->buf_size) {
+		size = rs->buf_len + len;
+		buf = realloc(rs->buf, size * sizeof(int16_t));
+		if (!buf) {
+			rs->next_in = UINT64_MAX;
+			*out_sample = rs->k;
+			return 0;
+		}
+		rs->buf = buf;
+		rs->buf_size = size;
+	}
+
+	buf = rs->buf + rs->buf_len;
+	for (size = 0; size < len; size++)
+		buf[size] = (int16_t)(in[size] - 128);
+	rs->buf_len += len;
+	end = rs->base + (int64_t)rs->buf_len;
+
+	/* outputs with n + (p + r * down) / up < end */
+	count = 0;
+	if (rs->n < end)
+		count = ((uint64_t)(end - rs->n) * rs->up - rs->p + rs->down - 1) / rs->down;
+
+	parts = 1;
+	if (rs->num_threads && count >= 2 * MIN_SPLIT) {
+		parts = (unsigned int)(count / MIN_SPLIT);
+		if (parts > rs->num_threads + 1)
+			parts = rs->num_threads + 1;
+	}
+
+	for (i = 0; i < parts; i++) {
+		r0 = count * i / parts;
+		t = rs->p + r0 * rs->down;
+		rs->parts[i].n = rs->n + (int64_t)(t / rs->up);
+		rs->parts[i].p = (unsigned int)(t % rs->up);
+		rs->parts[i].offset = r0;
+		rs->parts[i].count = count * (i + 1) / parts - r0;
+	}
+	rs->out = out;
+
+	if (parts > 1) {
+		pthread_mutex_lock(&rs->lock);
+		rs->num_parts = parts;
+		rs->pending = parts - 1;
+		rs->gen++;
+		pthread_cond_broadcast(&rs->work);
+		pthread_mutex_unlock(&rs->lock);
+	}
+
+	run_part(rs, &rs->parts[0]);
+
+	if (parts > 1) {
+		pthread_mutex_lock(&rs->lock);
+		while (rs->pending)
+			pthread_cond_wait(&rs->done, &rs->lock);
+		pthread_mutex_unlock(&rs->lock);
+	}
+
+	*out_sample = rs->k;
+	t = rs->p + count * rs->down;
+	rs->k += count;
+	rs->n += (int64_t)(t / rs->up);
+	rs->p = (unsigned int)(t % rs->up);
+
+	/* keep what the next output needs */
+	keep = rs->n - (taps - 1);
+	if (keep > end)
+		keep = end;
+	if (keep > rs->base) {
+		memmove(rs->buf, rs->buf + (keep - rs->base),
+			(size_t)(end - keep) * sizeof(int16_t));
+		rs->buf_len = (size_t)(end - keep);
+		rs->base = keep;
+	}
+
+	return (size_t)count * sample_size[rs->format];
+}
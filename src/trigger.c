@@ -0,0 +1,156 @@
+/*
+ * fx2adc - acquire data from Cypress FX2 + AD9288 based USB scopes
+ *
+ * Level and edge triggers on the sample data
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "trigger.h"
+
+#ifdef HAVE_SSE2
+#ifdef _MSC_VER
+static inline unsigned int lowest_bit(uint32_t v)
+{
+	unsigned long i;
+
+	_BitScanForward(&i, v);
+	return i;
+}
+
+static inline unsigned int highest_bit(uint32_t v)
+{
+	unsigned long i;
+
+	_BitScanReverse(&i, v);
+	return i;
+}
+#else
+#define lowest_bit(v)	((unsigned int)__builtin_ctz(v))
+#define highest_bit(v)	(31 - (unsigned int)__builtin_clz(v))
+#endif
+#endif
+
+static inline bool match(trigger_type_t type, unsigned int level, uint8_t prev,
+			 uint8_t x)
+{
+	switch (type) {
+	case TRIGGER_LEVEL:
+		return x >= 128 + level || x <= 128 - level;
+	case TRIGGER_RISING:
+		return prev < level && x >= level;
+	default:
+		return prev >= level && x < level;
+	}
+}
+
+bool trigger_scan(trigger_type_t type, unsigned int level, const uint8_t *buf,
+		  size_t len, uint8_t prev, size_t *first, size_t *last)
+{
+	bool found = false;
+	size_t i = 0;
+
+	if (!len)
+		return false;
+
+	/* the vector loops compare every sample with the one before */
+	if (match(type, level, prev, buf[0])) {
+		*first = *last = 0;
+		found = true;
+	}
+	i = 1;
+
+#if defined(HAVE_SSE2)
+	{
+		__m128i hi = _mm_set1_epi8((char)(128 + level));
+		__m128i lo = _mm_set1_epi8((char)(128 - level));
+		__m128i lv = _mm_set1_epi8((char)level);
+		__m128i x, p, ge, pge, m;
+		uint32_t mask;
+
+		for (; i + 16 <= len; i += 16) {
+			x = _mm_loadu_si128((const __m128i *)(buf + i));
+			if (type == TRIGGER_LEVEL) {
+				m = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(x, hi), x),
+						 _mm_cmpeq_epi8(_mm_min_epu8(x, lo), x));
+			} else {
+				p = _mm_loadu_si128((const __m128i *)(buf + i - 1));
+				ge = _mm_cmpeq_epi8(_mm_max_epu8(x, lv), x);
+				pge = _mm_cmpeq_epi8(_mm_max_epu8(p, lv), p);
+				m = type == TRIGGER_RISING ? _mm_andnot_si128(pge, ge) :
+							     _mm_andnot_si128(ge, pge);
+			}
+			mask = (uint32_t)_mm_movemask_epi8(m);
+			if (!mask)
+				continue;
+			if (!found)
+				*first = i + lowest_bit(mask);
+			*last = i + highest_bit(mask);
+			found = true;
+		}
+	}
+#elif defined(HAVE_NEON)
+	{
+		uint8x16_t hi = vdupq_n_u8(128 + level);
+		uint8x16_t lo = vdupq_n_u8(128 - level);
+		uint8x16_t lv = vdupq_n_u8(level);
+		uint8x16_t x, p, m;
+		uint64_t mask;
+
+		for (; i + 16 <= len; i += 16) {
+			x = vld1q_u8(buf + i);
+			if (type == TRIGGER_LEVEL) {
+				m = vorrq_u8(vcgeq_u8(x, hi), vcleq_u8(x, lo));
+			} else {
+				p = vld1q_u8(buf + i - 1);
+				m = type == TRIGGER_RISING ? vandq_u8(vcltq_u8(p, lv), vcgeq_u8(x, lv)) :
+							     vandq_u8(vcgeq_u8(p, lv), vcltq_u8(x, lv));
+			}
+			/* four bits per sample */
+			mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+			if (!mask)
+				continue;
+			if (!found)
+				*first = i + __builtin_ctzll(mask) / 4;
+			*last = i + (63 - __builtin_clzll(mask)) / 4;
+			found = true;
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (!match(type, level, buf[i - 1], buf[i]))
+			continue;
+		if (!found)
+			*first = i;
+		*last = i;
+		found = true;
+	}
+
+	return found;
+}